@@ -0,0 +1,315 @@
+#include "postgres.h"
+#include "storage/fd.h"
+
+#include "blockindex.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/*
+ * Block index
+ * -----------
+ *
+ * Optional sidecar file (`<filename>.idx`) mapping the values of the columns
+ * listed in `index_columns` to the blocks containing them. Unlike Bloom
+ * filters, which still have to be checked for every block of the file, the
+ * index gives the list of blocks straight away, so an equality lookup costs
+ * a few reads no matter how large the file is.
+ *
+ * The file starts with a header followed by an array of bucket heads per
+ * column. Values are hashed the same way as for Bloom filters, the hash picks
+ * the bucket. Each flushed block appends an entry per distinct value hash to
+ * the chain of its bucket; lookups follow the chain and collect the blocks of
+ * the entries with the same hash. Blocks may be listed more than once if they
+ * were appended to by several statements.
+ *
+ * New entries are appended as blocks get flushed, bucket heads and the header
+ * are only written when the storage is released. The header records the
+ * storage file state it corresponds to; an index which doesn't match the
+ * storage file (e.g. written before a crash, or not updated by a writer that
+ * didn't have the option set) is ignored by readers and rebuilt by the next
+ * writer.
+ */
+
+#define HEADS_PER_PAGE  (BLCKSZ / sizeof(uint64))
+
+#define HeadsSize(idx) \
+    ((Size) (idx)->header.ncolumns * (idx)->header.nbuckets * sizeof(uint64))
+#define HeadOffset(idx, column, bucket) \
+    (BlockIndexHeaderSize + \
+     ((Size) (column) * (idx)->header.nbuckets + (bucket)) * sizeof(uint64))
+#define EntriesOffset(idx) (BlockIndexHeaderSize + HeadsSize(idx))
+
+
+static void
+index_seek(BlockIndex *idx, Size pos)
+{
+    if (fseek(idx->file, pos, SEEK_SET) != 0)
+        elog(ERROR, "tuple_fdw: fseek failed on index '%s'", idx->filename);
+}
+
+static void
+index_write(BlockIndex *idx, const void *ptr, Size size)
+{
+    if (fwrite(ptr, 1, size, idx->file) != size)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot write index '%s': %s", idx->filename, err);
+    }
+}
+
+static void
+index_read(BlockIndex *idx, Size pos, void *ptr, Size size)
+{
+    if (pread(fileno(idx->file), ptr, size, pos) != (ssize_t) size)
+        elog(ERROR, "tuple_fdw: index '%s' is truncated", idx->filename);
+}
+
+static bool
+header_is_valid(BlockIndexHeader *header)
+{
+    return header->magic == BLOCK_INDEX_MAGIC
+        && header->version == BLOCK_INDEX_VERSION
+        && header->nbuckets > 0
+        && (header->nbuckets & (header->nbuckets - 1)) == 0
+        && header->ncolumns <= BLOCK_INDEX_MAX_COLUMNS;
+}
+
+/*
+ * Open the index. Readers get NULL if there is no valid index. Writers create
+ * the file if needed; the index has to be (re)created with
+ * `block_index_create` unless the header is valid.
+ */
+BlockIndex *
+block_index_open(const char *filename, bool readonly)
+{
+    BlockIndex *idx;
+    FILE       *file;
+    bool        valid;
+
+    file = AllocateFile(filename, readonly ? "r" : "r+");
+    if (file == NULL && !readonly && errno == ENOENT)
+        file = AllocateFile(filename, "w+");
+    if (file == NULL)
+    {
+        const char *err = strerror(errno);
+
+        if (readonly && errno == ENOENT)
+            return NULL;
+        elog(ERROR, "tuple_fdw: cannot open index '%s': %s", filename, err);
+    }
+
+    idx = palloc0(sizeof(BlockIndex));
+    idx->filename = pstrdup(filename);
+    idx->file = file;
+    idx->readonly = readonly;
+
+    valid = fread(&idx->header, 1, sizeof(BlockIndexHeader), file) == sizeof(BlockIndexHeader)
+        && header_is_valid(&idx->header);
+
+    if (!valid)
+    {
+        if (readonly)
+        {
+            block_index_close(idx);
+            return NULL;
+        }
+        memset(&idx->header, 0, sizeof(BlockIndexHeader));
+        return idx;
+    }
+
+    /* writers update the heads in memory */
+    if (!readonly)
+    {
+        struct stat buf;
+
+        idx->heads = palloc(HeadsSize(idx));
+        idx->dirty = palloc0(HeadsSize(idx) / BLCKSZ + 1);
+        index_read(idx, BlockIndexHeaderSize, idx->heads, HeadsSize(idx));
+
+        if (fstat(fileno(file), &buf) != 0)
+            elog(ERROR, "tuple_fdw: cannot get status of index '%s'", filename);
+        idx->end = Max((Size) buf.st_size, EntriesOffset(idx));
+    }
+
+    return idx;
+}
+
+/* Start over with an empty index of the columns */
+void
+block_index_create(BlockIndex *idx, int ncolumns, const AttrNumber *attnums)
+{
+    int     i;
+
+    Assert(!idx->readonly);
+
+    if (ncolumns > BLOCK_INDEX_MAX_COLUMNS)
+        elog(ERROR, "tuple_fdw: cannot index more than %d columns",
+             BLOCK_INDEX_MAX_COLUMNS);
+
+    if (ftruncate(fileno(idx->file), 0) != 0)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot truncate index '%s': %s", idx->filename, err);
+    }
+
+    memset(&idx->header, 0, sizeof(BlockIndexHeader));
+    idx->header.magic = BLOCK_INDEX_MAGIC;
+    idx->header.version = BLOCK_INDEX_VERSION;
+    idx->header.nbuckets = BLOCK_INDEX_NBUCKETS;
+    idx->header.ncolumns = ncolumns;
+    for (i = 0; i < ncolumns; i++)
+        idx->header.attnums[i] = attnums[i];
+
+    if (idx->heads)
+        pfree(idx->heads);
+    if (idx->dirty)
+        pfree(idx->dirty);
+    idx->heads = palloc0(HeadsSize(idx));
+    idx->dirty = palloc(HeadsSize(idx) / BLCKSZ + 1);
+    memset(idx->dirty, true, HeadsSize(idx) / BLCKSZ + 1);
+    idx->end = EntriesOffset(idx);
+}
+
+/* Position of the column in the index or -1 */
+int
+block_index_column(BlockIndex *idx, AttrNumber attnum)
+{
+    int     i;
+
+    for (i = 0; i < idx->header.ncolumns; i++)
+        if (idx->header.attnums[i] == attnum)
+            return i;
+
+    return -1;
+}
+
+bool
+block_index_is_current(BlockIndex *idx, Size last_block_offset, uint64 ntuples)
+{
+    return header_is_valid(&idx->header)
+        && idx->header.last_block_offset == last_block_offset
+        && idx->header.ntuples == ntuples;
+}
+
+/* Add the block to the posting lists of the distinct value hashes */
+void
+block_index_add(BlockIndex *idx, int column, Size block_offset,
+                const uint32 *hashes, int nhashes)
+{
+    BlockIndexEntry *entries;
+    int     i;
+
+    Assert(!idx->readonly && idx->heads != NULL);
+
+    if (nhashes == 0)
+        return;
+
+    entries = palloc0(sizeof(BlockIndexEntry) * nhashes);
+    for (i = 0; i < nhashes; i++)
+    {
+        uint32  bucket = hashes[i] & (idx->header.nbuckets - 1);
+        Size    slot = (Size) column * idx->header.nbuckets + bucket;
+
+        entries[i].prev = idx->heads[slot];
+        entries[i].block_offset = block_offset;
+        entries[i].hash = hashes[i];
+
+        idx->heads[slot] = idx->end + sizeof(BlockIndexEntry) * i;
+        idx->dirty[slot / HEADS_PER_PAGE] = true;
+    }
+
+    index_seek(idx, idx->end);
+    index_write(idx, entries, sizeof(BlockIndexEntry) * nhashes);
+    idx->end += sizeof(BlockIndexEntry) * nhashes;
+
+    pfree(entries);
+}
+
+/*
+ * Write out changed bucket heads and the header stating that the index now
+ * matches the storage file.
+ */
+void
+block_index_sync(BlockIndex *idx, Size last_block_offset, uint64 ntuples)
+{
+    Size    npages = (HeadsSize(idx) + BLCKSZ - 1) / BLCKSZ;
+    Size    i;
+
+    Assert(!idx->readonly);
+
+    /* entries and heads have to reach the disk before the header */
+    for (i = 0; i < npages; i++)
+    {
+        Size    size = Min(BLCKSZ, HeadsSize(idx) - i * BLCKSZ);
+
+        if (!idx->dirty[i])
+            continue;
+
+        index_seek(idx, BlockIndexHeaderSize + i * BLCKSZ);
+        index_write(idx, (char *) idx->heads + i * BLCKSZ, size);
+        idx->dirty[i] = false;
+    }
+    if (fflush(idx->file) != 0 || fsync(fileno(idx->file)) != 0)
+        elog(ERROR, "tuple_fdw: cannot sync index '%s'", idx->filename);
+
+    idx->header.last_block_offset = last_block_offset;
+    idx->header.ntuples = ntuples;
+    index_seek(idx, 0);
+    index_write(idx, &idx->header, sizeof(BlockIndexHeader));
+    if (fflush(idx->file) != 0 || fsync(fileno(idx->file)) != 0)
+        elog(ERROR, "tuple_fdw: cannot sync index '%s'", idx->filename);
+}
+
+/*
+ * Append offsets of the blocks which may contain values with the hash to the
+ * `offsets` array (allocated by the caller, grown as needed).
+ */
+void
+block_index_lookup(BlockIndex *idx, int column, uint32 hash,
+                   Size **offsets, int *noffsets, int *capacity)
+{
+    uint32  bucket = hash & (idx->header.nbuckets - 1);
+    uint64  pos;
+
+    index_read(idx, HeadOffset(idx, column, bucket), &pos, sizeof(uint64));
+
+    while (pos != 0)
+    {
+        BlockIndexEntry entry;
+
+        index_read(idx, pos, &entry, sizeof(BlockIndexEntry));
+
+        /* entries only ever point back */
+        if (entry.prev >= pos || (entry.prev != 0 && entry.prev < EntriesOffset(idx)))
+            elog(ERROR, "tuple_fdw: index '%s' is corrupted", idx->filename);
+
+        if (entry.hash == hash)
+        {
+            if (*noffsets >= *capacity)
+            {
+                *capacity = *capacity > 0 ? *capacity * 2 : 64;
+                *offsets = *offsets ?
+                    repalloc(*offsets, sizeof(Size) * *capacity) :
+                    palloc(sizeof(Size) * *capacity);
+            }
+            (*offsets)[(*noffsets)++] = entry.block_offset;
+        }
+        pos = entry.prev;
+    }
+}
+
+void
+block_index_close(BlockIndex *idx)
+{
+    FreeFile(idx->file);
+    if (idx->heads)
+        pfree(idx->heads);
+    if (idx->dirty)
+        pfree(idx->dirty);
+    pfree(idx->filename);
+    pfree(idx);
+}
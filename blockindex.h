@@ -0,0 +1,66 @@
+#ifndef TUPLE_BLOCKINDEX_H
+#define TUPLE_BLOCKINDEX_H
+
+#include "access/attnum.h"
+
+#include <stdio.h>
+
+
+#define BLOCK_INDEX_MAGIC       0x58495054  /* "TPIX" */
+#define BLOCK_INDEX_VERSION     1
+#define BLOCK_INDEX_NBUCKETS    65536       /* per column, power of two */
+#define BLOCK_INDEX_MAX_COLUMNS 32
+
+typedef struct
+{
+    uint32  magic;
+    uint32  version;
+    uint32  nbuckets;
+    uint32  ncolumns;
+
+    /* storage file state the index is consistent with */
+    uint64  last_block_offset;
+    uint64  ntuples;
+
+    int16   attnums[BLOCK_INDEX_MAX_COLUMNS];
+} BlockIndexHeader;
+
+/* Space reserved for the header; bucket heads follow it */
+#define BlockIndexHeaderSize 4096
+
+/*
+ * Posting list entry: a block contains a value with the given hash. Entries
+ * of a bucket are chained from the most recently added one backwards.
+ */
+typedef struct
+{
+    uint64  prev;           /* offset of the previous entry or 0 */
+    uint64  block_offset;
+    uint32  hash;
+    uint32  pad;
+} BlockIndexEntry;
+
+typedef struct
+{
+    char       *filename;
+    FILE       *file;
+    bool        readonly;
+    BlockIndexHeader header;
+    uint64     *heads;      /* writer only: `ncolumns * nbuckets` heads */
+    bool       *dirty;      /* ...and which pages of them were changed */
+    Size        end;        /* writer only: where the next entry goes */
+} BlockIndex;
+
+
+BlockIndex *block_index_open(const char *filename, bool readonly);
+void block_index_create(BlockIndex *idx, int ncolumns, const AttrNumber *attnums);
+int block_index_column(BlockIndex *idx, AttrNumber attnum);
+bool block_index_is_current(BlockIndex *idx, Size last_block_offset, uint64 ntuples);
+void block_index_add(BlockIndex *idx, int column, Size block_offset,
+                     const uint32 *hashes, int nhashes);
+void block_index_sync(BlockIndex *idx, Size last_block_offset, uint64 ntuples);
+void block_index_lookup(BlockIndex *idx, int column, uint32 hash,
+                        Size **offsets, int *noffsets, int *capacity);
+void block_index_close(BlockIndex *idx);
+
+#endif /* TUPLE_BLOCKINDEX_H */
@@ -0,0 +1,268 @@
+#include "postgres.h"
+
+#include "storage.h"
+#include "blockwriter.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+
+/*
+ * Background compression
+ * ----------------------
+ *
+ * With `async_compression` full blocks aren't compressed and written by the
+ * inserting backend itself. Instead the backend serializes the block
+ * metadata, copies the block into a free slot of a small ring of jobs and
+ * goes on filling the next block while background threads compress the
+ * queued ones (`compression_workers` of them, each taking the next queued
+ * job) and write them to the file. The ring has two slots per thread, so
+ * every thread may have a block to compress and another one waiting; the
+ * backend only stalls when all of them are taken.
+ *
+ * The threads must not touch anything that belongs to the backend: they only
+ * call LZ4, CRC and system calls and use their own duplicate of the file
+ * descriptor, so that they can finish their current job even if the backend
+ * has already closed the file while aborting the transaction. Errors are
+ * handed back in the job and reported by the backend.
+ *
+ * Blocks are compressed in any order but written in the order they were
+ * queued: whichever thread finishes compressing the oldest pending block
+ * writes out it and the following compressed ones, one thread at a time.
+ * The block being refilled (if any) keeps its offset, the others are
+ * appended one after another; the backend learns their offsets when it
+ * collects finished jobs, and only then updates the file header and the
+ * block index.
+ */
+
+static int
+write_all(int fd, const char *buf, Size size, Size offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, buf, size, offset);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        buf += written;
+        size -= written;
+        offset += written;
+    }
+
+    return 0;
+}
+
+/*
+ * Write out compressed jobs in the queue order. Called with the lock held by
+ * the thread which took over the writing; the lock is released during I/O.
+ */
+static void
+write_compressed_jobs(BlockWriter *writer)
+{
+    for (;;)
+    {
+        BlockWriteJob *job = &writer->jobs[writer->next_write];
+        Size        offset;
+        int         error;
+
+        /* blocks of an aborted insertion aren't written at all */
+        if (writer->shutdown || job->status != JOB_COMPRESSED)
+            break;
+
+        offset = job->offset != 0 ? job->offset : writer->next_offset;
+        pthread_mutex_unlock(&writer->lock);
+
+        if (job->size == 0)
+            error = -1;
+        else if ((error = write_all(writer->fd, job->buf, job->size, offset)) == 0
+                 && writer->sync && fsync(writer->fd) != 0)
+            error = errno;
+
+        pthread_mutex_lock(&writer->lock);
+        job->written_offset = offset;
+        job->error = error;
+        job->status = JOB_DONE;
+        if (error == 0)
+            writer->next_offset = offset + job->size;
+        writer->next_write = (writer->next_write + 1) % writer->njobs;
+        pthread_cond_broadcast(&writer->cond);
+    }
+}
+
+static void *
+block_writer_main(void *arg)
+{
+    BlockWriter *writer = (BlockWriter *) arg;
+
+    pthread_mutex_lock(&writer->lock);
+    for (;;)
+    {
+        BlockWriteJob *job = &writer->jobs[writer->next_compress];
+
+        while (!writer->shutdown && job->status != JOB_QUEUED)
+        {
+            pthread_cond_wait(&writer->cond, &writer->lock);
+            job = &writer->jobs[writer->next_compress];
+        }
+        if (writer->shutdown)
+            break;
+
+        job->status = JOB_COMPRESSING;
+        writer->next_compress = (writer->next_compress + 1) % writer->njobs;
+        pthread_mutex_unlock(&writer->lock);
+
+        job->size = StorageCompressBlock(job->data, (StorageBlockHeader *) job->buf,
+                                         job->meta_size, writer->lz4_acceleration);
+
+        pthread_mutex_lock(&writer->lock);
+        job->status = JOB_COMPRESSED;
+        if (!writer->writing)
+        {
+            writer->writing = true;
+            write_compressed_jobs(writer);
+            writer->writing = false;
+        }
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    return NULL;
+}
+
+BlockWriter *
+block_writer_start(int fd, int lz4_acceleration, int nthreads, bool sync)
+{
+    BlockWriter *writer = palloc0(sizeof(BlockWriter));
+    sigset_t    all,
+                old;
+    int         rc = 0;
+    int         i;
+
+    Assert(nthreads > 0 && nthreads <= BLOCK_WRITER_MAX_THREADS);
+
+    writer->njobs = nthreads * BLOCK_WRITER_JOBS_PER_THREAD;
+    writer->jobs = palloc0(sizeof(BlockWriteJob) * writer->njobs);
+    for (i = 0; i < writer->njobs; i++)
+        writer->jobs[i].data = palloc(BLOCK_SIZE);
+    writer->threads = palloc0(sizeof(pthread_t) * nthreads);
+
+    if ((writer->fd = dup(fd)) < 0)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot duplicate file descriptor: %s", err);
+    }
+    writer->lz4_acceleration = lz4_acceleration;
+    writer->sync = sync;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+
+    /* signals are for the backend to handle */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < nthreads && rc == 0; i++)
+    {
+        rc = pthread_create(&writer->threads[i], NULL, block_writer_main, writer);
+        if (rc == 0)
+            writer->nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0)
+    {
+        block_writer_stop(writer);
+        elog(ERROR, "tuple_fdw: cannot start compression thread: %s", strerror(rc));
+    }
+
+    return writer;
+}
+
+/* The next slot to fill, or NULL if the finished jobs have to be collected */
+BlockWriteJob *
+block_writer_get_free(BlockWriter *writer)
+{
+    BlockWriteJob *job = &writer->jobs[writer->next_submit];
+
+    return job->status == JOB_FREE ? job : NULL;
+}
+
+void
+block_writer_submit(BlockWriter *writer, BlockWriteJob *job)
+{
+    Assert(job == &writer->jobs[writer->next_submit]);
+
+    pthread_mutex_lock(&writer->lock);
+    job->status = JOB_QUEUED;
+    writer->next_submit = (writer->next_submit + 1) % writer->njobs;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/*
+ * Wait for the oldest submitted job to be done. Returns NULL if there are no
+ * jobs in flight.
+ */
+BlockWriteJob *
+block_writer_wait(BlockWriter *writer)
+{
+    BlockWriteJob *job = &writer->jobs[writer->next_reap];
+
+    if (job->status == JOB_FREE)
+        return NULL;
+
+    pthread_mutex_lock(&writer->lock);
+    while (job->status != JOB_DONE)
+        pthread_cond_wait(&writer->cond, &writer->lock);
+    pthread_mutex_unlock(&writer->lock);
+
+    return job;
+}
+
+/* Make the slot of the collected job available again */
+void
+block_writer_release(BlockWriter *writer, BlockWriteJob *job)
+{
+    Assert(job == &writer->jobs[writer->next_reap]);
+
+    pthread_mutex_lock(&writer->lock);
+    job->status = JOB_FREE;
+    writer->next_reap = (writer->next_reap + 1) % writer->njobs;
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/* Offset of the block following the written ones; only valid once drained */
+Size
+block_writer_next_offset(BlockWriter *writer)
+{
+    Size    offset;
+
+    pthread_mutex_lock(&writer->lock);
+    offset = writer->next_offset;
+    pthread_mutex_unlock(&writer->lock);
+
+    return offset;
+}
+
+/*
+ * Stop the threads. Jobs still in the queue are dropped, so the caller has to
+ * collect them beforehand unless the insertion is being aborted.
+ */
+void
+block_writer_stop(BlockWriter *writer)
+{
+    int     i;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->shutdown = true;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+
+    for (i = 0; i < writer->nthreads; i++)
+        pthread_join(writer->threads[i], NULL);
+    close(writer->fd);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->cond);
+}
@@ -0,0 +1,80 @@
+#ifndef TUPLE_BLOCKWRITER_H
+#define TUPLE_BLOCKWRITER_H
+
+#include <pthread.h>
+
+
+#define BLOCK_WRITER_MAX_THREADS    64
+#define BLOCK_WRITER_JOBS_PER_THREAD 2
+
+typedef enum
+{
+    JOB_FREE,
+    JOB_QUEUED,
+    JOB_COMPRESSING,
+    JOB_COMPRESSED,
+    JOB_DONE
+} BlockWriteJobStatus;
+
+/* A full block on its way to the disk */
+typedef struct
+{
+    BlockWriteJobStatus status;
+
+    /* set by the backend */
+    Size        offset;         /* where to write the block, 0 to append */
+    Size        meta_size;
+    char       *data;           /* uncompressed block */
+    char       *buf;            /* block header, metadata and compressed data */
+    Size        buf_size;
+
+    /* set by the writer */
+    Size        size;           /* size of the compressed block or 0 */
+    Size        written_offset;
+    int         error;          /* errno of a failed write, -1 if compression failed */
+
+    /* backend bookkeeping, never touched by the writer */
+    bool        is_new;
+    uint32      new_tuples;     /* tuples added since the last flush */
+    uint32    **index_hashes;   /* hashes to add to the block index */
+    int        *index_nhashes;
+} BlockWriteJob;
+
+/*
+ * Background threads compressing and writing blocks. Only plain C is run in
+ * the threads: no memory allocations, no error reporting, nothing else that
+ * belongs to the backend.
+ */
+typedef struct
+{
+    pthread_t      *threads;
+    int             nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             fd;         /* own descriptor of the storage file */
+    int             lz4_acceleration;
+    bool            sync;       /* fsync every block once written */
+    bool            shutdown;
+    bool            writing;    /* one of the threads is writing blocks out */
+    Size            next_offset;    /* where the next appended block goes */
+
+    /* ring of jobs; each position only ever moves forward */
+    BlockWriteJob  *jobs;
+    int             njobs;
+    int             next_submit;
+    int             next_compress;
+    int             next_write;
+    int             next_reap;
+} BlockWriter;
+
+
+BlockWriter *block_writer_start(int fd, int lz4_acceleration, int nthreads,
+                                bool sync);
+BlockWriteJob *block_writer_get_free(BlockWriter *writer);
+void block_writer_submit(BlockWriter *writer, BlockWriteJob *job);
+BlockWriteJob *block_writer_wait(BlockWriter *writer);
+void block_writer_release(BlockWriter *writer, BlockWriteJob *job);
+Size block_writer_next_offset(BlockWriter *writer);
+void block_writer_stop(BlockWriter *writer);
+
+#endif /* TUPLE_BLOCKWRITER_H */
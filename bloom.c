@@ -0,0 +1,250 @@
+#include "postgres.h"
+#include "access/hash.h"
+#include "lib/stringinfo.h"
+#include "mb/pg_wchar.h"
+
+#include "bloom.h"
+
+
+/*
+ * Bloom filters
+ * -------------
+ *
+ * Blocks may carry a Bloom filter per column listed in `bloom_columns`. It
+ * lets equality scans skip blocks that certainly don't contain the value
+ * without decompressing them, which is what zone maps can't do for columns
+ * whose values are spread all over the file.
+ *
+ * Values are hashed by the hash function of the column type's default hash
+ * opclass, so that keys of other types from the same operator family hash
+ * the same way. All the bits are derived from that single 32-bit hash by
+ * double hashing. Filters are sized for about 1% false positives: ten bits
+ * and seven probes per distinct value.
+ *
+ * N-gram filters of the columns listed in `ngram_columns` contain hashes of
+ * all byte trigrams of the values, and of their lower case versions (hashed
+ * differently) for ILIKE. Any string matching a LIKE pattern or a regular
+ * expression contains the trigrams of the pattern's literal parts, so blocks
+ * whose filter misses any of them are skipped. Patterns whose literal parts
+ * can't be reliably told (alternations, groups, escapes) aren't used.
+ */
+
+#define BLOOM_BITS_PER_VALUE    10
+#define BLOOM_NHASHES           7
+#define BLOOM_MIN_BITS          64
+#define BLOOM_MAX_BITS          (1 << 20)   /* 128 kilobytes */
+
+/* murmurhash3 finalizer; gives the second hash for double hashing */
+static inline uint32
+mix32(uint32 h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static int
+compare_hashes(const void *a, const void *b)
+{
+    uint32  ha = *(const uint32 *) a;
+    uint32  hb = *(const uint32 *) b;
+
+    return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+/* Sort hashes and remove duplicates; returns the number of distinct ones */
+int
+bloom_dedup_hashes(uint32 *hashes, int n)
+{
+    int     i,
+            m = 0;
+
+    if (n < 2)
+        return n;
+
+    qsort(hashes, n, sizeof(uint32), compare_hashes);
+    for (i = 1; i < n; i++)
+        if (hashes[i] != hashes[m])
+            hashes[++m] = hashes[i];
+
+    return m + 1;
+}
+
+uint32
+bloom_choose_nbits(int ndistinct)
+{
+    uint32  nbits = BLOOM_MIN_BITS;
+
+    while (nbits < (uint64) ndistinct * BLOOM_BITS_PER_VALUE
+           && nbits < BLOOM_MAX_BITS)
+        nbits <<= 1;
+
+    return nbits;
+}
+
+void
+bloom_build(BloomFilter *filter, uint32 nbits, const uint32 *hashes, int n)
+{
+    uint32  mask = nbits - 1;
+    int     i;
+
+    Assert((nbits & mask) == 0);
+
+    filter->nbits = nbits;
+    filter->nhashes = BLOOM_NHASHES;
+    memset(filter->bits, 0, nbits / 8);
+
+    for (i = 0; i < n; i++)
+    {
+        uint32  h1 = hashes[i];
+        uint32  h2 = mix32(h1) | 1;
+        uint32  j;
+
+        for (j = 0; j < filter->nhashes; j++)
+        {
+            uint32  bit = (h1 + j * h2) & mask;
+
+            filter->bits[bit >> 3] |= 1 << (bit & 7);
+        }
+    }
+}
+
+bool
+bloom_contains(const BloomFilter *filter, uint32 hash)
+{
+    uint32  mask = filter->nbits - 1;
+    uint32  h2 = mix32(hash) | 1;
+    uint32  j;
+
+    for (j = 0; j < filter->nhashes; j++)
+    {
+        uint32  bit = (hash + j * h2) & mask;
+
+        if ((filter->bits[bit >> 3] & (1 << (bit & 7))) == 0)
+            return false;
+    }
+
+    return true;
+}
+
+/* Sanity check a filter read from the file */
+bool
+bloom_is_valid(const BloomFilter *filter, Size size)
+{
+    return size >= offsetof(BloomFilter, bits)
+        && filter->nbits >= 8
+        && (filter->nbits & (filter->nbits - 1)) == 0
+        && size == BloomFilterSize(filter->nbits);
+}
+
+uint32
+ngram_hash(const char *ngram, bool lowered)
+{
+    uint32  hash = DatumGetUInt32(hash_any((const unsigned char *) ngram, NGRAM_LEN));
+
+    /* lower case trigrams mustn't be confused with the original ones */
+    return lowered ? mix32(hash ^ 0x9e3779b9) : hash;
+}
+
+static List *
+flush_literal(List *literals, StringInfo run)
+{
+    if (run->len >= NGRAM_LEN)
+        literals = lappend(literals, pstrdup(run->data));
+    resetStringInfo(run);
+
+    return literals;
+}
+
+/*
+ * Literal parts of a LIKE pattern (the escape character is backslash; other
+ * ones are substituted by `like_escape` before we get here).
+ */
+List *
+like_pattern_literals(const char *pat, int len)
+{
+    const char *end = pat + len;
+    List       *literals = NIL;
+    StringInfoData run;
+
+    initStringInfo(&run);
+    while (pat < end)
+    {
+        int     clen;
+
+        if (*pat == '%' || *pat == '_')
+        {
+            literals = flush_literal(literals, &run);
+            pat++;
+            continue;
+        }
+
+        if (*pat == '\\' && ++pat >= end)
+            break;
+
+        clen = Min(pg_mblen(pat), end - pat);
+        appendBinaryStringInfo(&run, pat, clen);
+        pat += clen;
+    }
+
+    return flush_literal(literals, &run);
+}
+
+/*
+ * Literal parts of a regular expression that any match has to contain. Only
+ * simple expressions consisting of literal characters, anchors, dots and
+ * quantifiers are understood; for anything else we return NIL.
+ */
+List *
+regex_pattern_literals(const char *pat, int len)
+{
+    const char *end = pat + len;
+    const char *p;
+    List       *literals = NIL;
+    StringInfoData run;
+
+    /* ARE director or embedded options */
+    if (len >= 3 && strncmp(pat, "***", 3) == 0)
+        return NIL;
+
+    for (p = pat; p < end; p++)
+        if (*p == '|' || *p == '(' || *p == ')' || *p == '[' || *p == ']'
+            || *p == '{' || *p == '}' || *p == '\\')
+            return NIL;
+
+    initStringInfo(&run);
+    while (pat < end)
+    {
+        int     clen;
+
+        if (*pat == '.' || *pat == '^' || *pat == '$'
+            || *pat == '*' || *pat == '+' || *pat == '?')
+        {
+            literals = flush_literal(literals, &run);
+            pat++;
+            continue;
+        }
+
+        clen = Min(pg_mblen(pat), end - pat);
+
+        /* quantified character is optional or may repeat */
+        if (pat + clen < end && (pat[clen] == '*' || pat[clen] == '?'))
+        {
+            literals = flush_literal(literals, &run);
+            pat += clen;
+            continue;
+        }
+
+        appendBinaryStringInfo(&run, pat, clen);
+        pat += clen;
+
+        if (pat < end && *pat == '+')
+            literals = flush_literal(literals, &run);
+    }
+
+    return flush_literal(literals, &run);
+}
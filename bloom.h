@@ -0,0 +1,31 @@
+#ifndef TUPLE_BLOOM_H
+#define TUPLE_BLOOM_H
+
+#include "nodes/pg_list.h"
+
+/*
+ * Bloom filter over 32-bit hashes of column values. It is stored in the block
+ * metadata as is.
+ */
+typedef struct
+{
+    uint32  nbits;      /* power of two */
+    uint32  nhashes;    /* number of bits set per value */
+    uint8   bits[];
+} BloomFilter;
+
+#define BloomFilterSize(nbits) (offsetof(BloomFilter, bits) + (nbits) / 8)
+
+#define NGRAM_LEN   3
+
+int bloom_dedup_hashes(uint32 *hashes, int n);
+uint32 bloom_choose_nbits(int ndistinct);
+void bloom_build(BloomFilter *filter, uint32 nbits, const uint32 *hashes, int n);
+bool bloom_contains(const BloomFilter *filter, uint32 hash);
+bool bloom_is_valid(const BloomFilter *filter, Size size);
+
+uint32 ngram_hash(const char *ngram, bool lowered);
+List *like_pattern_literals(const char *pat, int len);
+List *regex_pattern_literals(const char *pat, int len);
+
+#endif /* TUPLE_BLOOM_H */
@@ -0,0 +1,254 @@
+#include "postgres.h"
+#include "storage/fd.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+
+#include "filepool.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/*
+ * File pool
+ * ---------
+ *
+ * Scans with `use_mmap` would open, map, unmap and close the storage file
+ * every time, which is a good part of the cost of a short query. Instead the
+ * backend keeps the descriptors and the mappings of the files it has scanned
+ * recently, at most `tuple_fdw.mmap_pool_size` of them, and a scan only
+ * stat()s the file to make sure it's still the same one.
+ *
+ * Files only ever grow. The mapping reserves address space past the end of
+ * the file, as much as the file takes, so that the blocks appended later on
+ * are covered by it as well; the file is only mapped anew once it outgrows
+ * the mapping, which takes a few times at most while the file grows. Pages past the
+ * end of the file are never touched: scans only read what the file header
+ * refers to, and writers append the data before the header.
+ *
+ * Mappings in use are never moved or dropped. A scan finding the file it
+ * needs in use and replaced or grown past the mapping maps it on its own,
+ * the usual way.
+ *
+ * A deleted file (e.g. a segment removed by `tuple_fdw_drop_before`) keeps
+ * its disk space as long as it's open. Whenever a new file is added to the
+ * pool, the unused entries of deleted files are dropped.
+ */
+
+/* at least that much address space is reserved for a file */
+#define FILEPOOL_MIN_MAPPING    ((Size) 64 * 1024)
+
+int tuple_mmap_pool_size = 64;
+
+static HTAB *filepool = NULL;
+static uint64 filepool_clock = 0;
+
+
+static void
+close_pooled_file(PooledFile *file)
+{
+    Assert(file->refcount == 0);
+
+    if (file->addr)
+        munmap(file->addr, file->mapped);
+    close(file->fd);
+#if PG_VERSION_NUM >= 130000
+    ReleaseExternalFD();
+#endif
+    hash_search(filepool, file->path, HASH_REMOVE, NULL);
+}
+
+/* Map the file of the given size, replacing the current mapping on success */
+static bool
+map_pooled_file(PooledFile *file, Size size)
+{
+    Size    length = Max(size * 2, FILEPOOL_MIN_MAPPING);
+    char   *addr;
+
+    addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, file->fd, 0);
+    if (addr == MAP_FAILED)
+        return false;
+
+    if (file->addr)
+        munmap(file->addr, file->mapped);
+    file->addr = addr;
+    file->mapped = length;
+    file->size = size;
+
+    return true;
+}
+
+/*
+ * Drop the unused entries of deleted files, then the least recently used
+ * ones until there is room for a new entry. Returns false if all the entries
+ * are in use.
+ */
+static bool
+make_room(void)
+{
+    HASH_SEQ_STATUS status;
+    PooledFile *file;
+    PooledFile *victim = NULL;
+    struct stat buf;
+
+    hash_seq_init(&status, filepool);
+    while ((file = (PooledFile *) hash_seq_search(&status)) != NULL)
+    {
+        if (file->refcount == 0
+            && (fstat(file->fd, &buf) != 0 || buf.st_nlink == 0))
+            close_pooled_file(file);
+    }
+
+    while (hash_get_num_entries(filepool) >= tuple_mmap_pool_size)
+    {
+        victim = NULL;
+        hash_seq_init(&status, filepool);
+        while ((file = (PooledFile *) hash_seq_search(&status)) != NULL)
+        {
+            if (file->refcount == 0
+                && (victim == NULL || file->stamp < victim->stamp))
+                victim = file;
+        }
+
+        if (victim == NULL)
+            return false;
+        close_pooled_file(victim);
+    }
+
+    return true;
+}
+
+static PooledFile *
+open_pooled_file(const char *key)
+{
+    PooledFile *file;
+    struct stat buf;
+    int         fd;
+
+    if (!make_room())
+        return NULL;
+
+#if PG_VERSION_NUM >= 130000
+    if (!AcquireExternalFD())
+        return NULL;
+#endif
+    if ((fd = BasicOpenFile(key, O_RDONLY | PG_BINARY)) < 0
+        || fstat(fd, &buf) != 0 || buf.st_size == 0)
+    {
+        if (fd >= 0)
+            close(fd);
+#if PG_VERSION_NUM >= 130000
+        ReleaseExternalFD();
+#endif
+        return NULL;
+    }
+
+    file = (PooledFile *) hash_search(filepool, key, HASH_ENTER, NULL);
+    file->fd = fd;
+    file->dev = buf.st_dev;
+    file->ino = buf.st_ino;
+    file->addr = NULL;
+    file->mapped = 0;
+    file->refcount = 0;
+
+    if (!map_pooled_file(file, buf.st_size))
+    {
+        close_pooled_file(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+/*
+ * Take the mapping of the file for a scan. Returns NULL if the file has to
+ * be opened and mapped the usual way: it's empty, there is no room in the
+ * pool or the mapping in use doesn't fit any more. Errors are left to the
+ * usual way to report as well.
+ */
+PooledFile *
+filepool_acquire(const char *path)
+{
+    char        key[MAXPGPATH];
+    PooledFile *file;
+    struct stat buf;
+
+    if (tuple_mmap_pool_size <= 0 || strlen(path) >= MAXPGPATH)
+        return NULL;
+
+    if (filepool == NULL)
+    {
+        HASHCTL     ctl;
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = MAXPGPATH;
+        ctl.entrysize = sizeof(PooledFile);
+        ctl.hcxt = TopMemoryContext;
+        filepool = hash_create("tuple_fdw file pool", 64, &ctl,
+                               HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    if (stat(path, &buf) != 0 || buf.st_size == 0)
+        return NULL;
+
+    memset(key, 0, sizeof(key));
+    strlcpy(key, path, sizeof(key));
+    file = (PooledFile *) hash_search(filepool, key, HASH_FIND, NULL);
+
+    /* the file has been replaced */
+    if (file && (file->dev != buf.st_dev || file->ino != buf.st_ino))
+    {
+        if (file->refcount > 0)
+            return NULL;
+        close_pooled_file(file);
+        file = NULL;
+    }
+
+    if (file == NULL)
+    {
+        if ((file = open_pooled_file(key)) == NULL)
+            return NULL;
+    }
+    else if ((Size) buf.st_size > file->mapped)
+    {
+        if (file->refcount > 0 || !map_pooled_file(file, buf.st_size))
+            return NULL;
+    }
+    else
+        file->size = buf.st_size;
+
+    file->refcount++;
+    file->stamp = ++filepool_clock;
+
+    return file;
+}
+
+/*
+ * Check the size of the file again, e.g. after reading its header. Returns
+ * false if the file has outgrown a mapping which others are using.
+ */
+bool
+filepool_refresh(PooledFile *file, Size *size)
+{
+    struct stat buf;
+
+    if (fstat(file->fd, &buf) != 0)
+        return false;
+
+    if ((Size) buf.st_size > file->mapped
+        && (file->refcount > 1 || !map_pooled_file(file, buf.st_size)))
+        return false;
+
+    file->size = buf.st_size;
+    *size = buf.st_size;
+    return true;
+}
+
+void
+filepool_release(PooledFile *file)
+{
+    Assert(file->refcount > 0);
+    file->refcount--;
+}
@@ -0,0 +1,28 @@
+#ifndef TUPLE_FILEPOOL_H
+#define TUPLE_FILEPOOL_H
+
+#include <sys/types.h>
+
+
+/* Storage file kept open and mapped across queries (see filepool.c) */
+typedef struct
+{
+    char        path[MAXPGPATH];    /* hash key */
+    int         fd;
+    dev_t       dev;
+    ino_t       ino;
+    char       *addr;
+    Size        mapped;     /* length of the mapping, may exceed the file */
+    Size        size;       /* file size as of the last check */
+    int         refcount;   /* storage states using the mapping */
+    uint64      stamp;      /* last time it was acquired */
+} PooledFile;
+
+
+extern int tuple_mmap_pool_size;
+
+PooledFile *filepool_acquire(const char *path);
+bool filepool_refresh(PooledFile *file, Size *size);
+void filepool_release(PooledFile *file);
+
+#endif /* TUPLE_FILEPOOL_H */
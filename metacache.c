@@ -0,0 +1,176 @@
+#include "postgres.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+
+#include "metacache.h"
+
+#include <sys/stat.h>
+#include <time.h>
+
+
+/*
+ * Metadata cache
+ * --------------
+ *
+ * The planner needs the headers of the files of every table in the query:
+ * the numbers of blocks and rows for estimates, the file statistics to leave
+ * out files which can't have matching rows. Rather than reading them for
+ * every query, which takes a handful of syscalls per file and adds up with
+ * hundreds of partitions or segments, the backend keeps them in a cache keyed
+ * by the table and the file path.
+ *
+ * An entry is only used as long as the file keeps its identity, size and
+ * modification time, which takes a single stat() to check; every write to
+ * the file changes the latter. Entries of a table are dropped when its
+ * relcache entry is invalidated, e.g. by ALTER FOREIGN TABLE.
+ *
+ * The modification time is only as precise as the file system (and the
+ * kernel clock) keeps it, so a header rewritten twice within that time may go
+ * unnoticed. Scans skip files by the cached ranges too, so an entry read
+ * around the time the file was modified isn't trusted: such a file is read
+ * again on every lookup until it has been left alone for a while.
+ */
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+typedef struct
+{
+    Oid         relid;
+    char        filename[MAXPGPATH];
+} MetaCacheKey;
+
+typedef struct
+{
+    MetaCacheKey key;
+    dev_t       dev;
+    ino_t       ino;
+    off_t       size;
+    struct timespec mtime;
+    bool        racy;       /* read too soon after a change to be trusted */
+    FileMeta    meta;
+} MetaCacheEntry;
+
+static HTAB *metacache = NULL;
+static MemoryContext metacache_cxt = NULL;
+
+
+static void
+remove_entry(MetaCacheEntry *entry)
+{
+    if (entry->meta.stats)
+        pfree(entry->meta.stats);
+    hash_search(metacache, &entry->key, HASH_REMOVE, NULL);
+}
+
+/* Drop the entries of the relation, or all of them for InvalidOid */
+static void
+metacache_invalidate(Datum arg, Oid relid)
+{
+    HASH_SEQ_STATUS status;
+    MetaCacheEntry *entry;
+
+    hash_seq_init(&status, metacache);
+    while ((entry = (MetaCacheEntry *) hash_seq_search(&status)) != NULL)
+    {
+        if (!OidIsValid(relid) || entry->key.relid == relid)
+            remove_entry(entry);
+    }
+}
+
+static void
+metacache_init(void)
+{
+    HASHCTL     ctl;
+
+    metacache_cxt = AllocSetContextCreate(CacheMemoryContext,
+                                          "tuple_fdw metadata cache",
+                                          ALLOCSET_DEFAULT_SIZES);
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = sizeof(MetaCacheKey);
+    ctl.entrysize = sizeof(MetaCacheEntry);
+    ctl.hcxt = metacache_cxt;
+    metacache = hash_create("tuple_fdw metadata cache", 64, &ctl,
+                            HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    CacheRegisterRelcacheCallback(metacache_invalidate, (Datum) 0);
+}
+
+/*
+ * Get the header and the file statistics of a storage file of the relation,
+ * reading them only if the file has changed since. Returns false if the file
+ * doesn't exist or isn't a valid storage file (yet). The statistics belong
+ * to the cache and are only good until the next invalidation.
+ */
+bool
+metacache_lookup(Oid relid, const char *filename, FileMeta *meta)
+{
+    MetaCacheKey    key;
+    MetaCacheEntry *entry;
+    struct stat     buf;
+    bool            found;
+    char           *stats = NULL;
+    Size            stats_size = 0;
+
+    if (metacache == NULL)
+        metacache_init();
+
+    memset(&key, 0, sizeof(key));
+    key.relid = relid;
+    strlcpy(key.filename, filename, MAXPGPATH);
+
+    entry = (MetaCacheEntry *) hash_search(metacache, &key, HASH_FIND, NULL);
+    if (stat(filename, &buf) != 0)
+    {
+        if (entry)
+            remove_entry(entry);
+        return false;
+    }
+
+    if (entry
+        && !entry->racy
+        && entry->dev == buf.st_dev
+        && entry->ino == buf.st_ino
+        && entry->size == buf.st_size
+        && entry->mtime.tv_sec == buf.st_mtim.tv_sec
+        && entry->mtime.tv_nsec == buf.st_mtim.tv_nsec)
+    {
+        *meta = entry->meta;
+        return true;
+    }
+
+    /* changes made after the stat() only make the next lookup read it again */
+    if (!StorageReadFileInfo(filename, &meta->header, &meta->file_size,
+                             &stats, &stats_size))
+    {
+        if (entry)
+            remove_entry(entry);
+        return false;
+    }
+
+    entry = (MetaCacheEntry *) hash_search(metacache, &key, HASH_ENTER, &found);
+    if (found && entry->meta.stats)
+        pfree(entry->meta.stats);
+
+    entry->dev = buf.st_dev;
+    entry->ino = buf.st_ino;
+    entry->size = buf.st_size;
+    entry->mtime = buf.st_mtim;
+    entry->racy = time(NULL) <= buf.st_mtim.tv_sec + 1;
+    entry->meta.header = meta->header;
+    entry->meta.file_size = meta->file_size;
+    entry->meta.stats = NULL;
+    entry->meta.stats_size = stats_size;
+    if (stats)
+    {
+        entry->meta.stats = MemoryContextAlloc(metacache_cxt, stats_size);
+        memcpy(entry->meta.stats, stats, stats_size);
+        pfree(stats);
+    }
+
+    *meta = entry->meta;
+    return true;
+}
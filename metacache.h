@@ -0,0 +1,19 @@
+#ifndef TUPLE_METACACHE_H
+#define TUPLE_METACACHE_H
+
+#include "storage.h"
+
+
+/* What the planner knows about a storage file */
+typedef struct
+{
+    StorageFileHeader header;
+    Size        file_size;
+    char       *stats;      /* file statistics entries, NULL if none */
+    Size        stats_size;
+} FileMeta;
+
+
+bool metacache_lookup(Oid relid, const char *filename, FileMeta *meta);
+
+#endif /* TUPLE_METACACHE_H */
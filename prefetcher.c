@@ -0,0 +1,286 @@
+#include "postgres.h"
+
+#include "storage.h"
+#include "prefetcher.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+
+/*
+ * Block prefetching
+ * -----------------
+ *
+ * Scans driven asynchronously by an Append node (see `async_prefetch`) don't
+ * read blocks themselves. A background thread reads the blocks of the scan
+ * one after another into a small ring of slots and the scan picks them up
+ * from there, so that while the backend is busy with one partition the
+ * others keep their disks busy.
+ *
+ * The thread announces every block it has read by writing a byte to a pipe,
+ * which the backend waits on along with the other partitions of the Append.
+ * Only the compressed block is read ahead; checking and decompressing it is
+ * still up to the backend. Blocks which don't fit into a slot are read by the
+ * backend itself.
+ *
+ * Like the block writer threads the prefetcher uses its own duplicate of the
+ * file descriptor and doesn't touch anything else that belongs to the
+ * backend. Read errors are handed back in the slot and the prefetcher stops;
+ * the backend then reads the block itself, which reports the error properly.
+ */
+
+static int
+read_all(int fd, char *buf, Size size, Size offset)
+{
+    while (size > 0)
+    {
+        ssize_t nread = pread(fd, buf, size, offset);
+
+        if (nread < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (nread == 0)
+            return -1;
+        buf += nread;
+        size -= nread;
+        offset += nread;
+    }
+
+    return 0;
+}
+
+/* Let the backend know there's something new */
+static void
+notify_backend(BlockPrefetcher *prefetcher)
+{
+    char    c = 0;
+
+    /* a full pipe will wake the backend up anyway */
+    if (write(prefetcher->pipe[1], &c, 1) < 0)
+        return;
+}
+
+static void
+read_slot(BlockPrefetcher *prefetcher, PrefetchSlot *slot)
+{
+    StorageBlockHeader *header = (StorageBlockHeader *) slot->buf;
+
+    slot->size = 0;
+    slot->complete = false;
+    slot->error = read_all(prefetcher->fd, slot->buf, StorageBlockHeaderSize,
+                           slot->offset);
+    if (slot->error != 0)
+        return;
+
+    slot->size = StorageBlockHeaderSize + header->meta_size + header->compressed_size;
+    if (slot->size > prefetcher->buf_size)
+        return;
+
+    slot->error = read_all(prefetcher->fd, slot->buf + StorageBlockHeaderSize,
+                           slot->size - StorageBlockHeaderSize,
+                           slot->offset + StorageBlockHeaderSize);
+    slot->complete = (slot->error == 0);
+}
+
+static void *
+block_prefetcher_main(void *arg)
+{
+    BlockPrefetcher *prefetcher = (BlockPrefetcher *) arg;
+
+    pthread_mutex_lock(&prefetcher->lock);
+    for (;;)
+    {
+        PrefetchSlot *slot = &prefetcher->slots[prefetcher->next_read];
+
+        while (!prefetcher->shutdown && slot->status != PREFETCH_FREE)
+            pthread_cond_wait(&prefetcher->cond, &prefetcher->lock);
+        if (prefetcher->shutdown)
+            break;
+
+        if (prefetcher->next_offset > prefetcher->last_offset)
+        {
+            prefetcher->finished = true;
+            pthread_cond_broadcast(&prefetcher->cond);
+            notify_backend(prefetcher);
+            break;
+        }
+
+        slot->status = PREFETCH_READING;
+        slot->offset = prefetcher->next_offset;
+        pthread_mutex_unlock(&prefetcher->lock);
+
+        read_slot(prefetcher, slot);
+
+        pthread_mutex_lock(&prefetcher->lock);
+        slot->status = PREFETCH_READY;
+        prefetcher->next_read = (prefetcher->next_read + 1) % BLOCK_PREFETCHER_SLOTS;
+        if (slot->error == 0)
+            prefetcher->next_offset = slot->offset + slot->size;
+        else
+            prefetcher->finished = true;
+        pthread_cond_broadcast(&prefetcher->cond);
+        notify_backend(prefetcher);
+
+        if (prefetcher->finished)
+            break;
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+
+    return NULL;
+}
+
+/*
+ * Start reading the blocks from `start_offset` up to the one at `last_offset`
+ * into slots of `buf_size` bytes.
+ */
+BlockPrefetcher *
+block_prefetcher_start(int fd, Size start_offset, Size last_offset,
+                       Size buf_size)
+{
+    BlockPrefetcher *prefetcher = palloc0(sizeof(BlockPrefetcher));
+    sigset_t    all,
+                old;
+    int         rc;
+    int         i;
+
+    for (i = 0; i < BLOCK_PREFETCHER_SLOTS; i++)
+        prefetcher->slots[i].buf = palloc(buf_size);
+    prefetcher->buf_size = buf_size;
+    prefetcher->next_offset = start_offset;
+    prefetcher->last_offset = last_offset;
+
+    if ((prefetcher->fd = dup(fd)) < 0)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot duplicate file descriptor: %s", err);
+    }
+    if (pipe(prefetcher->pipe) != 0)
+    {
+        const char *err = strerror(errno);
+
+        close(prefetcher->fd);
+        elog(ERROR, "tuple_fdw: cannot create pipe: %s", err);
+    }
+    for (i = 0; i < 2; i++)
+        fcntl(prefetcher->pipe[i], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&prefetcher->lock, NULL);
+    pthread_cond_init(&prefetcher->cond, NULL);
+
+    /* signals are for the backend to handle */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    rc = pthread_create(&prefetcher->thread, NULL, block_prefetcher_main, prefetcher);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0)
+    {
+        block_prefetcher_stop(prefetcher);
+        elog(ERROR, "tuple_fdw: cannot start prefetching thread: %s", strerror(rc));
+    }
+    prefetcher->started = true;
+
+    return prefetcher;
+}
+
+/* Whether `block_prefetcher_take` would return right away */
+bool
+block_prefetcher_ready(BlockPrefetcher *prefetcher)
+{
+    PrefetchSlot *slot = &prefetcher->slots[prefetcher->next_take];
+    bool        ready;
+
+    pthread_mutex_lock(&prefetcher->lock);
+    ready = slot->status == PREFETCH_READY
+        || (slot->status == PREFETCH_FREE && prefetcher->finished);
+    pthread_mutex_unlock(&prefetcher->lock);
+
+    return ready;
+}
+
+/*
+ * Wait for the next block to be read. Returns NULL if the prefetcher has
+ * nothing for the offset: it has reached the last block, or the scan has
+ * moved elsewhere (e.g. wrapped around to the first block).
+ */
+PrefetchSlot *
+block_prefetcher_take(BlockPrefetcher *prefetcher, Size offset)
+{
+    PrefetchSlot *slot = &prefetcher->slots[prefetcher->next_take];
+
+    pthread_mutex_lock(&prefetcher->lock);
+    while (slot->status != PREFETCH_READY
+           && !(slot->status == PREFETCH_FREE && prefetcher->finished))
+        pthread_cond_wait(&prefetcher->cond, &prefetcher->lock);
+    pthread_mutex_unlock(&prefetcher->lock);
+
+    if (slot->status != PREFETCH_READY || slot->offset != offset)
+        return NULL;
+
+    return slot;
+}
+
+/* Make the slot of the consumed block available again */
+void
+block_prefetcher_release(BlockPrefetcher *prefetcher, PrefetchSlot *slot)
+{
+    Assert(slot == &prefetcher->slots[prefetcher->next_take]);
+
+    pthread_mutex_lock(&prefetcher->lock);
+    slot->status = PREFETCH_FREE;
+    prefetcher->next_take = (prefetcher->next_take + 1) % BLOCK_PREFETCHER_SLOTS;
+    pthread_cond_broadcast(&prefetcher->cond);
+    pthread_mutex_unlock(&prefetcher->lock);
+}
+
+/* Descriptor that becomes readable when a block has been read */
+int
+block_prefetcher_event(BlockPrefetcher *prefetcher)
+{
+    return prefetcher->pipe[0];
+}
+
+/*
+ * Consume the notifications; done before checking whether the next block is
+ * ready, so that a block read afterwards always leaves one behind.
+ */
+void
+block_prefetcher_clear_event(BlockPrefetcher *prefetcher)
+{
+    char    buf[64];
+
+    while (read(prefetcher->pipe[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+void
+block_prefetcher_stop(BlockPrefetcher *prefetcher)
+{
+    int     i;
+
+    if (prefetcher->started)
+    {
+        pthread_mutex_lock(&prefetcher->lock);
+        prefetcher->shutdown = true;
+        pthread_cond_broadcast(&prefetcher->cond);
+        pthread_mutex_unlock(&prefetcher->lock);
+
+        pthread_join(prefetcher->thread, NULL);
+        prefetcher->started = false;
+    }
+
+    close(prefetcher->fd);
+    for (i = 0; i < 2; i++)
+        close(prefetcher->pipe[i]);
+    pthread_mutex_destroy(&prefetcher->lock);
+    pthread_cond_destroy(&prefetcher->cond);
+
+    /* scans restarted over and over shouldn't pile up buffers */
+    for (i = 0; i < BLOCK_PREFETCHER_SLOTS; i++)
+        pfree(prefetcher->slots[i].buf);
+    pfree(prefetcher);
+}
@@ -0,0 +1,64 @@
+#ifndef TUPLE_PREFETCHER_H
+#define TUPLE_PREFETCHER_H
+
+#include <pthread.h>
+
+
+#define BLOCK_PREFETCHER_SLOTS  2
+
+typedef enum
+{
+    PREFETCH_FREE,
+    PREFETCH_READING,
+    PREFETCH_READY
+} PrefetchSlotStatus;
+
+/* A block read ahead of the scan */
+typedef struct
+{
+    PrefetchSlotStatus status;
+    Size        offset;         /* of the block in the file */
+    Size        size;           /* header, metadata and compressed data */
+    bool        complete;       /* the whole block fitted into the buffer */
+    int         error;          /* errno of a failed read, -1 if truncated */
+    char       *buf;
+} PrefetchSlot;
+
+/*
+ * Background thread reading the blocks of a sequential scan ahead of it. Like
+ * the block writer it only runs plain C: no memory allocations, no error
+ * reporting.
+ */
+typedef struct
+{
+    pthread_t       thread;
+    bool            started;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             fd;         /* own descriptor of the storage file */
+    int             pipe[2];    /* a byte is written whenever a slot is ready */
+    bool            shutdown;
+    bool            finished;   /* reached the last block */
+    Size            buf_size;
+
+    /* blocks are read one after another up to the last one */
+    Size            next_offset;
+    Size            last_offset;
+
+    /* ring of slots; each position only ever moves forward */
+    PrefetchSlot    slots[BLOCK_PREFETCHER_SLOTS];
+    int             next_read;
+    int             next_take;
+} BlockPrefetcher;
+
+
+BlockPrefetcher *block_prefetcher_start(int fd, Size start_offset,
+                                        Size last_offset, Size buf_size);
+bool block_prefetcher_ready(BlockPrefetcher *prefetcher);
+PrefetchSlot *block_prefetcher_take(BlockPrefetcher *prefetcher, Size offset);
+void block_prefetcher_release(BlockPrefetcher *prefetcher, PrefetchSlot *slot);
+int block_prefetcher_event(BlockPrefetcher *prefetcher);
+void block_prefetcher_clear_event(BlockPrefetcher *prefetcher);
+void block_prefetcher_stop(BlockPrefetcher *prefetcher);
+
+#endif /* TUPLE_PREFETCHER_H */
@@ -0,0 +1,529 @@
+#include "postgres.h"
+#include "lib/stringinfo.h"
+#include "storage/fd.h"
+
+#include "segments.h"
+#include "storage.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/*
+ * Segmented storage
+ * -----------------
+ *
+ * With the `directory` option a table is stored as a set of segment files in
+ * that directory rather than in a single file. Each segment is a regular
+ * storage file with its own sidecar files (block index, tail), so everything
+ * in `storage.c` works on a segment just like on a single file.
+ *
+ * A writer appends to a segment of its own. It holds an exclusive flock() on
+ * the segment while inserting and picks the newest segment nobody else
+ * holds, or creates a new one if all of them are taken. As writers never
+ * share a file they don't have to be serialized by a relation lock, and as
+ * they append through the tail (see `tail.c`) scans run alongside them.
+ * Scans read the segments one after another in the order of their numbers.
+ *
+ * With `segment_blocks` a writer moves on to a new segment once its current
+ * one has that many blocks; full segments are never picked again.
+ *
+ * The manifest (`MANIFEST` in the same directory) lists the segments along
+ * with the range of values of the leading sorted column in each, so that
+ * scans can skip whole segments. The range leaves NULLs out; whether there
+ * are any is recorded separately. Writers update their entry when they're
+ * done with the segment, before releasing it. An entry records the number of
+ * rows it describes: the segment may have been appended to by a writer that
+ * crashed before updating the manifest, and such an entry is ignored. The
+ * manifest is replaced as a whole by renaming a new version over it, and
+ * updates are serialized by a lock on `MANIFEST.lock`.
+ */
+
+static char *
+segment_path(const char *directory, uint32 number)
+{
+    return psprintf("%s/%08u" SEGMENT_SUFFIX, directory, number);
+}
+
+static bool
+parse_segment_name(const char *name, uint32 *number)
+{
+    if (strlen(name) != SEGMENT_NAME_LEN
+        || strspn(name, "0123456789") != 8
+        || strcmp(name + 8, SEGMENT_SUFFIX) != 0)
+        return false;
+
+    *number = strtoul(name, NULL, 10);
+    return true;
+}
+
+static int
+compare_numbers(const void *a, const void *b)
+{
+    uint32  na = *(const uint32 *) a;
+    uint32  nb = *(const uint32 *) b;
+
+    return na < nb ? -1 : (na > nb ? 1 : 0);
+}
+
+/* Numbers of the segments in the directory in ascending order */
+static uint32 *
+list_segment_numbers(const char *directory, int *count)
+{
+    DIR        *dir;
+    struct dirent *de;
+    uint32     *numbers;
+    int         capacity = 16;
+    int         n = 0;
+
+    numbers = palloc(sizeof(uint32) * capacity);
+
+    /* nothing has been written yet */
+    dir = AllocateDir(directory);
+    if (dir == NULL && errno == ENOENT)
+    {
+        *count = 0;
+        return numbers;
+    }
+
+    while ((de = ReadDir(dir, directory)) != NULL)
+    {
+        uint32  number;
+
+        if (!parse_segment_name(de->d_name, &number))
+            continue;
+
+        if (n == capacity)
+        {
+            capacity *= 2;
+            numbers = repalloc(numbers, sizeof(uint32) * capacity);
+        }
+        numbers[n++] = number;
+    }
+    FreeDir(dir);
+
+    qsort(numbers, n, sizeof(uint32), compare_numbers);
+    *count = n;
+
+    return numbers;
+}
+
+/* File names of the segments in the order they are scanned */
+List *
+segment_list(const char *directory)
+{
+    List       *segments = NIL;
+    uint32     *numbers;
+    int         count;
+    int         i;
+
+    numbers = list_segment_numbers(directory, &count);
+    for (i = 0; i < count; i++)
+        segments = lappend(segments, segment_path(directory, numbers[i]));
+    pfree(numbers);
+
+    return segments;
+}
+
+/*
+ * Take the segment unless another writer holds it. Returns the descriptor
+ * holding the lock or -1.
+ */
+static int
+try_lock_segment(const char *path, int flags)
+{
+    struct stat buf;
+    int         fd;
+
+#if PG_VERSION_NUM >= 110000
+    fd = OpenTransientFile(path, flags | PG_BINARY);
+#else
+    fd = OpenTransientFile((FileName) path, flags | PG_BINARY, S_IRUSR | S_IWUSR);
+#endif
+    if (fd < 0)
+    {
+        const char *err = strerror(errno);
+
+        /* removed since listed or created by someone else meanwhile */
+        if (errno == ENOENT || errno == EEXIST)
+            return -1;
+        elog(ERROR, "tuple_fdw: cannot open segment '%s': %s", path, err);
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        int     error = errno;
+
+        CloseTransientFile(fd);
+        if (error == EWOULDBLOCK)
+            return -1;
+        elog(ERROR, "tuple_fdw: cannot lock segment '%s': %s", path, strerror(error));
+    }
+
+    /* the segment may have been removed between opening and locking it */
+    if (fstat(fd, &buf) != 0 || buf.st_nlink == 0)
+    {
+        CloseTransientFile(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Check whether the segment has `max_blocks` blocks already (0 - no limit) */
+static bool
+segment_is_full(const char *path, uint64 max_blocks)
+{
+    StorageFileHeader header;
+    Size        file_size;
+
+    return max_blocks > 0
+        && StorageReadFileInfo(path, &header, &file_size, NULL, NULL)
+        && header.nblocks >= max_blocks;
+}
+
+/*
+ * Find a segment for a writer to append to and lock it. The lock is held
+ * until `segment_unlock` is called with the returned `lock_fd`, or until the
+ * transaction is aborted.
+ */
+char *
+segment_acquire(const char *directory, uint64 max_blocks, int *lock_fd)
+{
+    uint32     *numbers;
+    uint32      next;
+    int         count;
+    int         i;
+
+    /* the newest segments are the least likely to be busy */
+    numbers = list_segment_numbers(directory, &count);
+    for (i = count - 1; i >= 0; i--)
+    {
+        char   *path = segment_path(directory, numbers[i]);
+
+        if ((*lock_fd = try_lock_segment(path, O_RDWR)) >= 0)
+        {
+            if (!segment_is_full(path, max_blocks))
+            {
+                pfree(numbers);
+                return path;
+            }
+            segment_unlock(*lock_fd);
+        }
+        pfree(path);
+    }
+
+    /* all taken; other writers may be starting new segments too */
+    next = count > 0 ? numbers[count - 1] + 1 : 1;
+    pfree(numbers);
+
+    for (;;)
+    {
+        char   *path = segment_path(directory, next++);
+
+        if ((*lock_fd = try_lock_segment(path, O_RDWR | O_CREAT | O_EXCL)) >= 0)
+            return path;
+        pfree(path);
+    }
+}
+
+void
+segment_unlock(int lock_fd)
+{
+    /* closing the descriptor releases the lock */
+    CloseTransientFile(lock_fd);
+}
+
+/*
+ * Remove the segments along with their side files and manifest entries. The
+ * caller makes sure nobody is using them.
+ */
+void
+segment_remove(const char *directory, List *filenames)
+{
+    static const char *const suffixes[] = {"", ".idx", ".tail"};
+    ListCell   *lc;
+
+    foreach (lc, filenames)
+    {
+        const char *filename = (const char *) lfirst(lc);
+        int         i;
+
+        /* the segment itself goes first: side files alone are ignored */
+        for (i = 0; i < lengthof(suffixes); i++)
+        {
+            char   *path = psprintf("%s%s", filename, suffixes[i]);
+
+            if (unlink(path) != 0 && errno != ENOENT)
+            {
+                const char *err = strerror(errno);
+
+                elog(ERROR, "tuple_fdw: cannot remove file '%s': %s", path, err);
+            }
+            pfree(path);
+        }
+    }
+    fsync_fname(directory, true);
+
+    manifest_remove(directory, filenames);
+}
+
+/* Manifest */
+
+static pg_crc32c
+manifest_checksum(const char *data, Size size)
+{
+    pg_crc32c   crc;
+
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, data, size);
+    FIN_CRC32C(crc);
+
+    return crc;
+}
+
+/* Parse the manifest; returns false if it's corrupted */
+static bool
+parse_manifest(const char *buf, Size size, List **entries)
+{
+    ManifestHeader  header;
+    const char     *ptr = buf + sizeof(ManifestHeader);
+    uint32          i;
+
+    if (size < sizeof(ManifestHeader))
+        return false;
+
+    memcpy(&header, buf, sizeof(ManifestHeader));
+    if (header.magic != MANIFEST_MAGIC
+        || header.version != MANIFEST_VERSION
+        || !EQ_CRC32C(header.checksum, manifest_checksum(ptr, size - sizeof(ManifestHeader))))
+        return false;
+
+    for (i = 0; i < header.nentries; i++)
+    {
+        ManifestEntry   entry;
+        SegmentInfo    *info;
+
+        if (ptr + sizeof(ManifestEntry) > buf + size)
+            return false;
+        memcpy(&entry, ptr, sizeof(ManifestEntry));
+        ptr += sizeof(ManifestEntry);
+        if (ptr + entry.range_size > buf + size)
+            return false;
+
+        info = palloc0(sizeof(SegmentInfo));
+        memcpy(info->name, entry.name, SEGMENT_NAME_LEN);
+        info->ntuples = entry.ntuples;
+        info->attnum = entry.attnum;
+        info->has_nulls = entry.has_nulls;
+        info->range_size = entry.range_size;
+        info->range = palloc(Max(entry.range_size, 1));
+        memcpy(info->range, ptr, entry.range_size);
+        ptr += entry.range_size;
+
+        *entries = lappend(*entries, info);
+    }
+
+    return true;
+}
+
+/*
+ * Read the manifest. A missing or corrupted one is empty: all it costs is
+ * scans not skipping segments until writers fill it in again.
+ */
+List *
+manifest_read(const char *directory)
+{
+    char       *path = psprintf("%s/" MANIFEST_FILE, directory);
+    List       *entries = NIL;
+    FILE       *file;
+    struct stat buf;
+    char       *data;
+
+    if ((file = AllocateFile(path, PG_BINARY_R)) == NULL)
+    {
+        const char *err = strerror(errno);
+
+        if (errno != ENOENT)
+            elog(ERROR, "tuple_fdw: cannot open manifest '%s': %s", path, err);
+        pfree(path);
+        return NIL;
+    }
+
+    if (fstat(fileno(file), &buf) != 0)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot get manifest status: %s", err);
+    }
+
+    data = palloc(Max(buf.st_size, 1));
+    if (fread(data, 1, buf.st_size, file) != (size_t) buf.st_size
+        || !parse_manifest(data, buf.st_size, &entries))
+    {
+        elog(WARNING, "tuple_fdw: manifest '%s' is corrupted and is ignored", path);
+        entries = NIL;
+    }
+
+    pfree(data);
+    FreeFile(file);
+    pfree(path);
+
+    return entries;
+}
+
+/* Name of the segment stored in the file, as the manifest has it */
+static const char *
+segment_name(const char *filename)
+{
+    const char *name = strrchr(filename, '/');
+
+    return name ? name + 1 : filename;
+}
+
+/* Entry of the segment stored in the file, if any */
+SegmentInfo *
+manifest_find(List *manifest, const char *filename)
+{
+    const char *name = segment_name(filename);
+    ListCell   *lc;
+
+    foreach (lc, manifest)
+    {
+        SegmentInfo *info = (SegmentInfo *) lfirst(lc);
+
+        if (strcmp(info->name, name) == 0)
+            return info;
+    }
+
+    return NULL;
+}
+
+/* Serialize the entries and put the result in place of the manifest */
+static void
+write_manifest(const char *directory, List *entries)
+{
+    char           *path = psprintf("%s/" MANIFEST_FILE, directory);
+    char           *tmp_path = psprintf("%s.tmp", path);
+    StringInfoData  buf;
+    ManifestHeader  header;
+    ListCell       *lc;
+    int             fd;
+
+    initStringInfo(&buf);
+    memset(&header, 0, sizeof(ManifestHeader));
+    appendBinaryStringInfo(&buf, (char *) &header, sizeof(ManifestHeader));
+
+    foreach (lc, entries)
+    {
+        SegmentInfo    *info = (SegmentInfo *) lfirst(lc);
+        ManifestEntry   entry;
+
+        memset(&entry, 0, sizeof(ManifestEntry));
+        memcpy(entry.name, info->name, SEGMENT_NAME_LEN);
+        entry.ntuples = info->ntuples;
+        entry.attnum = info->attnum;
+        entry.has_nulls = info->has_nulls;
+        entry.range_size = info->range_size;
+        appendBinaryStringInfo(&buf, (char *) &entry, sizeof(ManifestEntry));
+        appendBinaryStringInfo(&buf, info->range, info->range_size);
+    }
+
+    header.magic = MANIFEST_MAGIC;
+    header.version = MANIFEST_VERSION;
+    header.nentries = list_length(entries);
+    header.checksum = manifest_checksum(buf.data + sizeof(ManifestHeader),
+                                        buf.len - sizeof(ManifestHeader));
+    memcpy(buf.data, &header, sizeof(ManifestHeader));
+
+#if PG_VERSION_NUM >= 110000
+    fd = OpenTransientFile(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+#else
+    fd = OpenTransientFile(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+                           S_IRUSR | S_IWUSR);
+#endif
+    if (fd < 0 || write(fd, buf.data, buf.len) != buf.len || pg_fsync(fd) != 0)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot write manifest '%s': %s", tmp_path, err);
+    }
+    CloseTransientFile(fd);
+
+    /* fsyncs the directory too */
+    durable_rename(tmp_path, path, ERROR);
+
+    pfree(buf.data);
+    pfree(tmp_path);
+    pfree(path);
+}
+
+/* Serialize manifest updates; released by closing the descriptor */
+static int
+lock_manifest(const char *directory)
+{
+    char   *path = psprintf("%s/" MANIFEST_FILE ".lock", directory);
+    int     fd;
+
+#if PG_VERSION_NUM >= 110000
+    fd = OpenTransientFile(path, O_RDWR | O_CREAT | PG_BINARY);
+#else
+    fd = OpenTransientFile(path, O_RDWR | O_CREAT | PG_BINARY, S_IRUSR | S_IWUSR);
+#endif
+    if (fd < 0 || flock(fd, LOCK_EX) != 0)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot lock manifest '%s': %s", path, err);
+    }
+    pfree(path);
+
+    return fd;
+}
+
+/* Add or replace the entry of the segment */
+void
+manifest_update(const char *directory, SegmentInfo *info)
+{
+    int         lock_fd = lock_manifest(directory);
+    List       *entries = manifest_read(directory);
+    SegmentInfo *old = manifest_find(entries, info->name);
+
+    if (old)
+        *old = *info;
+    else
+        entries = lappend(entries, info);
+    write_manifest(directory, entries);
+
+    CloseTransientFile(lock_fd);
+}
+
+/* Remove the entries of the segments */
+void
+manifest_remove(const char *directory, List *filenames)
+{
+    int         lock_fd = lock_manifest(directory);
+    List       *entries = manifest_read(directory);
+    List       *kept = NIL;
+    ListCell   *lc;
+
+    foreach (lc, entries)
+    {
+        SegmentInfo *info = (SegmentInfo *) lfirst(lc);
+        ListCell   *lc2;
+        bool        removed = false;
+
+        foreach (lc2, filenames)
+            if (strcmp(info->name, segment_name((char *) lfirst(lc2))) == 0)
+                removed = true;
+
+        if (!removed)
+            kept = lappend(kept, info);
+    }
+    write_manifest(directory, kept);
+
+    CloseTransientFile(lock_fd);
+}
@@ -0,0 +1,57 @@
+#ifndef TUPLE_SEGMENTS_H
+#define TUPLE_SEGMENTS_H
+
+#include "access/attnum.h"
+#include "nodes/pg_list.h"
+#include "port/pg_crc32c.h"
+
+
+/* Segment files are named by their number: 00000001.seg, 00000002.seg... */
+#define SEGMENT_SUFFIX      ".seg"
+#define SEGMENT_NAME_LEN    (8 + sizeof(SEGMENT_SUFFIX) - 1)
+
+#define MANIFEST_FILE       "MANIFEST"
+#define MANIFEST_MAGIC      0x4D4C5054  /* "TPLM" */
+#define MANIFEST_VERSION    1
+
+typedef struct
+{
+    uint32      magic;
+    uint32      version;
+    uint32      nentries;
+    pg_crc32c   checksum;   /* covers the entries following the header */
+} ManifestHeader;
+
+/* Manifest entry as stored in the file; the serialized range follows it */
+typedef struct
+{
+    char        name[SEGMENT_NAME_LEN + 1];
+    uint64      ntuples;
+    int16       attnum;
+    bool        has_nulls;
+    uint32      range_size;
+} ManifestEntry;
+
+/* What the manifest knows about a segment */
+typedef struct
+{
+    char        name[SEGMENT_NAME_LEN + 1];
+    uint64      ntuples;    /* rows in the segment and its tail */
+    AttrNumber  attnum;     /* column the range is of, 0 if it isn't known */
+    bool        has_nulls;  /* the column may be NULL, which the range leaves out */
+    uint32      range_size;
+    char       *range;      /* serialized min and max values */
+} SegmentInfo;
+
+
+List *segment_list(const char *directory);
+char *segment_acquire(const char *directory, uint64 max_blocks, int *lock_fd);
+void segment_unlock(int lock_fd);
+void segment_remove(const char *directory, List *filenames);
+
+List *manifest_read(const char *directory);
+SegmentInfo *manifest_find(List *manifest, const char *filename);
+void manifest_update(const char *directory, SegmentInfo *info);
+void manifest_remove(const char *directory, List *filenames);
+
+#endif /* TUPLE_SEGMENTS_H */
@@ -1,5 +1,22 @@
 #include "postgres.h"
+#include "miscadmin.h"
+#include "access/hash.h"
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#define detoast_external_attr heap_tuple_fetch_attr
+#endif
+#include "access/htup_details.h"
+#include "access/nbtree.h"
+#include "catalog/pg_type.h"
 #include "storage/fd.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/formatting.h"
+#include "utils/lsyscache.h"
+#include "utils/timestamp.h"
+#include "utils/typcache.h"
 #include "lz4.h"
 
 #include "storage.h"
@@ -16,18 +33,24 @@
  *
  * Storage file consists of header and a set of data blocks each of which
  * contains tuples. Data block starts with a header containing compressed block
- * data size and checksum. Compressed data consists of tuples, each contains
- * a header and tuple itself (memcpy of HeapTupleHeaderData and tuple body).
+ * data size, checksum, number of tuples and the size of block metadata.
+ * Metadata (e.g. min and max values of some columns) is stored uncompressed
+ * so that it could be read without decompressing the block. Compressed data
+ * consists of tuples, each contains a header and tuple itself (memcpy of
+ * HeapTupleHeaderData and tuple body).
  *
- * Storage header currently contains only the last block offset to speedup
- * inserts.
+ * Storage header contains the format version, the creation time, the last
+ * block offset to speedup inserts and the total number of blocks and tuples. It occupies
+ * the first 4 kilobytes of the file.
  *
  * The storage file layout can be visualized as follows:
  *
  * ┌──────────────────────────────────────────────┐
- * │ StorageFileHeader                            │   ─ 8 bytes
+ * │ StorageFileHeader                            │   ─ 4 kilobytes
  * ├──────────────────────────────────────────────┤
- * │ StorageBlockHeader                           │   ─ 8 bytes
+ * │ StorageBlockHeader                           │   ─ 16 bytes
+ * ├──────────────────────────────────────────────┤
+ * │ Block metadata                               │   ─ meta_size bytes
  * ├────────────────────┬─────────────────────────┤
  * │ StorageTupleHeader │ tuple body              │  ┐
  * ├──────────┬─────────┴──────────┬──────────────┤  │
@@ -46,6 +69,8 @@
 
 
 static void allocate_new_block(StorageState *state);
+static void mmap_file(StorageState *state);
+static void refresh_pooled_mapping(StorageState *state);
 
 
 /* Basic low level operations */
@@ -70,348 +95,3562 @@ storage_write(StorageState *state, const void *ptr, Size size)
 
 /* Storage file manipulations */
 
-static void
-write_storage_file_header(StorageState *state)
+static pg_crc32c
+file_header_checksum(StorageFileHeader *header)
 {
-    storage_seek(state, 0);
-    storage_write(state, &state->file_header, sizeof(StorageFileHeader));
+    pg_crc32c   crc;
+
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, header, offsetof(StorageFileHeader, checksum));
+    FIN_CRC32C(crc);
+
+    return crc;
 }
 
-static void
-read_storage_file_header(StorageState *state)
+/*
+ * Pick the latest valid header out of the header slots found at the start of
+ * the file. On failure the first slot is returned for error reporting.
+ */
+static bool
+choose_file_header(const char *buf, Size size, StorageFileHeader *header)
 {
-    Size bytes;
+    StorageFileHeader slots[2];
+    bool        found = false;
+    int         i;
 
-    if (state->mmaped_file)
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < 2; i++)
     {
-        Assert(state->readonly);
-        memcpy(&state->file_header, state->mmaped_file, sizeof(StorageFileHeader));
+        Size    pos = i * StorageFileHeaderSlotSize;
+
+        if (size > pos)
+            memcpy(&slots[i], buf + pos, Min(sizeof(StorageFileHeader), size - pos));
+
+        if (slots[i].magic == STORAGE_MAGIC
+            && slots[i].version == STORAGE_VERSION
+            && EQ_CRC32C(slots[i].checksum, file_header_checksum(&slots[i]))
+            && (!found || slots[i].generation > header->generation))
+        {
+            *header = slots[i];
+            found = true;
+        }
     }
-    else
-    {
-        storage_seek(state, 0);
-        bytes = fread(&state->file_header, 1, sizeof(StorageFileHeader), state->file);
 
-        if (bytes == 0)
-        {   
-            /* it's a brand new file, initialize new header */
-            state->file_header.last_block_offset = sizeof(StorageFileHeader);
+    if (!found)
+        *header = slots[0];
 
-            /* write it to the disk if possible*/
-            if (!state->readonly)
-                write_storage_file_header(state);
-        }
-    }
+    return found;
 }
 
-static void
-decompress_block(StorageState *state, char *compressed_data, Size len)
+static pg_crc32c
+file_stats_checksum(StorageFileStats *stats, const char *entries)
 {
-    int size;
+    pg_crc32c   crc;
 
-    size = LZ4_decompress_safe(compressed_data,
-                               state->cur_block.data,
-                               len,
-                               BLOCK_SIZE);
-    if (size < 0)
-        elog(ERROR, "tuple_fdw: decompression failed");
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, stats, offsetof(StorageFileStats, checksum));
+    COMP_CRC32C(crc, entries, stats->size);
+    FIN_CRC32C(crc);
 
-    Assert(BLOCK_SIZE == size);
+    return crc;
 }
 
-static bool
-read_block(StorageState* state, Size offset)
+/*
+ * Find the file statistics written along with the chosen header, if any, in
+ * the header slots. Returns a copy of the entries.
+ */
+static char *
+find_file_stats(const char *buf, Size size, StorageFileHeader *header,
+                Size *stats_size)
 {
-    StorageBlockHeader *block_header;
-    StorageBlockHeader  b;
-    char       *compressed_data;
-    Size        bytes;
-    pg_crc32c   crc;
+    StorageFileStats stats;
+    Size        pos;
+    char       *result;
+
+    pos = (header->generation % 2) * StorageFileHeaderSlotSize
+        + StorageFileStatsOffset;
+    if (size < pos + StorageFileStatsSize)
+        return NULL;
+
+    memcpy(&stats, buf + pos, sizeof(StorageFileStats));
+    pos += StorageFileStatsSize;
+    if (stats.magic != STORAGE_STATS_MAGIC
+        || stats.generation != header->generation
+        || stats.size > size - pos
+        || !EQ_CRC32C(stats.checksum, file_stats_checksum(&stats, buf + pos)))
+        return NULL;
+
+    result = palloc(stats.size);
+    memcpy(result, buf + pos, stats.size);
+    *stats_size = stats.size;
+
+    return result;
+}
 
-    if (state->mmaped_file)
-    {
-        if (offset >= state->mmaped_size)
-            return false;
+/*
+ * Serialize the ranges of the stats columns over the whole file into the
+ * header slot, after the header. A column which doesn't fit any more is left
+ * out, and its range stays unknown from now on. Returns the number of bytes
+ * of the slot to write.
+ */
+static Size
+serialize_file_stats(StorageState *state, char *slot)
+{
+    StorageFileStats *stats = (StorageFileStats *) (slot + StorageFileStatsOffset);
+    char       *entries = slot + StorageFileStatsOffset + StorageFileStatsSize;
+    char       *buf = entries;
+    int         i;
 
-        block_header = (StorageBlockHeader *) (state->mmaped_file + offset);
-        compressed_data = block_header->data;
-    }
-    else
+    for (i = 0; i < state->nstats; i++)
     {
-        /* read the block */
-        storage_seek(state, offset);
-
-        bytes = fread(&b, 1, StorageBlockHeaderSize, state->file);
-        if (bytes != StorageBlockHeaderSize)
-            return false;
-
-        Assert(b.compressed_size > 0);
+        StorageStatsColumn *col = &state->stats[i];
+        StorageMetaEntry   *entry = (StorageMetaEntry *) buf;
+        char       *ptr = entry->data;
+        Size        payload;
+
+        if (!col->file_valid)
+            continue;
+
+        payload = datumEstimateSpace(col->file_min, !col->file_has_value,
+                                     col->typbyval, col->typlen)
+            + datumEstimateSpace(col->file_max, !col->file_has_value,
+                                 col->typbyval, col->typlen);
+        if (buf + MAXALIGN(StorageMetaEntrySize + payload) > slot + StorageFileHeaderSlotSize)
+        {
+            col->file_valid = false;
+            continue;
+        }
 
-        compressed_data = palloc(b.compressed_size);
-        bytes = fread(compressed_data, 1, b.compressed_size, state->file);
-        if (bytes != b.compressed_size)
-            return false;
+        entry->kind = BLOCK_META_MINMAX;
+        entry->attnum = col->attnum;
+        datumSerialize(col->file_min, !col->file_has_value,
+                       col->typbyval, col->typlen, &ptr);
+        datumSerialize(col->file_max, !col->file_has_value,
+                       col->typbyval, col->typlen, &ptr);
+        entry->size = ptr - entry->data;
 
-        block_header = &b;
+        buf += MAXALIGN(StorageMetaEntrySize + entry->size);
     }
 
-    /* calculate checksum and compare it to a stored one */
-    INIT_CRC32C(crc);
-    COMP_CRC32C(crc, compressed_data, block_header->compressed_size);
-    FIN_CRC32C(crc);
+    if (buf == entries)
+        return sizeof(StorageFileHeader);
 
-    if (!EQ_CRC32C(crc, block_header->checksum))
-        elog(ERROR, "tuple_fdw: wrong checksum");
+    stats->magic = STORAGE_STATS_MAGIC;
+    stats->size = buf - entries;
+    stats->generation = state->file_header.generation;
+    stats->checksum = file_stats_checksum(stats, entries);
 
-    decompress_block(state, compressed_data, block_header->compressed_size);
+    return buf - slot;
+}
 
-    state->cur_block.offset = offset;
-    state->cur_block.status = BS_LOADED;
-    state->cur_block.compressed_size = block_header->compressed_size;
-    state->cur_offset = 0;
+/*
+ * Files written by tuple_fdw 0.1 start with the offset of the last block
+ * followed by the first block (if any), whose compressed size is positive.
+ */
+static bool
+is_version_01_file(const char *buf, Size size)
+{
+    uint32  magic;
+    Size    last_block_offset;
+    int32   compressed_size;
+
+    if (size < sizeof(Size))
+        return false;
+    memcpy(&magic, buf, sizeof(uint32));
+    memcpy(&last_block_offset, buf, sizeof(Size));
+    if (magic == STORAGE_MAGIC)
+        return false;
+
+    if (last_block_offset == sizeof(Size))
+        return true;
+    if (last_block_offset < sizeof(Size) || size < sizeof(Size) + sizeof(int32))
+        return false;
+    memcpy(&compressed_size, buf + sizeof(Size), sizeof(int32));
+
+    return compressed_size > 0;
+}
 
-    return true;
+static void
+report_invalid_header(StorageState *state, const char *buf, Size size)
+{
+    StorageFileHeader *header = &state->file_header;
+
+    if (is_version_01_file(buf, size))
+        ereport(ERROR,
+                (errmsg("tuple_fdw: file '%s' was written by tuple_fdw 0.1",
+                        state->filename),
+                 errhint("The storage format has changed since; reload the data into a new file.")));
+    if (header->magic != STORAGE_MAGIC)
+        elog(ERROR, "tuple_fdw: file '%s' is not a tuple_fdw storage",
+             state->filename);
+    if (header->version != STORAGE_VERSION)
+        elog(ERROR, "tuple_fdw: file '%s' has unsupported storage version %u",
+             state->filename, header->version);
+    elog(ERROR, "tuple_fdw: file '%s' has a corrupted header", state->filename);
 }
 
-static bool
-load_next_block(StorageState *state)
+/*
+ * Make sure everything written so far has reached the disk, unless the sync
+ * mode leaves it to the OS.
+ */
+static void
+sync_storage_file(StorageState *state)
 {
-    Size    offset;
+    if (fflush(state->file) != 0)
+    {
+        const char *err = strerror(errno);
 
-    if (BlockIsInvalid(state->cur_block))
+        elog(ERROR, "tuple_fdw: write failed: %s", err);
+    }
+
+    if (state->sync_mode == SYNC_NONE)
+        return;
+
+    if (fsync(fileno(state->file)) != 0)
     {
-        /* we're about to read the first block in the file */
-        offset = sizeof(StorageFileHeader);
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot fsync file '%s': %s", state->filename, err);
     }
-    else
+    state->unsynced = false;
+}
+
+/*
+ * Write the next generation of the header into the slot not holding the
+ * current one. The data it refers to must be synced beforehand.
+ */
+static void
+write_storage_file_header(StorageState *state)
+{
+    StorageFileHeader *header = &state->file_header;
+    char       *slot;
+    Size        size;
+
+    header->version = STORAGE_VERSION;
+    header->generation++;
+    header->checksum = file_header_checksum(header);
+
+    slot = palloc0(StorageFileHeaderSlotSize);
+    memcpy(slot, header, sizeof(StorageFileHeader));
+    size = serialize_file_stats(state, slot);
+
+    storage_seek(state, (header->generation % 2) * StorageFileHeaderSlotSize);
+    storage_write(state, slot, size);
+    pfree(slot);
+    if (fflush(state->file) != 0)
     {
-        offset = state->cur_block.offset \
-            + StorageBlockHeaderSize \
-            + state->cur_block.compressed_size;
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: write failed: %s", err);
     }
 
-    return read_block(state, offset);
+    state->header_dirty = false;
+    state->unsynced = true;
 }
 
 static void
-load_last_block(StorageState *state)
+init_file_header(StorageState *state)
 {
-    /* read the last block */
-    if (read_block(state, state->file_header.last_block_offset) == true)
+    memset(&state->file_header, 0, sizeof(StorageFileHeader));
+    state->file_header.magic = STORAGE_MAGIC;
+    state->file_header.version = STORAGE_VERSION;
+    state->file_header.last_block_offset = StorageFileHeaderSize;
+    state->file_header.created = (uint64) GetCurrentTimestamp();
+}
+
+static void
+read_storage_file_header(StorageState *state)
+{
+    char    buf[2 * StorageFileHeaderSlotSize];
+    Size    bytes;
+
+    if (state->file_stats)
+        pfree(state->file_stats);
+    state->file_stats = NULL;
+    state->file_stats_size = 0;
+
+    if (state->mmaped_file)
     {
-        state->cur_block.offset = state->file_header.last_block_offset;
-        state->cur_block.status = BS_LOADED;
+        Assert(state->readonly);
+        bytes = Min(state->mmaped_size, sizeof(buf));
+        memcpy(buf, state->mmaped_file, bytes);
     }
     else
     {
-        allocate_new_block(state);
-    }
-}
+        storage_seek(state, 0);
+        bytes = fread(buf, 1, sizeof(buf), state->file);
 
-static void
-find_last_tuple_offset(StorageState *state)
-{
-    Size    off = 0;
+        if (bytes == 0)
+        {
+            /* it's a brand new file, initialize new header */
+            init_file_header(state);
 
-    /* iterate over tuples in the block */
-    while (off < BLOCK_SIZE)
+            /* write it to the disk if possible*/
+            if (!state->readonly)
+            {
+                write_storage_file_header(state);
+                sync_storage_file(state);
+            }
+            return;
+        }
+    }
+
+    if (bytes < offsetof(StorageFileHeader, generation))
     {
-        StorageTupleHeader  *st_header;
+        /* an empty 0.1 file has nothing but the offset */
+        if (is_version_01_file(buf, bytes))
+            report_invalid_header(state, buf, bytes);
+        elog(ERROR, "tuple_fdw: file '%s' is truncated", state->filename);
+    }
 
-        st_header = (StorageTupleHeader *) (state->cur_block.data + off);
+    if (choose_file_header(buf, bytes, &state->file_header))
+    {
+        MemoryContext oldcxt = MemoryContextSwitchTo(state->mcxt);
 
-        if (st_header->length == 0)
-            break;
+        state->file_stats = find_file_stats(buf, bytes, &state->file_header,
+                                            &state->file_stats_size);
+        MemoryContextSwitchTo(oldcxt);
+        return;
+    }
 
-        off = off + st_header->length + StorageTupleHeaderSize;
+    /*
+     * The very first header goes to the second slot. A reader finding
+     * nothing in the first one may be looking at a segment being created by
+     * a concurrent writer, which is empty anyway.
+     */
+    if (state->readonly && state->file_header.magic == 0)
+    {
+        init_file_header(state);
+        return;
     }
 
-    state->cur_offset = off;
+    report_invalid_header(state, buf, bytes);
 }
 
-static StorageBlockHeader *
-compress_current_block(StorageState *state)
-{
-    Size    estimate;
-    Size    size;
-    StorageBlockHeader *block_header;
-    pg_crc32c   crc;
+/* Block statistics */
 
-    estimate = LZ4_compressBound(BLOCK_SIZE);
-    block_header = (StorageBlockHeader *) \
-        palloc0(StorageBlockHeaderSize + estimate);
+#if PG_VERSION_NUM < 110000
+#define HASHSTANDARD_PROC HASHPROC
+#endif
 
-    size = LZ4_compress_fast(state->cur_block.data,
-                             block_header->data,
-                             BLOCK_SIZE,
-                             estimate,
-                             state->lz4_acceleration);
-    if (size == 0)
-        elog(ERROR, "tuple_fdw: compression failed");
-    block_header->compressed_size = size;
+static int
+find_stats_column(StorageState *state, AttrNumber attnum)
+{
+    int     i;
 
-    /* calculate checksum */
-    INIT_CRC32C(crc);
-    COMP_CRC32C(crc, block_header->data, size);
-    FIN_CRC32C(crc);
-    block_header->checksum = crc;
+    for (i = 0; i < state->nstats; i++)
+        if (state->stats[i].attnum == attnum)
+            return i;
 
-    return block_header;
+    return -1;
 }
 
-static void
-flush_last_block(StorageState *state)
+static int
+find_bloom_column(StorageState *state, AttrNumber attnum, uint16 kind)
 {
-    StorageBlockHeader *block_header;
-    Size                block_size;
+    int     i;
 
-    Assert(!BlockIsInvalid(state->cur_block));
+    for (i = 0; i < state->nblooms; i++)
+        if (state->blooms[i].attnum == attnum && state->blooms[i].kind == kind)
+            return i;
 
-    if (state->cur_block.status == BS_LOADED)
+    return -1;
+}
+
+static void
+add_block_hash(StorageState *state, StorageBloomColumn *col, uint32 hash)
+{
+    if (col->nhashes >= col->capacity)
     {
-        /* no modifications were made */
-        return;
+        col->capacity = col->capacity > 0 ? col->capacity * 2 : 1024;
+        col->hashes = col->hashes ?
+            repalloc(col->hashes, sizeof(uint32) * col->capacity) :
+            MemoryContextAlloc(state->mcxt, sizeof(uint32) * col->capacity);
     }
+    col->hashes[col->nhashes++] = hash;
+}
 
-    /* compress */
-    block_header = compress_current_block(state);
-    block_size = StorageBlockHeaderSize + block_header->compressed_size;
+static void
+add_block_ngrams(StorageState *state, StorageBloomColumn *col,
+                 const char *str, int len, bool lowered)
+{
+    int     i;
 
-    /* write out to disk */
-    storage_seek(state, state->cur_block.offset);
-    storage_write(state, block_header, block_size);
+    for (i = 0; i + NGRAM_LEN <= len; i++)
+        add_block_hash(state, col, ngram_hash(str + i, lowered));
+}
 
-    state->cur_block.compressed_size = block_header->compressed_size;
+static Datum
+copy_stats_value(StorageState *state, StorageStatsColumn *col, Datum value)
+{
+    MemoryContext oldcxt = MemoryContextSwitchTo(state->mcxt);
 
-    /* if new block is being flushed overwrite the file header */
-    if (state->cur_block.status == BS_NEW)
-    {
-        state->file_header.last_block_offset = state->cur_block.offset;
-        write_storage_file_header(state);
-        state->cur_block.status = BS_LOADED;
-    }
-    fsync(fileno(state->file));
+    value = datumCopy(value, col->typbyval, col->typlen);
+    MemoryContextSwitchTo(oldcxt);
 
-    pfree(block_header);
+    return value;
 }
 
 static void
-allocate_new_block(StorageState *state)
+reset_block_stats(StorageState *state)
 {
-    Block *block = &state->cur_block;
+    int     i;
 
-    if (block->offset != 0)
+    for (i = 0; i < state->nstats; i++)
     {
-        block->offset = state->cur_block.offset \
-                        + StorageBlockHeaderSize \
-                        + block->compressed_size;
+        StorageStatsColumn *col = &state->stats[i];
+
+        if (col->has_value && !col->typbyval)
+        {
+            pfree(DatumGetPointer(col->min));
+            pfree(DatumGetPointer(col->max));
+        }
+        col->has_value = false;
     }
-    else
+
+    for (i = 0; i < state->nblooms; i++)
+        state->blooms[i].nhashes = 0;
+}
+
+/*
+ * Widen the [min, max] range of the column values to cover the value. Returns
+ * false if it did already.
+ */
+static bool
+extend_range(StorageState *state, StorageStatsColumn *col, Datum value,
+             bool *has_value, Datum *min, Datum *max)
+{
+    if (!*has_value)
     {
-        /*
-         * this is the first block in the storage, it goes straight next to
-         * the file header
-         */
-        block->offset = sizeof(StorageFileHeader);
+        *min = copy_stats_value(state, col, value);
+        *max = copy_stats_value(state, col, value);
+        *has_value = true;
+        return true;
     }
 
-    memset(block->data, 0, BLOCK_SIZE);
-    block->status = BS_NEW;
+    if (DatumGetInt32(FunctionCall2Coll(&col->cmp, col->collation,
+                                        value, *min)) < 0)
+    {
+        if (!col->typbyval)
+            pfree(DatumGetPointer(*min));
+        *min = copy_stats_value(state, col, value);
+        return true;
+    }
+    else if (DatumGetInt32(FunctionCall2Coll(&col->cmp, col->collation,
+                                             value, *max)) > 0)
+    {
+        if (!col->typbyval)
+            pfree(DatumGetPointer(*max));
+        *max = copy_stats_value(state, col, value);
+        return true;
+    }
 
-    state->cur_offset = 0;
+    return false;
 }
 
 static void
-mmap_file(StorageState *state)
+update_block_stats(StorageState *state, HeapTuple tuple)
 {
-    struct stat buf;
-    int         fd = fileno(state->file);
-    
-    if (fstat(fd, &buf) != 0)
+    int     i;
+
+    for (i = 0; i < state->nstats; i++)
     {
-        const char *err = strerror(errno);
+        StorageStatsColumn *col = &state->stats[i];
+        Datum   original;
+        Datum   value;
+        bool    isnull;
+
+        original = heap_getattr(tuple, col->attnum, state->tupdesc, &isnull);
+        if (isnull)
+        {
+            if (i == 0 && state->track_range)
+                state->range_has_nulls = true;
+            continue;
+        }
 
-        elog(ERROR, "tuple_fdw: cannot get file status: %s", err);
+        /* statistics are stored along with the block, no toast pointers */
+        value = original;
+        if (col->typlen == -1)
+            value = PointerGetDatum(PG_DETOAST_DATUM_PACKED(original));
+
+        extend_range(state, col, value, &col->has_value, &col->min, &col->max);
+
+        /* the range of the whole file is only needed for the first one */
+        if (i == 0 && state->track_range)
+            extend_range(state, col, value, &state->range_has_value,
+                         &state->range_min, &state->range_max);
+
+        /* the header has to cover the row before it's committed */
+        if (col->file_valid
+            && extend_range(state, col, value, &col->file_has_value,
+                            &col->file_min, &col->file_max))
+            state->header_dirty = true;
+
+        /* ranges keep copies of their own */
+        if (DatumGetPointer(value) != DatumGetPointer(original))
+            pfree(DatumGetPointer(value));
     }
 
-    state->mmaped_file = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (state->mmaped_file == MAP_FAILED)
+    /* Bloom filters are built from the hashes when the block is flushed */
+    for (i = 0; i < state->nblooms; i++)
     {
-        const char *err = strerror(errno);
-
-        elog(ERROR, "tuple_fdw: mmap failed: %s", err);
+        StorageBloomColumn *col = &state->blooms[i];
+        Datum   value;
+        bool    isnull;
+
+        value = heap_getattr(tuple, col->attnum, state->tupdesc, &isnull);
+        if (isnull)
+            continue;
+
+        if (col->kind == BLOCK_META_NGRAM)
+        {
+            text   *txt = DatumGetTextPP(value);
+            char   *lowered;
+
+            add_block_ngrams(state, col, VARDATA_ANY(txt),
+                             VARSIZE_ANY_EXHDR(txt), false);
+
+            /* lowered the same way ILIKE does it */
+            lowered = str_tolower(VARDATA_ANY(txt), VARSIZE_ANY_EXHDR(txt),
+                                  col->collation);
+            add_block_ngrams(state, col, lowered, strlen(lowered), true);
+
+            pfree(lowered);
+            if ((Pointer) txt != DatumGetPointer(value))
+                pfree(txt);
+        }
+        else
+            add_block_hash(state, col,
+                           DatumGetUInt32(FunctionCall1Coll(&col->hash,
+                                                            col->collation,
+                                                            value)));
     }
-    state->mmaped_size = buf.st_size;
 }
 
-void
-unmap_file(StorageState *state)
+/*
+ * Estimate the size of the block metadata. Also removes duplicate hashes
+ * which don't matter to Bloom filters.
+ */
+static Size
+estimate_block_meta_size(StorageState *state)
 {
-    if (munmap(state->mmaped_file, state->mmaped_size) == -1)
+    Size    size = 0;
+    int     i;
+
+    for (i = 0; i < state->nstats; i++)
     {
-        const char *err = strerror(errno);
+        StorageStatsColumn *col = &state->stats[i];
+        Size    payload;
+
+        payload = datumEstimateSpace(col->min, !col->has_value,
+                                     col->typbyval, col->typlen)
+            + datumEstimateSpace(col->max, !col->has_value,
+                                 col->typbyval, col->typlen);
+        size += MAXALIGN(StorageMetaEntrySize + payload);
+    }
 
-        elog(ERROR, "tuple_fdw: munmap failed: %s", err);
+    for (i = 0; i < state->nblooms; i++)
+    {
+        StorageBloomColumn *col = &state->blooms[i];
+
+        col->nhashes = bloom_dedup_hashes(col->hashes, col->nhashes);
+        size += MAXALIGN(StorageMetaEntrySize
+                         + BloomFilterSize(bloom_choose_nbits(col->nhashes)));
     }
+
+    return size;
 }
 
-void
-StorageInit(StorageState *state,
-            const char *filename,
-            bool readonly,
-            bool use_mmap)
+/* Serialize metadata of the current block into the zeroed buffer */
+static void
+serialize_block_meta(StorageState *state, char *buf)
 {
-    const char *mode = readonly ? "r" : "r+";
+    int     i;
 
-    /*TODO: assert that use_mmap isn't used in non-readonly queries */
-    state->readonly = readonly;
-    if ((state->file = AllocateFile(filename, mode)) == NULL)
+    for (i = 0; i < state->nstats; i++)
     {
-        const char *err = strerror(errno);
-        elog(ERROR, "tuple_fdw: cannot open file '%s': %s", filename, err);
-    }
+        StorageStatsColumn *col = &state->stats[i];
+        StorageMetaEntry   *entry = (StorageMetaEntry *) buf;
+        char       *ptr = entry->data;
+
+        entry->kind = BLOCK_META_MINMAX;
+        entry->attnum = col->attnum;
+        datumSerialize(col->min, !col->has_value, col->typbyval, col->typlen, &ptr);
+        datumSerialize(col->max, !col->has_value, col->typbyval, col->typlen, &ptr);
+        entry->size = ptr - entry->data;
+
+        buf += MAXALIGN(StorageMetaEntrySize + entry->size);
+    }
+
+    for (i = 0; i < state->nblooms; i++)
+    {
+        StorageBloomColumn *col = &state->blooms[i];
+        StorageMetaEntry   *entry = (StorageMetaEntry *) buf;
+        uint32      nbits = bloom_choose_nbits(col->nhashes);
+
+        entry->kind = col->kind;
+        entry->attnum = col->attnum;
+        entry->size = BloomFilterSize(nbits);
+        bloom_build((BloomFilter *) entry->data, nbits, col->hashes, col->nhashes);
+
+        buf += MAXALIGN(StorageMetaEntrySize + entry->size);
+    }
+}
+
+/*
+ * Extract statistics and Bloom filters of the columns we're interested in
+ * from the block metadata.
+ */
+static void
+parse_block_meta(StorageState *state, char *meta, Size meta_size,
+                 StorageBlockInfo *info)
+{
+    StorageBlockStats *stats = info->stats;
+    char   *ptr = meta;
+
+    while (ptr + StorageMetaEntrySize <= meta + meta_size)
+    {
+        StorageMetaEntry entry;
+        int     col;
+
+        /* metadata isn't necessarily aligned when mmaped */
+        memcpy(&entry, ptr, StorageMetaEntrySize);
+
+        if (entry.kind == BLOCK_META_MINMAX
+            && (col = find_stats_column(state, entry.attnum)) >= 0)
+        {
+            char   *payload = ptr + StorageMetaEntrySize;
+            bool    isnull;
+
+            stats[col].present = true;
+            stats[col].min = datumRestore(&payload, &isnull);
+            stats[col].has_value = !isnull;
+            stats[col].max = datumRestore(&payload, &isnull);
+        }
+        else if ((entry.kind == BLOCK_META_BLOOM || entry.kind == BLOCK_META_NGRAM)
+                 && (col = find_bloom_column(state, entry.attnum, entry.kind)) >= 0
+                 && ptr + StorageMetaEntrySize + entry.size <= meta + meta_size)
+        {
+            BloomFilter *filter = palloc(entry.size);
+
+            memcpy(filter, ptr + StorageMetaEntrySize, entry.size);
+            if (bloom_is_valid(filter, entry.size))
+                info->blooms[col] = filter;
+            else
+                pfree(filter);
+        }
+
+        ptr += MAXALIGN(StorageMetaEntrySize + entry.size);
+    }
+}
+
+static void
+decompress_block(StorageState *state, char *compressed_data, Size len)
+{
+    int size;
+
+    size = LZ4_decompress_safe(compressed_data,
+                               state->cur_block.data,
+                               len,
+                               BLOCK_SIZE);
+    if (size < 0)
+        elog(ERROR, "tuple_fdw: decompression failed");
+
+    Assert(BLOCK_SIZE == size);
+}
+
+/*
+ * Read the header of the block at the offset. Returns false if there is no
+ * block there. Unless the file is mmaped, leaves the file position right
+ * after the header.
+ */
+static bool
+read_block_header(StorageState *state, Size offset, StorageBlockHeader *header)
+{
+    if (state->mmaped_file)
+    {
+        if (offset + StorageBlockHeaderSize > state->mmaped_size)
+            return false;
+        memcpy(header, state->mmaped_file + offset, StorageBlockHeaderSize);
+    }
+    else
+    {
+        storage_seek(state, offset);
+        if (fread(header, 1, StorageBlockHeaderSize, state->file) != StorageBlockHeaderSize)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Read `size` bytes following the block header which has just been read by
+ * `read_block_header`. Returns a pointer into the mmaped file or a palloc'ed
+ * buffer, NULL if the block is incomplete.
+ */
+static char *
+read_block_body(StorageState *state, Size offset, Size size)
+{
+    char   *buf;
+
+    if (state->mmaped_file)
+    {
+        if (offset + StorageBlockHeaderSize + size > state->mmaped_size)
+            return NULL;
+        return state->mmaped_file + offset + StorageBlockHeaderSize;
+    }
+
+    buf = palloc(size);
+    if (fread(buf, 1, size, state->file) != size)
+    {
+        pfree(buf);
+        return NULL;
+    }
+
+    return buf;
+}
+
+/* Load the tail read at the start of the scan as the current block */
+static bool
+read_tail_block(StorageState *state)
+{
+    if (state->tail_data == NULL)
+        return false;
+
+    memcpy(state->cur_block.data, state->tail_data, state->tail_length);
+    if (state->tail_length + StorageTupleHeaderSize <= BLOCK_SIZE)
+        memset(state->cur_block.data + state->tail_length, 0, StorageTupleHeaderSize);
+
+    state->cur_block.offset = TAIL_BLOCK_OFFSET;
+    state->cur_block.status = BS_LOADED;
+    state->cur_block.compressed_size = 0;
+    state->cur_block.meta_size = 0;
+    state->cur_block.ntuples = state->tail_ntuples;
+    state->cur_block.flushed_ntuples = state->tail_ntuples;
+    state->cur_offset = 0;
+
+    return true;
+}
+
+static bool
+read_block(StorageState* state, Size offset)
+{
+    StorageBlockHeader  header;
+    PrefetchSlot *slot = NULL;
+    char       *data;
+    Size        size;
+    pg_crc32c   crc;
+
+    if (offset == TAIL_BLOCK_OFFSET)
+        return read_tail_block(state);
+
+    /* take the block from the prefetcher if it has read it in full */
+    if (state->prefetcher
+        && (slot = block_prefetcher_take(state->prefetcher, offset)) != NULL
+        && !slot->complete)
+    {
+        block_prefetcher_release(state->prefetcher, slot);
+        slot = NULL;
+    }
+
+    if (slot != NULL)
+    {
+        memcpy(&header, slot->buf, StorageBlockHeaderSize);
+        size = header.meta_size + header.compressed_size;
+        data = slot->buf + StorageBlockHeaderSize;
+    }
+    else
+    {
+        if (!read_block_header(state, offset, &header))
+            return false;
+
+        Assert(header.compressed_size > 0);
+
+        size = header.meta_size + header.compressed_size;
+        if ((data = read_block_body(state, offset, size)) == NULL)
+            return false;
+    }
+
+    /* calculate checksum and compare it to a stored one */
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, data, size);
+    FIN_CRC32C(crc);
+
+    if (!EQ_CRC32C(crc, header.checksum))
+        elog(ERROR, "tuple_fdw: wrong checksum");
+
+    decompress_block(state, data + header.meta_size, header.compressed_size);
+
+    if (slot != NULL)
+        block_prefetcher_release(state->prefetcher, slot);
+    else if (!state->mmaped_file)
+        pfree(data);
+
+    state->cur_block.offset = offset;
+    state->cur_block.status = BS_LOADED;
+    state->cur_block.compressed_size = header.compressed_size;
+    state->cur_block.meta_size = header.meta_size;
+    state->cur_block.ntuples = header.ntuples;
+    state->cur_block.flushed_ntuples = header.ntuples;
+    state->cur_offset = 0;
+
+    return true;
+}
+
+static bool
+load_next_block(StorageState *state)
+{
+    Size    offset;
+
+    if (BlockIsInvalid(state->cur_block))
+    {
+        /*
+         * We're about to read the first block of the scan. Unless the scan is
+         * synchronized with others it's the first block in the file.
+         */
+        offset = state->start_offset;
+    }
+    else if (state->cur_block.offset == TAIL_BLOCK_OFFSET)
+        offset = TAIL_BLOCK_OFFSET;     /* nothing follows the tail */
+    else
+        offset = BlockNextOffset(state->cur_block);
+
+    /* wrapped scan stops where it has started */
+    if (state->wrapped && offset >= state->start_offset)
+        return false;
+
+    /*
+     * The last block may have shrunk when it was rewritten, so anything past
+     * it isn't necessarily a valid block.
+     */
+    if (offset > state->file_header.last_block_offset
+        || !read_block(state, offset))
+    {
+        /* the tail goes after the last block; it's never a scan start */
+        if (offset != TAIL_BLOCK_OFFSET && !state->wrapped
+            && read_tail_block(state))
+            return true;
+
+        if (!state->syncscan || state->wrapped
+            || state->start_offset == StorageFileHeaderSize)
+            return false;
+
+        /* reached the end of file; go on with the blocks we've missed */
+        state->wrapped = true;
+        offset = StorageFileHeaderSize;
+        if (!read_block(state, offset))
+            return false;
+    }
+
+    if (state->syncscan)
+        tuple_ss_report_location(&state->file_id, offset);
+
+    return true;
+}
+
+/*
+ * Walk the tuples of the block loaded for appending: find where the next
+ * tuple goes and recalculate the block statistics.
+ */
+static void
+find_last_tuple_offset(StorageState *state)
+{
+    Size    off = 0;
+    uint32  ntuples = 0;
+
+    reset_block_stats(state);
+
+    /* iterate over tuples in the block */
+    while (off + StorageTupleHeaderSize <= BLOCK_SIZE)
+    {
+        StorageTupleHeader  *st_header;
+
+        st_header = (StorageTupleHeader *) (state->cur_block.data + off);
+
+        if (st_header->length == 0)
+            break;
+
+        if (state->nstats > 0 || state->nblooms > 0)
+        {
+            HeapTupleData   tuple;
+
+            tuple.t_len = st_header->length;
+            tuple.t_data = (HeapTupleHeader) st_header->data;
+            update_block_stats(state, &tuple);
+        }
+
+        ntuples++;
+        off = off + st_header->length + StorageTupleHeaderSize;
+    }
+
+    state->cur_offset = off;
+    state->cur_block.ntuples = ntuples;
+}
+
+static void
+load_last_block(StorageState *state)
+{
+    /* read the last block */
+    if (read_block(state, state->file_header.last_block_offset) == true)
+        find_last_tuple_offset(state);
+    else
+        allocate_new_block(state);
+}
+
+/*
+ * Block directory entry of the tail. There is no metadata, the statistics
+ * are calculated right away; Bloom filters aren't worth it for a single
+ * block, the tail is always read if statistics don't rule it out.
+ */
+static void
+add_tail_block_info(StorageState *state, StorageBlockInfo *info)
+{
+    Size    off = 0;
+    int     nblooms = state->nblooms;
+    int     i;
+
+    info->offset = TAIL_BLOCK_OFFSET;
+    info->ntuples = state->tail_ntuples;
+    info->stats = palloc0(sizeof(StorageBlockStats) * state->nstats);
+    info->blooms = palloc0(sizeof(BloomFilter *) * state->nblooms);
+
+    if (state->nstats == 0)
+        return;
+
+    reset_block_stats(state);
+    state->nblooms = 0;
+    while (off + StorageTupleHeaderSize <= state->tail_length)
+    {
+        StorageTupleHeader *st_header;
+        HeapTupleData       tuple;
+
+        st_header = (StorageTupleHeader *) (state->tail_data + off);
+        if (st_header->length == 0)
+            break;
+
+        tuple.t_len = st_header->length;
+        tuple.t_data = (HeapTupleHeader) st_header->data;
+        update_block_stats(state, &tuple);
+
+        off = off + st_header->length + StorageTupleHeaderSize;
+    }
+    state->nblooms = nblooms;
+
+    /* the values now belong to the directory */
+    for (i = 0; i < state->nstats; i++)
+    {
+        StorageStatsColumn *col = &state->stats[i];
+
+        info->stats[i].present = true;
+        info->stats[i].has_value = col->has_value;
+        info->stats[i].min = col->min;
+        info->stats[i].max = col->max;
+        col->has_value = false;
+    }
+}
+
+/*
+ * Collect offsets of all blocks in the file along with the statistics of
+ * stats columns. Only block headers and metadata are read, compressed data
+ * is skipped.
+ */
+static void
+build_block_directory(StorageState *state)
+{
+    Size    offset = StorageFileHeaderSize;
+    int     capacity = 64;
+    int     i;
+    MemoryContext oldcxt = MemoryContextSwitchTo(state->mcxt);
+
+    state->blocks = palloc(sizeof(StorageBlockInfo) * capacity);
+    state->nblocks = 0;
+
+    /* the last block offset in the file header limits the walk */
+    while (offset <= state->file_header.last_block_offset)
+    {
+        StorageBlockHeader  header;
+        StorageBlockInfo   *info;
+
+        if (!read_block_header(state, offset, &header))
+            break;
+
+        if (state->nblocks >= capacity)
+        {
+            capacity *= 2;
+            state->blocks = repalloc(state->blocks,
+                                     sizeof(StorageBlockInfo) * capacity);
+        }
+        info = &state->blocks[state->nblocks++];
+        info->offset = offset;
+        info->ntuples = header.ntuples;
+        info->stats = palloc0(sizeof(StorageBlockStats) * state->nstats);
+        info->blooms = palloc0(sizeof(BloomFilter *) * state->nblooms);
+
+        if ((state->nstats > 0 || state->nblooms > 0) && header.meta_size > 0)
+        {
+            char   *meta = read_block_body(state, offset, header.meta_size);
+
+            if (meta == NULL)
+                elog(ERROR, "tuple_fdw: block at offset %zu is truncated", offset);
+
+            parse_block_meta(state, meta, header.meta_size, info);
+            if (!state->mmaped_file)
+                pfree(meta);
+        }
+
+        offset += StorageBlockHeaderSize + header.meta_size + header.compressed_size;
+    }
+
+    if (state->tail_data)
+    {
+        if (state->nblocks >= capacity)
+            state->blocks = repalloc(state->blocks,
+                                     sizeof(StorageBlockInfo) * (capacity + 1));
+        add_tail_block_info(state, &state->blocks[state->nblocks++]);
+    }
+
+    /*
+     * Blocks written before the column was declared sorted don't have
+     * statistics; there is no way to narrow down the range then.
+     */
+    state->range_stats = state->sorted;
+    for (i = 0; i < state->nblocks && state->range_stats; i++)
+        state->range_stats = state->blocks[i].stats[0].present;
+
+    MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Remember offsets of the tuples of the current block so that they could be
+ * visited in any order.
+ */
+static void
+collect_tuple_offsets(StorageState *state)
+{
+    Size    off = 0;
+
+    if (state->tuple_offsets == NULL)
+    {
+        state->tuple_offsets_capacity = 1024;
+        state->tuple_offsets = MemoryContextAlloc(state->mcxt,
+                                                  sizeof(uint32) * state->tuple_offsets_capacity);
+    }
+    state->ntuples = 0;
+
+    while (off + StorageTupleHeaderSize <= BLOCK_SIZE)
+    {
+        StorageTupleHeader  *st_header;
+
+        st_header = (StorageTupleHeader *) (state->cur_block.data + off);
+
+        if (st_header->length == 0)
+            break;
+
+        if (state->ntuples >= state->tuple_offsets_capacity)
+        {
+            state->tuple_offsets_capacity *= 2;
+            state->tuple_offsets = repalloc(state->tuple_offsets,
+                                            sizeof(uint32) * state->tuple_offsets_capacity);
+        }
+        state->tuple_offsets[state->ntuples++] = off;
+
+        off = off + st_header->length + StorageTupleHeaderSize;
+    }
+}
+
+/* Block index */
+
+static int
+find_index_column(StorageState *state, AttrNumber attnum)
+{
+    int     i;
+
+    for (i = 0; i < state->nindexes; i++)
+        if (state->indexes[i].attnum == attnum && state->indexes[i].position >= 0)
+            return i;
+
+    return -1;
+}
+
+/* Remember hashes of the tuple values to add them to the index on flush */
+static void
+update_block_index(StorageState *state, HeapTuple tuple)
+{
+    int     i;
+
+    for (i = 0; i < state->nindexes; i++)
+    {
+        StorageIndexColumn *col = &state->indexes[i];
+        Datum       value;
+        bool        isnull;
+
+        value = heap_getattr(tuple, col->attnum, state->tupdesc, &isnull);
+        if (isnull)
+            continue;
+
+        if (col->nhashes >= col->capacity)
+        {
+            col->capacity = col->capacity > 0 ? col->capacity * 2 : 1024;
+            col->hashes = col->hashes ?
+                repalloc(col->hashes, sizeof(uint32) * col->capacity) :
+                MemoryContextAlloc(state->mcxt, sizeof(uint32) * col->capacity);
+        }
+        col->hashes[col->nhashes++] =
+            DatumGetUInt32(FunctionCall1Coll(&col->hash, col->collation, value));
+    }
+}
+
+static void
+flush_block_index(StorageState *state)
+{
+    int     i;
+
+    if (state->index == NULL)
+        return;
+
+    for (i = 0; i < state->nindexes; i++)
+    {
+        StorageIndexColumn *col = &state->indexes[i];
+        int         n = bloom_dedup_hashes(col->hashes, col->nhashes);
+
+        block_index_add(state->index, col->position, state->cur_block.offset,
+                        col->hashes, n);
+        col->nhashes = 0;
+    }
+}
+
+/*
+ * Index all the blocks of the storage file from scratch. Happens when the
+ * index doesn't exist yet or is out of date.
+ */
+static void
+rebuild_block_index(StorageState *state)
+{
+    AttrNumber *attnums;
+    Size        offset = StorageFileHeaderSize;
+    int         i;
+
+    attnums = palloc(sizeof(AttrNumber) * state->nindexes);
+    for (i = 0; i < state->nindexes; i++)
+    {
+        state->indexes[i].position = i;
+        attnums[i] = state->indexes[i].attnum;
+    }
+    block_index_create(state->index, state->nindexes, attnums);
+    pfree(attnums);
+
+    while (offset <= state->file_header.last_block_offset
+           && read_block(state, offset))
+    {
+        Size    off = 0;
+
+        while (off + StorageTupleHeaderSize <= BLOCK_SIZE)
+        {
+            StorageTupleHeader *st_header;
+            HeapTupleData       tuple;
+
+            st_header = (StorageTupleHeader *) (state->cur_block.data + off);
+            if (st_header->length == 0)
+                break;
+
+            tuple.t_len = st_header->length;
+            tuple.t_data = (HeapTupleHeader) st_header->data;
+            update_block_index(state, &tuple);
+
+            off = off + st_header->length + StorageTupleHeaderSize;
+        }
+
+        flush_block_index(state);
+        offset = BlockNextOffset(state->cur_block);
+    }
+
+    /* the last block is loaded again for appending */
+    state->cur_block.status = BS_INVALID;
+
+    block_index_sync(state->index,
+                     state->file_header.last_block_offset,
+                     state->file_header.ntuples);
+}
+
+/*
+ * Compress the block data into the buffer right after the block metadata,
+ * which must already be there, and fill in the rest of the block header.
+ * The buffer must have room for `LZ4_compressBound(BLOCK_SIZE)` bytes of
+ * compressed data. Returns the size of the whole block or 0 if compression
+ * failed.
+ *
+ * Doesn't use any backend facilities, so it's safe to call from the
+ * background compression threads.
+ */
+Size
+StorageCompressBlock(const char *data, StorageBlockHeader *block_header,
+                     Size meta_size, int lz4_acceleration)
+{
+    int         size;
+    pg_crc32c   crc;
+
+    size = LZ4_compress_fast(data,
+                             block_header->data + meta_size,
+                             BLOCK_SIZE,
+                             LZ4_compressBound(BLOCK_SIZE),
+                             lz4_acceleration);
+    if (size <= 0)
+        return 0;
+    block_header->compressed_size = size;
+    block_header->meta_size = meta_size;
+
+    /* calculate checksum */
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, block_header->data, meta_size + size);
+    FIN_CRC32C(crc);
+    block_header->checksum = crc;
+
+    return StorageBlockHeaderSize + meta_size + size;
+}
+
+static StorageBlockHeader *
+compress_current_block(StorageState *state)
+{
+    Size    meta_size;
+    StorageBlockHeader *block_header;
+
+    meta_size = estimate_block_meta_size(state);
+    block_header = (StorageBlockHeader *) \
+        palloc0(StorageBlockHeaderSize + meta_size + LZ4_compressBound(BLOCK_SIZE));
+
+    serialize_block_meta(state, block_header->data);
+    block_header->ntuples = state->cur_block.ntuples;
+
+    if (StorageCompressBlock(state->cur_block.data, block_header, meta_size,
+                             state->lz4_acceleration) == 0)
+        elog(ERROR, "tuple_fdw: compression failed");
+
+    return block_header;
+}
+
+/*
+ * Account for a block written to the file. With per block syncing the block
+ * is already on disk and the header is written right away; otherwise that
+ * waits until the data gets synced at the end of the statement.
+ */
+static void
+account_flushed_block(StorageState *state, Size offset, bool is_new,
+                      uint32 new_tuples)
+{
+    if (is_new)
+    {
+        state->file_header.last_block_offset = offset;
+        state->file_header.nblocks++;
+    }
+    state->file_header.ntuples += new_tuples;
+    state->header_dirty = true;
+
+    if (state->sync_mode == SYNC_PER_BLOCK)
+        write_storage_file_header(state);
+}
+
+static void
+flush_last_block(StorageState *state)
+{
+    StorageBlockHeader *block_header;
+    Size                block_size;
+
+    Assert(!BlockIsInvalid(state->cur_block));
+
+    if (state->cur_block.status == BS_LOADED)
+    {
+        /* no modifications were made */
+        return;
+    }
+
+    /* compress */
+    block_header = compress_current_block(state);
+    block_size = StorageBlockHeaderSize
+        + block_header->meta_size
+        + block_header->compressed_size;
+
+    /* write out to disk */
+    storage_seek(state, state->cur_block.offset);
+    storage_write(state, block_header, block_size);
+    state->unsynced = true;
+    if (state->sync_mode == SYNC_PER_BLOCK)
+        sync_storage_file(state);
+
+    state->cur_block.compressed_size = block_header->compressed_size;
+    state->cur_block.meta_size = block_header->meta_size;
+
+    /* update the file header */
+    account_flushed_block(state, state->cur_block.offset,
+                          state->cur_block.status == BS_NEW,
+                          state->cur_block.ntuples - state->cur_block.flushed_ntuples);
+    state->cur_block.flushed_ntuples = state->cur_block.ntuples;
+
+    state->cur_block.status = BS_LOADED;
+
+    /* the block is indexed once it's on disk */
+    flush_block_index(state);
+
+    pfree(block_header);
+}
+
+/* Start filling an empty block at the offset */
+static void
+clear_current_block(StorageState *state, Size offset)
+{
+    Block *block = &state->cur_block;
+
+    block->offset = offset;
+    memset(block->data, 0, BLOCK_SIZE);
+    block->status = BS_NEW;
+    block->compressed_size = 0;
+    block->meta_size = 0;
+    block->ntuples = 0;
+    block->flushed_ntuples = 0;
+
+    state->cur_offset = 0;
+    reset_block_stats(state);
+}
+
+static void
+allocate_new_block(StorageState *state)
+{
+    Block *block = &state->cur_block;
+
+    if (block->offset != 0)
+    {
+        clear_current_block(state, BlockNextOffset(*block));
+    }
+    else
+    {
+        /*
+         * this is the first block in the storage, it goes straight next to
+         * the file header
+         */
+        clear_current_block(state, StorageFileHeaderSize);
+    }
+}
+
+/* Make the file header refer to the data written so far, data first */
+static void
+commit_storage_file(StorageState *state)
+{
+    if (state->header_dirty)
+    {
+        if (state->unsynced)
+            sync_storage_file(state);
+        write_storage_file_header(state);
+    }
+    if (state->unsynced)
+        sync_storage_file(state);
+}
+
+/* Tail (see tail.c) */
+
+/* Offset of the block following the last one in the file */
+static Size
+next_block_offset(StorageState *state)
+{
+    StorageBlockHeader header;
+    Size        offset = state->file_header.last_block_offset;
+
+    if (state->file_header.nblocks == 0)
+        return StorageFileHeaderSize;
+
+    if (!read_block_header(state, offset, &header))
+        elog(ERROR, "tuple_fdw: block at offset %zu is truncated", offset);
+
+    return offset + StorageBlockHeaderSize + header.meta_size + header.compressed_size;
+}
+
+/*
+ * Turn the rows of the tail, followed by the ones inserted since (if any),
+ * into a new block of the storage file and start the tail over.
+ */
+static void
+seal_tail(StorageState *state)
+{
+    StorageTail *tail = state->tail;
+    Size        length = tail->header.length;
+    Size        off = 0;
+    uint32      ntuples = 0;
+    int         i;
+
+    if (BlockIsInvalid(state->cur_block))
+        clear_current_block(state, TAIL_BLOCK_OFFSET);
+
+    Assert(state->cur_block.offset == TAIL_BLOCK_OFFSET);
+    Assert(length + state->cur_offset <= BLOCK_SIZE);
+
+    memmove(state->cur_block.data + length, state->cur_block.data,
+            state->cur_offset);
+    tail_read(tail, state->cur_block.data);
+
+    /* none of the rows have been accounted for in the block metadata yet */
+    reset_block_stats(state);
+    for (i = 0; i < state->nindexes; i++)
+        state->indexes[i].nhashes = 0;
+
+    while (off + StorageTupleHeaderSize <= BLOCK_SIZE)
+    {
+        StorageTupleHeader *st_header;
+        HeapTupleData       tuple;
+
+        st_header = (StorageTupleHeader *) (state->cur_block.data + off);
+        if (st_header->length == 0)
+            break;
+
+        tuple.t_len = st_header->length;
+        tuple.t_data = (HeapTupleHeader) st_header->data;
+        update_block_stats(state, &tuple);
+        update_block_index(state, &tuple);
+
+        ntuples++;
+        off = off + st_header->length + StorageTupleHeaderSize;
+    }
+
+    state->cur_offset = off;
+    state->cur_block.ntuples = ntuples;
+    state->cur_block.flushed_ntuples = 0;
+    state->cur_block.status = BS_NEW;
+    state->cur_block.offset = next_block_offset(state);
+
+    /* the block has to be in place before the tail forgets its rows */
+    flush_last_block(state);
+    if (length > 0)
+        commit_storage_file(state);
+
+    /*
+     * An empty tail gets stale on disk: it says the same, and is written with
+     * the next rows anyway, which saves a couple of fsyncs per block during
+     * bulk loads.
+     */
+    tail_reset(tail, state->file_header.last_block_offset,
+               state->file_header.ntuples);
+    if (length > 0)
+        tail_commit(tail, state->sync_mode != SYNC_NONE);
+
+    clear_current_block(state, TAIL_BLOCK_OFFSET);
+}
+
+/*
+ * Read the file header again if it has changed. The block index is dropped
+ * if it doesn't match the new header.
+ */
+static bool
+refresh_file_header(StorageState *state)
+{
+    StorageFileHeader old = state->file_header;
+
+    read_storage_file_header(state);
+    if (state->file_header.generation == old.generation
+        && state->file_header.last_block_offset == old.last_block_offset
+        && state->file_header.ntuples == old.ntuples)
+        return false;
+
+    /* the mapping may not cover the new blocks */
+    if (state->pooled)
+        refresh_pooled_mapping(state);
+    else if (state->mmaped_file)
+    {
+        unmap_file(state);
+        mmap_file(state);
+    }
+
+    if (state->index
+        && !block_index_is_current(state->index,
+                                   state->file_header.last_block_offset,
+                                   state->file_header.ntuples))
+    {
+        block_index_close(state->index);
+        state->index = NULL;
+    }
+
+    return true;
+}
+
+/*
+ * Read the rows of the tail for a scan. A writer may seal the tail meanwhile,
+ * moving its rows to a block past the end of the file as we know it; then
+ * the file header is read again and so is the tail.
+ */
+static void
+load_tail(StorageState *state, const char *filename)
+{
+    int     attempt;
+
+    for (attempt = 0; attempt < 100; attempt++)
+    {
+        StorageTail *tail = tail_open(filename, true, false);
+        bool        current;
+        bool        intact;
+
+        if (tail == NULL)
+            return;
+
+        current = tail_is_current(tail, state->file_header.last_block_offset,
+                                  state->file_header.ntuples);
+        if (current && tail->header.length > 0)
+        {
+            if (tail->header.length > BLOCK_SIZE)
+                elog(ERROR, "tuple_fdw: tail '%s' is corrupted", tail->filename);
+
+            state->tail_length = tail->header.length;
+            state->tail_ntuples = tail->header.tail_ntuples;
+            state->tail_data = MemoryContextAlloc(state->mcxt, state->tail_length);
+            tail_read(tail, state->tail_data);
+        }
+        intact = tail_is_intact(tail);
+        tail_close(tail);
+
+        if (current && intact)
+            return;
+
+        if (state->tail_data)
+        {
+            pfree(state->tail_data);
+            state->tail_data = NULL;
+        }
+
+        /* a stale tail, unless the file has changed since */
+        if (!refresh_file_header(state))
+            return;
+    }
+
+    elog(ERROR, "tuple_fdw: tail '%s' keeps changing", filename);
+}
+
+/*
+ * Set up the ranges of the stats columns over the whole file which writers
+ * keep in the header. They start from the ones the header has, or from
+ * nothing if the file is empty; ranges of other columns are unknown and stay
+ * so. Stats the header has for columns we don't keep get dropped with the
+ * first row added.
+ */
+static void
+init_file_stats(StorageState *state, bool empty)
+{
+    char       *ptr = state->file_stats;
+    int         i;
+
+    for (i = 0; i < state->nstats; i++)
+        state->stats[i].file_valid = empty;
+
+    while (ptr + StorageMetaEntrySize <= state->file_stats + state->file_stats_size)
+    {
+        StorageMetaEntry *entry = (StorageMetaEntry *) ptr;
+        int         col = find_stats_column(state, entry->attnum);
+
+        if (entry->kind != BLOCK_META_MINMAX || col < 0)
+            state->file_stats_stale = true;
+        else if (!empty)
+        {
+            StorageStatsColumn *stats = &state->stats[col];
+            char       *payload = entry->data;
+            Datum       min,
+                        max;
+            bool        isnull;
+
+            min = datumRestore(&payload, &isnull);
+            max = datumRestore(&payload, &isnull);
+            if (!isnull)
+            {
+                stats->file_min = copy_stats_value(state, stats, min);
+                stats->file_max = copy_stats_value(state, stats, max);
+                stats->file_has_value = true;
+            }
+            stats->file_valid = true;
+        }
+
+        ptr += MAXALIGN(StorageMetaEntrySize + entry->size);
+    }
+}
+
+/*
+ * Open the tail. Readers load its rows for the scan (range scans may leave
+ * it to `StorageStartRangeScan`); writers with `use_tail` append to it,
+ * others seal what is there, so that the rows don't get lost once the storage
+ * file changes.
+ */
+void
+StorageOpenTail(StorageState *state, bool use_tail)
+{
+    char       *filename;
+    bool        current;
+
+    state->use_tail = use_tail && !state->readonly;
+    filename = psprintf("%s.tail", state->filename);
+
+    if (state->readonly)
+    {
+        load_tail(state, filename);
+        state->tail_loaded = true;
+        pfree(filename);
+        return;
+    }
+
+    state->tail = tail_open(filename, false, state->use_tail);
+    pfree(filename);
+
+    if (state->tail == NULL)
+    {
+        init_file_stats(state, state->file_header.ntuples == 0);
+        return;
+    }
+
+    current = tail_is_current(state->tail,
+                              state->file_header.last_block_offset,
+                              state->file_header.ntuples);
+    init_file_stats(state, state->file_header.ntuples == 0
+                    && (!current || state->tail->header.tail_ntuples == 0));
+
+    /* a stale tail only has rows which are in the storage file already */
+    if (!current)
+        tail_reset(state->tail, state->file_header.last_block_offset,
+                   state->file_header.ntuples);
+    else if (!state->use_tail && state->tail->header.length > 0)
+    {
+        seal_tail(state);
+        /* ...and rows go to the last block from now on */
+        state->cur_block.status = BS_INVALID;
+    }
+
+    if (!state->use_tail)
+    {
+        tail_close(state->tail);
+        state->tail = NULL;
+    }
+}
+
+/* Segments (see segments.c) */
+
+/*
+ * Number of rows in the storage file and its tail, read without setting up
+ * the storage state. As rows are only ever appended, it identifies the
+ * state of the file the segment manifest entry describes.
+ */
+uint64
+StorageCountTuples(const char *filename)
+{
+    StorageFileHeader header;
+    StorageTail *tail;
+    Size        file_size;
+    uint64      ntuples;
+    char       *tailname;
+
+    if (!StorageReadFileInfo(filename, &header, &file_size, NULL, NULL))
+        return 0;
+    ntuples = header.ntuples;
+
+    tailname = psprintf("%s.tail", filename);
+    if ((tail = tail_open(tailname, true, false)) != NULL)
+    {
+        if (tail_is_current(tail, header.last_block_offset, header.ntuples))
+            ntuples += tail->header.tail_ntuples;
+        tail_close(tail);
+    }
+    pfree(tailname);
+
+    return ntuples;
+}
+
+/*
+ * Keep track of the range of the first stats column over the whole file
+ * while inserting, starting from the range of the rows already there: the
+ * one the manifest has, or none if the file is empty (`info` is NULL).
+ */
+void
+StorageTrackRange(StorageState *state, SegmentInfo *info)
+{
+    StorageStatsColumn *col;
+    char       *ptr;
+    Datum       min,
+                max;
+    bool        isnull;
+
+    if (state->nstats == 0)
+        return;
+
+    col = &state->stats[0];
+    state->track_range = true;
+    state->range_has_value = false;
+    state->range_has_nulls = false;
+    if (info == NULL)
+        return;
+
+    if (info->attnum != col->attnum || info->range_size == 0)
+    {
+        /* the range the manifest has is of no use */
+        state->track_range = false;
+        return;
+    }
+
+    state->range_has_nulls = info->has_nulls;
+    ptr = info->range;
+    min = datumRestore(&ptr, &isnull);
+    max = datumRestore(&ptr, &isnull);
+    if (!isnull)
+    {
+        state->range_min = copy_stats_value(state, col, min);
+        state->range_max = copy_stats_value(state, col, max);
+        state->range_has_value = true;
+    }
+}
+
+/*
+ * Fill in the range for the manifest; it's unknown unless tracked or kept in
+ * the file header. The header doesn't tell whether there are NULLs.
+ */
+void
+StorageSerializeRange(StorageState *state, SegmentInfo *info)
+{
+    StorageStatsColumn *col;
+    bool        has_value;
+    Datum       min,
+                max;
+    char       *ptr;
+
+    info->attnum = InvalidAttrNumber;
+    info->has_nulls = true;
+    info->range_size = 0;
+    info->range = NULL;
+    if (state->nstats == 0)
+        return;
+
+    col = &state->stats[0];
+    if (state->track_range)
+    {
+        has_value = state->range_has_value;
+        info->has_nulls = state->range_has_nulls;
+        min = state->range_min;
+        max = state->range_max;
+    }
+    else if (col->file_valid)
+    {
+        has_value = col->file_has_value;
+        min = col->file_min;
+        max = col->file_max;
+    }
+    else
+        return;
+
+    info->attnum = col->attnum;
+    info->range_size =
+        datumEstimateSpace(min, !has_value, col->typbyval, col->typlen)
+        + datumEstimateSpace(max, !has_value, col->typbyval, col->typlen);
+    info->range = ptr = palloc0(info->range_size);
+    datumSerialize(min, !has_value, col->typbyval, col->typlen, &ptr);
+    datumSerialize(max, !has_value, col->typbyval, col->typlen, &ptr);
+}
+
+/* Background compression (see blockwriter.c) */
+
+/*
+ * Collect the oldest job of the writer: the block is on disk now, so the
+ * file header and the block index may refer to it. Returns false if there
+ * were no jobs in flight.
+ */
+static bool
+reap_written_block(StorageState *state)
+{
+    BlockWriteJob *job = block_writer_wait(state->writer);
+    int         i;
+
+    if (job == NULL)
+        return false;
+
+    if (job->error != 0)
+    {
+        if (job->error < 0)
+            elog(ERROR, "tuple_fdw: compression failed");
+        elog(ERROR, "tuple_fdw: write failed: %s", strerror(job->error));
+    }
+
+    state->unsynced = true;
+    account_flushed_block(state, job->written_offset, job->is_new,
+                          job->new_tuples);
+
+    for (i = 0; i < state->nindexes; i++)
+    {
+        StorageIndexColumn *col = &state->indexes[i];
+        int         n;
+
+        if (job->index_hashes[i] == NULL)
+            continue;
+
+        n = bloom_dedup_hashes(job->index_hashes[i], job->index_nhashes[i]);
+        if (state->index)
+            block_index_add(state->index, col->position, job->written_offset,
+                            job->index_hashes[i], n);
+        pfree(job->index_hashes[i]);
+        job->index_hashes[i] = NULL;
+    }
+
+    block_writer_release(state->writer, job);
+    return true;
+}
+
+/*
+ * Hand the full current block over to the writer threads and start a new one.
+ * The offset of the new block is only known once the queued blocks are
+ * compressed, so it stays 0 until then.
+ */
+static void
+queue_current_block(StorageState *state)
+{
+    Block          *block = &state->cur_block;
+    BlockWriteJob  *job;
+    Size            meta_size;
+    Size            size;
+    int             i;
+
+    if (state->writer == NULL)
+    {
+        MemoryContext oldcxt = MemoryContextSwitchTo(state->mcxt);
+
+        state->writer = block_writer_start(fileno(state->file),
+                                           state->lz4_acceleration,
+                                           Max(state->compression_workers, 1),
+                                           state->sync_mode == SYNC_PER_BLOCK);
+        for (i = 0; i < state->writer->njobs; i++)
+        {
+            BlockWriteJob *j = &state->writer->jobs[i];
+
+            j->index_hashes = palloc0(sizeof(uint32 *) * state->nindexes);
+            j->index_nhashes = palloc0(sizeof(int) * state->nindexes);
+        }
+        MemoryContextSwitchTo(oldcxt);
+    }
+
+    while ((job = block_writer_get_free(state->writer)) == NULL)
+        reap_written_block(state);
+
+    meta_size = estimate_block_meta_size(state);
+    size = StorageBlockHeaderSize + meta_size + LZ4_compressBound(BLOCK_SIZE);
+    if (job->buf_size < size)
+    {
+        if (job->buf)
+            pfree(job->buf);
+        job->buf = MemoryContextAlloc(state->mcxt, size);
+        job->buf_size = size;
+    }
+    memset(job->buf, 0, StorageBlockHeaderSize + meta_size);
+    serialize_block_meta(state, ((StorageBlockHeader *) job->buf)->data);
+    ((StorageBlockHeader *) job->buf)->ntuples = block->ntuples;
+    memcpy(job->data, block->data, BLOCK_SIZE);
+
+    job->offset = block->offset;
+    job->meta_size = meta_size;
+    job->is_new = (block->status == BS_NEW);
+    job->new_tuples = block->ntuples - block->flushed_ntuples;
+
+    /* index entries are added once the block offset is known */
+    for (i = 0; i < state->nindexes; i++)
+    {
+        StorageIndexColumn *col = &state->indexes[i];
+
+        job->index_hashes[i] = col->hashes;
+        job->index_nhashes[i] = col->nhashes;
+        col->hashes = NULL;
+        col->nhashes = 0;
+        col->capacity = 0;
+    }
+
+    block_writer_submit(state->writer, job);
+
+    clear_current_block(state, 0);
+}
+
+/*
+ * Wait for all the queued blocks to be written and stop the thread. The
+ * current block gets its final offset.
+ */
+static void
+drain_block_writer(StorageState *state)
+{
+    while (reap_written_block(state))
+        ;
+
+    if (state->cur_block.offset == 0)
+        state->cur_block.offset = block_writer_next_offset(state->writer);
+
+    StorageStopCompression(state);
+}
+
+/*
+ * Stop the writer threads without waiting for the queued blocks. Used when
+ * the insertion is aborted: the file header isn't updated, so the blocks
+ * already written are simply ignored.
+ */
+void
+StorageStopCompression(StorageState *state)
+{
+    if (state->writer == NULL)
+        return;
+
+    block_writer_stop(state->writer);
+    state->writer = NULL;
+}
+
+/* Descriptor of the storage file, whether it's pooled or not */
+static int
+storage_fd(StorageState *state)
+{
+    return state->pooled ? state->pooled->fd : fileno(state->file);
+}
+
+static void
+mmap_file(StorageState *state)
+{
+    struct stat buf;
+    int         fd = fileno(state->file);
+
+    if (fstat(fd, &buf) != 0)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot get file status: %s", err);
+    }
+
+    /* empty file cannot be mmaped; it will be read the usual way */
+    if (buf.st_size == 0)
+        return;
+
+    state->mmaped_file = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (state->mmaped_file == MAP_FAILED)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: mmap failed: %s", err);
+    }
+    state->mmaped_size = buf.st_size;
+}
+
+/*
+ * Make the pooled mapping cover the file as it is now. If it can't be moved,
+ * being used by other scans, the file is opened and mapped the usual way.
+ */
+static void
+refresh_pooled_mapping(StorageState *state)
+{
+    Size        size;
+
+    if (filepool_refresh(state->pooled, &size))
+    {
+        state->mmaped_file = state->pooled->addr;
+        state->mmaped_size = size;
+        return;
+    }
+
+    filepool_release(state->pooled);
+    state->pooled = NULL;
+    state->mmaped_file = NULL;
+    state->mmaped_size = 0;
+
+    if ((state->file = AllocateFile(state->filename, "r")) == NULL)
+    {
+        const char *err = strerror(errno);
+        elog(ERROR, "tuple_fdw: cannot open file '%s': %s", state->filename, err);
+    }
+    mmap_file(state);
+}
+
+void
+unmap_file(StorageState *state)
+{
+    /* the mapping stays in the pool for the next scans */
+    if (state->pooled)
+    {
+        filepool_release(state->pooled);
+        state->pooled = NULL;
+        state->mmaped_file = NULL;
+        state->mmaped_size = 0;
+        return;
+    }
+
+    if (state->mmaped_file == NULL)
+        return;
+
+    if (munmap(state->mmaped_file, state->mmaped_size) == -1)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: munmap failed: %s", err);
+    }
+    state->mmaped_file = NULL;
+    state->mmaped_size = 0;
+}
+
+/*
+ * Read the header of the storage file without setting up the storage state.
+ * Used by the planner; returns false if the file doesn't exist or isn't a
+ * valid storage file (yet). The file statistics (if `stats` isn't NULL) are
+ * returned as a copy of the entries, NULL if there are none.
+ */
+bool
+StorageReadFileInfo(const char *filename,
+                    StorageFileHeader *header,
+                    Size *file_size,
+                    char **stats,
+                    Size *stats_size)
+{
+    FILE       *file;
+    struct stat buf;
+    bool        result;
+    char        slots[2 * StorageFileHeaderSlotSize];
+    Size        bytes;
+
+    if ((file = AllocateFile(filename, "r")) == NULL)
+        return false;
+
+    bytes = fread(slots, 1, sizeof(slots), file);
+    result = bytes >= offsetof(StorageFileHeader, generation)
+        && choose_file_header(slots, bytes, header)
+        && fstat(fileno(file), &buf) == 0;
+
+    if (result)
+        *file_size = buf.st_size;
+    if (result && stats)
+    {
+        *stats_size = 0;
+        *stats = find_file_stats(slots, bytes, header, stats_size);
+    }
+
+    FreeFile(file);
+
+    return result;
+}
+
+void
+StorageInit(StorageState *state,
+            const char *filename,
+            bool readonly,
+            bool use_mmap)
+{
+    const char *mode = readonly ? "r" : "r+";
+
+    /*TODO: assert that use_mmap isn't used in non-readonly queries */
+    state->filename = pstrdup(filename);
+    state->readonly = readonly;
+    state->mcxt = CurrentMemoryContext;
+
+    /*
+     * Scans reuse the descriptor and the mapping the pool has kept since the
+     * previous ones. The header read from the mapping may refer to blocks
+     * appended after the pool has checked the file, hence the refresh.
+     */
+    if (readonly && use_mmap
+        && (state->pooled = filepool_acquire(filename)) != NULL)
+    {
+        state->mmaped_file = state->pooled->addr;
+        state->mmaped_size = state->pooled->size;
+        read_storage_file_header(state);
+        refresh_pooled_mapping(state);
+
+        state->start_offset = StorageFileHeaderSize;
+        return;
+    }
+
+    if ((state->file = AllocateFile(filename, mode)) == NULL)
+    {
+        const char *err = strerror(errno);
+        elog(ERROR, "tuple_fdw: cannot open file '%s': %s", filename, err);
+    }
+
+    /*
+     * The header comes first: with a writer appending concurrently, the file
+     * mapped afterwards covers all the blocks the header refers to.
+     */
+    read_storage_file_header(state);
 
     if (use_mmap)
         mmap_file(state);
 
-    read_storage_file_header(state);
+    state->start_offset = StorageFileHeaderSize;
+}
+
+/*
+ * Set up the tuple descriptor and the columns to keep block statistics for.
+ * Statistics are calculated for every `sorted` column, the leading one is
+ * also used to narrow down range scans, and for `minmax_columns`.
+ */
+void
+StorageSetColumns(StorageState *state,
+                  TupleDesc tupdesc,
+                  List *attrs_sorted,
+                  List *attrs_minmax)
+{
+    List       *attrs;
+    ListCell   *lc;
+    int         i = 0;
+
+    attrs = list_concat_unique_int(list_copy(attrs_sorted), attrs_minmax);
+
+    state->tupdesc = tupdesc;
+    state->nstats = list_length(attrs);
+    state->sorted = (attrs_sorted != NIL);
+    state->stats = MemoryContextAllocZero(state->mcxt,
+                                          sizeof(StorageStatsColumn) * state->nstats);
+
+    foreach (lc, attrs)
+    {
+        StorageStatsColumn *col = &state->stats[i++];
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, lfirst_int(lc) - 1);
+        TypeCacheEntry *typentry;
+
+        typentry = lookup_type_cache(attr->atttypid, TYPECACHE_CMP_PROC_FINFO);
+        if (!OidIsValid(typentry->cmp_proc))
+            elog(ERROR, "tuple_fdw: could not identify a comparison function for type %s",
+                 format_type_be(attr->atttypid));
+
+        col->attnum = attr->attnum;
+        col->typlen = attr->attlen;
+        col->typbyval = attr->attbyval;
+        col->collation = attr->attcollation;
+        fmgr_info_copy(&col->cmp, &typentry->cmp_proc_finfo, state->mcxt);
+    }
+}
+
+/*
+ * Set up the columns to build per block Bloom filters of values (`attrs`)
+ * and of value trigrams (`ngram_attrs`) for. Must be called after
+ * `StorageSetColumns`.
+ */
+void
+StorageSetBloomColumns(StorageState *state, List *attrs, List *ngram_attrs)
+{
+    ListCell   *lc;
+    int         i = 0;
+
+    state->nblooms = list_length(attrs) + list_length(ngram_attrs);
+    state->blooms = MemoryContextAllocZero(state->mcxt,
+                                           sizeof(StorageBloomColumn) * state->nblooms);
+
+    foreach (lc, attrs)
+    {
+        StorageBloomColumn *col = &state->blooms[i++];
+        Form_pg_attribute attr = TupleDescAttr(state->tupdesc, lfirst_int(lc) - 1);
+        TypeCacheEntry *typentry;
+
+        typentry = lookup_type_cache(attr->atttypid, TYPECACHE_HASH_PROC_FINFO);
+        if (!OidIsValid(typentry->hash_proc))
+            elog(ERROR, "tuple_fdw: could not identify a hash function for type %s",
+                 format_type_be(attr->atttypid));
+
+        col->kind = BLOCK_META_BLOOM;
+        col->attnum = attr->attnum;
+        col->collation = attr->attcollation;
+        fmgr_info_copy(&col->hash, &typentry->hash_proc_finfo, state->mcxt);
+    }
+
+    foreach (lc, ngram_attrs)
+    {
+        StorageBloomColumn *col = &state->blooms[i++];
+        Form_pg_attribute attr = TupleDescAttr(state->tupdesc, lfirst_int(lc) - 1);
+
+        if (attr->atttypid != TEXTOID && attr->atttypid != VARCHAROID)
+            elog(ERROR, "tuple_fdw: n-gram filters require a text or varchar column, '%s' is %s",
+                 NameStr(attr->attname), format_type_be(attr->atttypid));
+
+        col->kind = BLOCK_META_NGRAM;
+        col->attnum = attr->attnum;
+        col->collation = attr->attcollation;
+    }
+}
+
+/*
+ * Set up the columns covered by the sidecar block index (`<filename>.idx`).
+ * Writers create or rebuild the index if it doesn't match the storage file,
+ * readers ignore such an index. Must be called after `StorageSetColumns`.
+ */
+void
+StorageSetIndexColumns(StorageState *state, List *attrs)
+{
+    ListCell   *lc;
+    char       *filename;
+    bool        current;
+    int         i = 0;
+
+    if (attrs == NIL)
+        return;
+
+    state->nindexes = list_length(attrs);
+    state->indexes = MemoryContextAllocZero(state->mcxt,
+                                            sizeof(StorageIndexColumn) * state->nindexes);
+
+    foreach (lc, attrs)
+    {
+        StorageIndexColumn *col = &state->indexes[i++];
+        Form_pg_attribute attr = TupleDescAttr(state->tupdesc, lfirst_int(lc) - 1);
+        TypeCacheEntry *typentry;
+
+        typentry = lookup_type_cache(attr->atttypid, TYPECACHE_HASH_PROC_FINFO);
+        if (!OidIsValid(typentry->hash_proc))
+            elog(ERROR, "tuple_fdw: could not identify a hash function for type %s",
+                 format_type_be(attr->atttypid));
+
+        col->attnum = attr->attnum;
+        col->collation = attr->attcollation;
+        col->position = -1;
+        fmgr_info_copy(&col->hash, &typentry->hash_proc_finfo, state->mcxt);
+    }
+
+    filename = psprintf("%s.idx", state->filename);
+    state->index = block_index_open(filename, state->readonly);
+    pfree(filename);
+
+    if (state->index == NULL)
+        return;
+
+    current = block_index_is_current(state->index,
+                                     state->file_header.last_block_offset,
+                                     state->file_header.ntuples);
+
+    if (state->readonly)
+    {
+        if (!current)
+        {
+            block_index_close(state->index);
+            state->index = NULL;
+            return;
+        }
+
+        for (i = 0; i < state->nindexes; i++)
+            state->indexes[i].position =
+                block_index_column(state->index, state->indexes[i].attnum);
+        return;
+    }
+
+    /* writers maintain exactly the columns they were given */
+    if (current && state->index->header.ncolumns == state->nindexes)
+    {
+        for (i = 0; i < state->nindexes; i++)
+            if (block_index_column(state->index, state->indexes[i].attnum) != i)
+                current = false;
+    }
+    else
+        current = false;
+
+    if (current)
+    {
+        for (i = 0; i < state->nindexes; i++)
+            state->indexes[i].position = i;
+    }
+    else
+        rebuild_block_index(state);
+}
+
+/*
+ * Look up the comparison functions of a btree key on the column. Returns the
+ * right argument type of the operator.
+ */
+static Oid
+prepare_btree_key(StorageScanKey *key, Form_pg_attribute attr, MemoryContext mcxt)
+{
+    TypeCacheEntry *typentry;
+    int         strategy;
+    Oid         lefttype,
+                righttype;
+    Oid         cmp_proc;
+
+    typentry = lookup_type_cache(attr->atttypid, TYPECACHE_BTREE_OPFAMILY);
+    get_op_opfamily_properties(key->opno, typentry->btree_opf, false,
+                               &strategy, &lefttype, &righttype);
+
+    cmp_proc = get_opfamily_proc(typentry->btree_opf, lefttype, righttype,
+                                 BTORDER_PROC);
+    if (!OidIsValid(cmp_proc))
+        elog(ERROR, "tuple_fdw: missing support function %d(%u,%u) in opfamily %u",
+             BTORDER_PROC, lefttype, righttype, typentry->btree_opf);
+
+    fmgr_info_cxt(cmp_proc, &key->cmp, mcxt);
+    key->strategy = strategy;
+    key->collation = attr->attcollation;
+
+    /* array elements are sorted to be looked up in the storage order */
+    if (key->is_array)
+    {
+        cmp_proc = get_opfamily_proc(typentry->btree_opf, righttype, righttype,
+                                     BTORDER_PROC);
+        if (!OidIsValid(cmp_proc))
+            elog(ERROR, "tuple_fdw: missing support function %d(%u,%u) in opfamily %u",
+                 BTORDER_PROC, righttype, righttype, typentry->btree_opf);
+
+        fmgr_info_cxt(cmp_proc, &key->elem_cmp, mcxt);
+    }
+
+    return righttype;
+}
+
+/*
+ * Set scan keys. Keys on columns without statistics, Bloom filters or index
+ * are ignored; the caller has to recheck all the conditions anyway.
+ */
+void
+StorageSetScanKeys(StorageState *state, StorageScanKey *keys, int nkeys)
+{
+    int     i;
+
+    for (i = 0; i < nkeys; i++)
+    {
+        StorageScanKey *key = &keys[i];
+        Form_pg_attribute attr;
+        Oid         righttype;
+
+        attr = TupleDescAttr(state->tupdesc, key->attnum - 1);
+
+        /* keys may outlive the state they were set up for (see segments.c) */
+        key->elem_hashes = NULL;
+        key->nhashes = 0;
+
+        /* patterns are only checked against n-gram filters */
+        if (key->kind != KEY_BTREE)
+        {
+            key->column = -1;
+            key->bloom = find_bloom_column(state, key->attnum, BLOCK_META_NGRAM);
+            key->index = -1;
+            key->collation = attr->attcollation;
+            continue;
+        }
+
+        key->column = find_stats_column(state, key->attnum);
+        key->bloom = find_bloom_column(state, key->attnum, BLOCK_META_BLOOM);
+        key->index = find_index_column(state, key->attnum);
+        if (key->column < 0 && key->bloom < 0 && key->index < 0)
+            continue;
+
+        righttype = prepare_btree_key(key, attr, state->mcxt);
+
+        /*
+         * Bloom filters and the index only answer equality. The key value has
+         * to be hashed by the hash function of the same operator family as
+         * the column values for the hashes to be comparable.
+         */
+        if (key->bloom >= 0 || key->index >= 0)
+        {
+            TypeCacheEntry *typentry;
+            Oid     hash_opf;
+            Oid     hash_proc = InvalidOid;
+
+            typentry = lookup_type_cache(attr->atttypid, TYPECACHE_HASH_OPFAMILY);
+            hash_opf = typentry->hash_opf;
+
+            if (key->strategy == BTEqualStrategyNumber && OidIsValid(hash_opf)
+                && get_op_opfamily_strategy(key->opno, hash_opf) == HTEqualStrategyNumber)
+                hash_proc = get_opfamily_proc(hash_opf, righttype, righttype,
+                                              HASHSTANDARD_PROC);
+
+            if (OidIsValid(hash_proc))
+                fmgr_info_cxt(hash_proc, &key->hash_fn, state->mcxt);
+            else
+                key->bloom = key->index = -1;
+        }
+    }
+
+    state->keys = keys;
+    state->nkeys = nkeys;
+}
+
+/*
+ * Set up btree keys for checking them against file statistics read by
+ * `StorageReadFileInfo`, without the storage state: the planner checks them
+ * against many files.
+ */
+void
+StoragePrepareKeys(TupleDesc tupdesc, StorageScanKey *keys, int nkeys)
+{
+    int     i;
+
+    for (i = 0; i < nkeys; i++)
+    {
+        StorageScanKey *key = &keys[i];
+
+        if (key->kind == KEY_BTREE)
+            prepare_btree_key(key, TupleDescAttr(tupdesc, key->attnum - 1),
+                              CurrentMemoryContext);
+    }
+}
+
+/*
+ * Check that there is a whole block at the offset: it fits into the file of
+ * the given size and its checksum matches.
+ */
+static bool
+is_block_start(StorageState *state, Size offset, Size file_size)
+{
+    StorageBlockHeader header;
+    char       *data;
+    Size        size;
+    pg_crc32c   crc;
+
+    if (offset < StorageFileHeaderSize
+        || offset > state->file_header.last_block_offset)
+        return false;
+
+    if (!read_block_header(state, offset, &header)
+        || header.compressed_size <= 0
+        || header.compressed_size > LZ4_compressBound(BLOCK_SIZE))
+        return false;
+
+    size = header.meta_size + header.compressed_size;
+    if (offset + StorageBlockHeaderSize + size > file_size
+        || (data = read_block_body(state, offset, size)) == NULL)
+        return false;
+
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, data, size);
+    FIN_CRC32C(crc);
+
+    if (!state->mmaped_file)
+        pfree(data);
+
+    return EQ_CRC32C(crc, header.checksum);
+}
+
+/*
+ * Make the scan join other scans of the same file that are currently in
+ * progress (see `syncscan.c`). Only makes sense for large files and for
+ * scans which don't need to return tuples in the storage order.
+ */
+void
+StorageStartSyncScan(StorageState *state)
+{
+    struct stat buf;
+    Size        location;
+
+    Assert(state->readonly);
+
+    if (fstat(storage_fd(state), &buf) != 0)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot get file status: %s", err);
+    }
+
+    /* the same threshold heap uses */
+    if (buf.st_size <= (off_t) (NBuffers / 4) * BLCKSZ)
+        return;
+
+    state->file_id.dev = buf.st_dev;
+    state->file_id.ino = buf.st_ino;
+    state->file_id.created = state->file_header.created;
+    state->syncscan = true;
+
+    location = tuple_ss_get_location(&state->file_id, StorageFileHeaderSize);
+
+    /*
+     * The reported location is always a block boundary as the storage is
+     * append only. Still, a scan starting anywhere else would take garbage
+     * for the end of the file and silently skip the rest of it, so make sure.
+     */
+    if (is_block_start(state, location, buf.st_size))
+        state->start_offset = location;
+}
+
+/*
+ * Read the blocks of the sequential scan ahead of it in a background thread
+ * (see `prefetcher.c`), starting where the scan does. Blocks past the last
+ * one the header knows, including the tail, are read by the scan itself.
+ */
+void
+StorageStartPrefetch(StorageState *state)
+{
+    MemoryContext oldcxt;
+
+    Assert(state->readonly && !state->range_scan);
+
+    if (state->file_header.nblocks == 0)
+        return;
+
+    oldcxt = MemoryContextSwitchTo(state->mcxt);
+    state->prefetcher = block_prefetcher_start(storage_fd(state),
+                                               state->start_offset,
+                                               state->file_header.last_block_offset,
+                                               PREFETCH_BUF_SIZE);
+    MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Whether `StorageReadTuple` can return without waiting for the prefetcher to
+ * read a block
+ */
+bool
+StorageTupleReady(StorageState *state)
+{
+    StorageTupleHeader *st_header = GetCurrentTuple(state);
+
+    if (state->prefetcher == NULL)
+        return true;
+
+    if (!BlockIsInvalid(state->cur_block)
+        && state->cur_offset + StorageTupleHeaderSize <= BLOCK_SIZE
+        && st_header->length != 0)
+        return true;
+
+    return block_prefetcher_ready(state->prefetcher);
+}
+
+void
+StorageStopPrefetch(StorageState *state)
+{
+    if (state->prefetcher == NULL)
+        return;
+
+    block_prefetcher_stop(state->prefetcher);
+    state->prefetcher = NULL;
+}
+
+/*
+ * Make room for a tuple of `len` bytes in the current block, starting a new
+ * block if it doesn't fit. Returns the place for the tuple body.
+ */
+static char *
+reserve_tuple_space(StorageState *state, Size len)
+{
+    StorageTupleHeader st_header;
+    char *buf;
+    Size tuple_length = MAXALIGN(len + StorageTupleHeaderSize);
+
+    if (tuple_length > BLOCK_SIZE)
+        elog(ERROR, "tuple_fdw: maximum tuple size exceeded");
+
+    if (BlockIsInvalid(state->cur_block))
+    {
+        if (state->use_tail)
+            clear_current_block(state, TAIL_BLOCK_OFFSET);
+        else
+            load_last_block(state);
+    }
+
+    if (state->use_tail)
+    {
+        /* rows go to the tail until they make up a whole block */
+        if (state->tail->header.length + state->cur_offset + tuple_length > BLOCK_SIZE)
+            seal_tail(state);
+    }
+    else if (state->cur_offset + tuple_length > BLOCK_SIZE)
+    {
+        /* if not, create new block */
+        if (state->async_compression && state->cur_block.status != BS_LOADED)
+            queue_current_block(state);
+        else
+        {
+            flush_last_block(state);
+            allocate_new_block(state);
+        }
+    }
+
+    /* write tuple length */
+    st_header.length = MAXALIGN(len);
+    buf = state->cur_block.data + state->cur_offset;
+    memcpy(buf, &st_header, StorageTupleHeaderSize);
+
+    return buf + StorageTupleHeaderSize;
+}
+
+/* Account for the tuple just written to the current block */
+static void
+finish_tuple_insert(StorageState *state, HeapTuple tuple)
+{
+    if (state->cur_block.status != BS_NEW)
+        state->cur_block.status = BS_MODIFIED;
+
+    /* the header must not vouch for the new rows with stats we don't keep */
+    if (state->file_stats_stale)
+    {
+        state->header_dirty = true;
+        state->file_stats_stale = false;
+    }
+
+    update_block_stats(state, tuple);
+    update_block_index(state, tuple);
+    state->cur_block.ntuples++;
+
+    /* advance the current offset */
+    state->cur_offset += MAXALIGN(tuple->t_len + StorageTupleHeaderSize);
+}
+
+void
+StorageInsertTuple(StorageState *state, HeapTuple tuple)
+{
+    char   *buf = reserve_tuple_space(state, tuple->t_len);
+
+    memcpy(buf, tuple->t_data, tuple->t_len);
+    finish_tuple_insert(state, tuple);
+}
+
+/*
+ * Form the tuple from the slot values right in the block buffer, the same
+ * way `heap_form_tuple` does, saving an allocation and a copy per row.
+ *
+ * Values stored out of line (e.g. coming from a heap table) are fetched
+ * first: the storage file has to be self-contained.
+ */
+void
+StorageInsertSlot(StorageState *state, TupleTableSlot *slot)
+{
+    TupleDesc       tupdesc = slot->tts_tupleDescriptor;
+    int             natts = tupdesc->natts;
+    Datum          *values;
+    bool           *isnull;
+    bool            hasnull = false;
+    bool            detoasted = false;
+    Size            hoff;
+    Size            data_len;
+    HeapTupleHeader td;
+    HeapTupleData   tuple;
+    int             i;
+
+    slot_getallattrs(slot);
+    values = slot->tts_values;
+    isnull = slot->tts_isnull;
+
+    for (i = 0; i < natts; i++)
+    {
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+
+        if (isnull[i])
+        {
+            hasnull = true;
+            continue;
+        }
+
+        if (attr->attlen == -1 && VARATT_IS_EXTERNAL(DatumGetPointer(values[i])))
+        {
+            if (!detoasted)
+            {
+                if (state->values == NULL)
+                    state->values = MemoryContextAlloc(state->mcxt, sizeof(Datum) * natts);
+                memcpy(state->values, values, sizeof(Datum) * natts);
+                values = state->values;
+                detoasted = true;
+            }
+            values[i] = PointerGetDatum(detoast_external_attr((struct varlena *)
+                                                              DatumGetPointer(values[i])));
+        }
+    }
+
+    hoff = SizeofHeapTupleHeader;
+    if (hasnull)
+        hoff += BITMAPLEN(natts);
+    hoff = MAXALIGN(hoff);
+    data_len = heap_compute_data_size(tupdesc, values, isnull);
+
+    td = (HeapTupleHeader) reserve_tuple_space(state, hoff + data_len);
+    memset(td, 0, hoff);
+
+    HeapTupleHeaderSetDatumLength(td, hoff + data_len);
+    HeapTupleHeaderSetTypeId(td, tupdesc->tdtypeid);
+    HeapTupleHeaderSetTypMod(td, tupdesc->tdtypmod);
+    HeapTupleHeaderSetNatts(td, natts);
+    td->t_hoff = hoff;
+
+    heap_fill_tuple(tupdesc, values, isnull,
+                    (char *) td + hoff, data_len,
+                    &td->t_infomask,
+                    hasnull ? td->t_bits : NULL);
+
+    tuple.t_len = hoff + data_len;
+    tuple.t_data = td;
+    finish_tuple_insert(state, &tuple);
+
+    if (detoasted)
+    {
+        for (i = 0; i < natts; i++)
+            if (values[i] != slot->tts_values[i])
+                pfree(DatumGetPointer(values[i]));
+    }
+}
+
+/* Range scans */
+
+/* Key is a lower bound: `col > v`, `col >= v` or `col = v` */
+#define KeyIsLowerBound(key) ((key)->strategy >= BTEqualStrategyNumber)
+/* Key is an upper bound: `col < v`, `col <= v` or `col = v` */
+#define KeyIsUpperBound(key) ((key)->strategy <= BTEqualStrategyNumber)
+/*
+ * Only keys on the leading sorted column define the range. Of array keys only
+ * one is looked up element by element, the rest are merely rechecked.
+ */
+#define KeyIsRangeKey(state, key) \
+    ((state)->sorted && (key)->column == 0 \
+     && (!(key)->is_array || (key) == (state)->array_key))
+
+static bool
+has_range_keys(StorageState *state)
+{
+    int     i;
+
+    for (i = 0; i < state->nkeys; i++)
+        if (KeyIsRangeKey(state, &state->keys[i]))
+            return true;
+
+    return false;
+}
+
+static inline int
+compare_key_value(StorageScanKey *key, Datum value, Datum key_value)
+{
+    return DatumGetInt32(FunctionCall2Coll(&key->cmp, key->collation,
+                                           value, key_value));
+}
+
+/* Compare column value with the key value (the current array element) */
+static inline int
+compare_key(StorageScanKey *key, Datum value)
+{
+    return compare_key_value(key, value,
+                             key->is_array ? key->elems[key->cur_elem] : key->value);
+}
+
+static int
+compare_array_elems(const void *a, const void *b, void *arg)
+{
+    StorageScanKey *key = (StorageScanKey *) arg;
+
+    return DatumGetInt32(FunctionCall2Coll(&key->elem_cmp, key->collation,
+                                           *(const Datum *) a,
+                                           *(const Datum *) b));
+}
+
+/* Sort array key elements and remove duplicates */
+static void
+sort_array_key(StorageScanKey *key)
+{
+    int     i,
+            n = 0;
+
+    if (key->nelems < 2)
+        return;
+
+    qsort_arg(key->elems, key->nelems, sizeof(Datum), compare_array_elems, key);
+
+    for (i = 1; i < key->nelems; i++)
+        if (compare_array_elems(&key->elems[n], &key->elems[i], key) != 0)
+            key->elems[++n] = key->elems[i];
+    key->nelems = n + 1;
+}
+
+/*
+ * Check whether the [min, max] range of column values may contain values
+ * satisfying the key.
+ */
+static bool
+range_may_match(StorageScanKey *key, Datum min, Datum max)
+{
+    int     lo,
+            hi;
+
+    if (!key->is_array)
+    {
+        switch (key->strategy)
+        {
+            case BTLessStrategyNumber:
+                return compare_key(key, min) < 0;
+            case BTLessEqualStrategyNumber:
+                return compare_key(key, min) <= 0;
+            case BTEqualStrategyNumber:
+                return compare_key(key, min) <= 0 && compare_key(key, max) >= 0;
+            case BTGreaterEqualStrategyNumber:
+                return compare_key(key, max) >= 0;
+            case BTGreaterStrategyNumber:
+                return compare_key(key, max) > 0;
+            default:
+                return true;
+        }
+    }
+
+    /* the first element not below the minimum must not be above the maximum */
+    lo = 0;
+    hi = key->nelems;
+    while (lo < hi)
+    {
+        int     mid = lo + (hi - lo) / 2;
+
+        if (compare_key_value(key, min, key->elems[mid]) <= 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo < key->nelems && compare_key_value(key, max, key->elems[lo]) >= 0;
+}
+
+static void
+alloc_key_hashes(StorageState *state, StorageScanKey *key, int nhashes)
+{
+    if (key->elem_hashes)
+        pfree(key->elem_hashes);
+    key->elem_hashes = MemoryContextAlloc(state->mcxt,
+                                          sizeof(uint32) * Max(nhashes, 1));
+    key->nhashes = 0;
+}
+
+/* Hash trigrams of the literal parts of the pattern */
+static void
+hash_pattern_key(StorageState *state, StorageScanKey *key)
+{
+    text       *pat = DatumGetTextPP(key->value);
+    char       *str = VARDATA_ANY(pat);
+    int         len = VARSIZE_ANY_EXHDR(pat);
+    List       *literals;
+    ListCell   *lc;
+
+    if (key->kind == KEY_ILIKE)
+    {
+        str = str_tolower(str, len, key->collation);
+        len = strlen(str);
+    }
+
+    if (key->kind == KEY_REGEX)
+        literals = regex_pattern_literals(str, len);
+    else
+        literals = like_pattern_literals(str, len);
+
+    /* trigrams can't outnumber the pattern bytes */
+    alloc_key_hashes(state, key, len);
+    foreach (lc, literals)
+    {
+        char   *literal = (char *) lfirst(lc);
+        int     i;
+
+        for (i = 0; i + NGRAM_LEN <= strlen(literal); i++)
+            key->elem_hashes[key->nhashes++] =
+                ngram_hash(literal + i, key->kind == KEY_ILIKE);
+    }
+}
+
+/* Hash the key value (or array elements) for Bloom filter lookups */
+static void
+hash_key(StorageState *state, StorageScanKey *key)
+{
+    int     i;
+
+    if (key->kind != KEY_BTREE)
+    {
+        hash_pattern_key(state, key);
+        return;
+    }
+
+    if (!key->is_array)
+    {
+        key->hash = DatumGetUInt32(FunctionCall1Coll(&key->hash_fn, key->collation,
+                                                     key->value));
+        return;
+    }
+
+    alloc_key_hashes(state, key, key->nelems);
+    for (i = 0; i < key->nelems; i++)
+        key->elem_hashes[key->nhashes++] =
+            DatumGetUInt32(FunctionCall1Coll(&key->hash_fn, key->collation,
+                                             key->elems[i]));
+}
+
+static bool
+bloom_may_match(StorageState *state, StorageScanKey *key, BloomFilter *filter)
+{
+    int     i;
+
+    /* a matching string contains every trigram of the pattern literals */
+    if (key->kind != KEY_BTREE)
+    {
+        for (i = 0; i < key->nhashes; i++)
+            if (!bloom_contains(filter, key->elem_hashes[i]))
+                return false;
+        return true;
+    }
+
+    if (!key->is_array)
+        return bloom_contains(filter, key->hash);
+
+    /* only the current element matters when elements are looked up in turn */
+    if (key == state->array_key)
+        return bloom_contains(filter, key->elem_hashes[key->cur_elem]);
+
+    for (i = 0; i < key->nhashes; i++)
+        if (bloom_contains(filter, key->elem_hashes[i]))
+            return true;
+
+    return false;
+}
+
+/*
+ * Check block statistics against the keys that don't define the range and
+ * Bloom filters against equality and pattern keys, so that blocks which
+ * can't contain matching tuples are skipped without being decompressed.
+ */
+static bool
+block_may_match(StorageState *state, StorageBlockInfo *block)
+{
+    int     i;
+
+    for (i = 0; i < state->nkeys; i++)
+    {
+        StorageScanKey     *key = &state->keys[i];
+        StorageBlockStats  *stats;
+
+        if (key->bloom >= 0 && block->blooms[key->bloom] != NULL
+            && !bloom_may_match(state, key, block->blooms[key->bloom]))
+            return false;
+
+        if (key->column < 0 || KeyIsRangeKey(state, key))
+            continue;
+
+        stats = &block->stats[key->column];
+        if (!stats->present)
+            continue;
+
+        /* NULLs never satisfy btree operators */
+        if (!stats->has_value || !range_may_match(key, stats->min, stats->max))
+            return false;
+    }
+
+    return true;
+}
+
+static int
+compare_blocknos(const void *a, const void *b)
+{
+    int     ba = *(const int *) a;
+    int     bb = *(const int *) b;
+
+    return ba < bb ? -1 : (ba > bb ? 1 : 0);
+}
+
+/* Block directory entry of the block at the offset or -1 */
+static int
+find_block(StorageState *state, Size offset)
+{
+    int     lo = 0,
+            hi = state->nblocks - 1;
+
+    while (lo <= hi)
+    {
+        int     mid = lo + (hi - lo) / 2;
+
+        if (state->blocks[mid].offset == offset)
+            return mid;
+        if (state->blocks[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -1;
+}
+
+/*
+ * Look up the indexed equality keys in the block index. Only the blocks
+ * listed for all of them are visited then.
+ */
+static void
+lookup_index_blocks(StorageState *state)
+{
+    Size   *offsets = NULL;
+    int     capacity = 0;
+    int    *blocknos = NULL;
+    int     i,
+            j;
+
+    state->use_index = false;
+    if (state->index_blocks)
+    {
+        pfree(state->index_blocks);
+        state->index_blocks = NULL;
+    }
+    state->nindex_blocks = 0;
+
+    for (i = 0; i < state->nkeys; i++)
+    {
+        StorageScanKey *key = &state->keys[i];
+        int         column;
+        int         noffsets = 0;
+        int         nblocknos = 0;
+
+        if (key->index < 0)
+            continue;
+
+        column = state->indexes[key->index].position;
+        if (!key->is_array)
+            block_index_lookup(state->index, column, key->hash,
+                               &offsets, &noffsets, &capacity);
+        else
+            for (j = 0; j < key->nhashes; j++)
+                block_index_lookup(state->index, column, key->elem_hashes[j],
+                                   &offsets, &noffsets, &capacity);
+
+        blocknos = MemoryContextAlloc(state->mcxt, sizeof(int) * Max(noffsets, 1));
+        for (j = 0; j < noffsets; j++)
+        {
+            int     blockno = find_block(state, offsets[j]);
+
+            if (blockno >= 0)
+                blocknos[nblocknos++] = blockno;
+        }
+
+        /* sort, deduplicate and intersect with what other keys have found */
+        if (nblocknos > 1)
+        {
+            int     m = 0;
+
+            qsort(blocknos, nblocknos, sizeof(int), compare_blocknos);
+            for (j = 1; j < nblocknos; j++)
+                if (blocknos[j] != blocknos[m])
+                    blocknos[++m] = blocknos[j];
+            nblocknos = m + 1;
+        }
+
+        if (state->use_index)
+        {
+            int     k = 0,
+                    m = 0;
+
+            for (j = 0; j < state->nindex_blocks && k < nblocknos;)
+            {
+                if (state->index_blocks[j] < blocknos[k])
+                    j++;
+                else if (state->index_blocks[j] > blocknos[k])
+                    k++;
+                else
+                {
+                    state->index_blocks[m++] = blocknos[k];
+                    j++;
+                    k++;
+                }
+            }
+            state->nindex_blocks = m;
+            pfree(blocknos);
+        }
+        else
+        {
+            state->index_blocks = blocknos;
+            state->nindex_blocks = nblocknos;
+            state->use_index = true;
+        }
+    }
+
+    /* the tail isn't indexed, it has to be read anyway */
+    if (state->use_index && state->nblocks > 0
+        && state->blocks[state->nblocks - 1].offset == TAIL_BLOCK_OFFSET)
+    {
+        state->index_blocks = repalloc(state->index_blocks,
+                                       sizeof(int) * (state->nindex_blocks + 1));
+        state->index_blocks[state->nindex_blocks++] = state->nblocks - 1;
+    }
+
+    if (offsets)
+        pfree(offsets);
+}
+
+/*
+ * Number of the block to visit after the current one. With the index only
+ * the listed blocks are visited.
+ */
+static int
+next_blockno(StorageState *state)
+{
+    int     lo = 0,
+            hi = state->nindex_blocks;
+
+    if (!state->use_index)
+        return state->cur_blockno + (state->backward ? -1 : 1);
+
+    /* the first listed block past the current one */
+    while (lo < hi)
+    {
+        int     mid = lo + (hi - lo) / 2;
+
+        if (state->index_blocks[mid] > state->cur_blockno)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    if (state->backward)
+    {
+        /* ...or the last one before it */
+        while (lo > 0 && state->index_blocks[lo - 1] >= state->cur_blockno)
+            lo--;
+        return lo > 0 ? state->index_blocks[lo - 1] : -1;
+    }
+
+    return lo < state->nindex_blocks ? state->index_blocks[lo] : state->nblocks;
+}
+
+/*
+ * Check that the value of the sorted column isn't below any of the lower
+ * bounds. NULLs are stored after all other values.
+ */
+static bool
+above_lower_bounds(StorageState *state, Datum value, bool isnull)
+{
+    int     i;
+
+    if (isnull)
+        return true;
+
+    for (i = 0; i < state->nkeys; i++)
+    {
+        StorageScanKey *key = &state->keys[i];
+        int     cmp;
+
+        if (!KeyIsRangeKey(state, key) || !KeyIsLowerBound(key))
+            continue;
+
+        cmp = compare_key(key, value);
+        if (key->strategy == BTGreaterStrategyNumber ? cmp <= 0 : cmp < 0)
+            return false;
+    }
+
+    return true;
+}
+
+/* Check that the value of the sorted column isn't above any upper bound */
+static bool
+below_upper_bounds(StorageState *state, Datum value, bool isnull)
+{
+    int     i;
+
+    for (i = 0; i < state->nkeys; i++)
+    {
+        StorageScanKey *key = &state->keys[i];
+        int     cmp;
+
+        if (!KeyIsRangeKey(state, key) || !KeyIsUpperBound(key))
+            continue;
+
+        if (isnull)
+            return false;
+
+        cmp = compare_key(key, value);
+        if (key->strategy == BTLessStrategyNumber ? cmp >= 0 : cmp > 0)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Binary search the [from, to] part of the block directory for the first and
+ * the last blocks that may contain tuples satisfying the range keys.
+ */
+static void
+narrow_block_range(StorageState *state, int from, int to)
+{
+    int     lo,
+            hi;
+
+    /* the first block whose maximum isn't below the lower bounds */
+    lo = from;
+    hi = to + 1;
+    while (lo < hi)
+    {
+        int     mid = lo + (hi - lo) / 2;
+        StorageBlockStats *stats = &state->blocks[mid].stats[0];
+
+        if (above_lower_bounds(state, stats->max, !stats->has_value))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    state->first_blockno = lo;
+
+    /* the last block whose minimum isn't above the upper bounds */
+    lo = from;
+    hi = to + 1;
+    while (lo < hi)
+    {
+        int     mid = lo + (hi - lo) / 2;
+        StorageBlockStats *stats = &state->blocks[mid].stats[0];
+
+        if (below_upper_bounds(state, stats->min, !stats->has_value))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    state->last_blockno = lo - 1;
+}
+
+static Datum
+get_sort_key(StorageState *state, int n, bool *isnull)
+{
+    StorageTupleHeader *st_header;
+    HeapTupleData       tuple;
+
+    st_header = (StorageTupleHeader *)
+        (state->cur_block.data + state->tuple_offsets[n]);
+    tuple.t_len = st_header->length;
+    tuple.t_data = (HeapTupleHeader) st_header->data;
+
+    return heap_getattr(&tuple, state->stats[0].attnum, state->tupdesc, isnull);
+}
+
+/* The first tuple of the current block not below the lower bounds */
+static int
+find_first_tuple(StorageState *state)
+{
+    int     lo = 0,
+            hi = state->ntuples;
+
+    while (lo < hi)
+    {
+        int     mid = lo + (hi - lo) / 2;
+        Datum   value;
+        bool    isnull;
+
+        value = get_sort_key(state, mid, &isnull);
+        if (above_lower_bounds(state, value, isnull))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+/* The last tuple of the current block not above the upper bounds */
+static int
+find_last_tuple(StorageState *state)
+{
+    int     lo = 0,
+            hi = state->ntuples;
+
+    while (lo < hi)
+    {
+        int     mid = lo + (hi - lo) / 2;
+        Datum   value;
+        bool    isnull;
+
+        value = get_sort_key(state, mid, &isnull);
+        if (below_upper_bounds(state, value, isnull))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo - 1;
+}
+
+/*
+ * Check the range of the first stats column over the whole segment, as the
+ * manifest has it, against the keys on that column. The scan keys must have
+ * their values by now.
+ */
+bool
+StorageSegmentMayMatch(StorageState *state, SegmentInfo *info)
+{
+    char       *ptr = info->range;
+    Datum       min,
+                max;
+    bool        isnull;
+    int         i;
+
+    if (state->nstats == 0 || info->attnum != state->stats[0].attnum
+        || info->range_size == 0)
+        return true;
+
+    min = datumRestore(&ptr, &isnull);
+    max = datumRestore(&ptr, &isnull);
+
+    for (i = 0; i < state->nkeys; i++)
+    {
+        StorageScanKey *key = &state->keys[i];
+
+        if (key->kind != KEY_BTREE || key->column != 0)
+            continue;
+
+        /* NULL never satisfies a btree operator, neither does an empty array */
+        if (key->isnull || (key->is_array && key->nelems == 0) || isnull)
+            return false;
+
+        if (key->is_array)
+            sort_array_key(key);
+        if (!range_may_match(key, min, max))
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Check the ranges of the stats columns over the whole file (`stats` entries
+ * as the header has them) against the keys on those columns. The keys must
+ * have their values by now.
+ */
+bool
+StorageStatsMayMatch(const char *stats, Size stats_size,
+                     StorageScanKey *keys, int nkeys)
+{
+    const char *ptr = stats;
+    int         i;
+
+    while (ptr + StorageMetaEntrySize <= stats + stats_size)
+    {
+        StorageMetaEntry *entry = (StorageMetaEntry *) ptr;
+
+        ptr += MAXALIGN(StorageMetaEntrySize + entry->size);
+        if (entry->kind != BLOCK_META_MINMAX)
+            continue;
+
+        for (i = 0; i < nkeys; i++)
+        {
+            StorageScanKey *key = &keys[i];
+            char       *payload = entry->data;
+            Datum       min,
+                        max;
+            bool        isnull;
+
+            /* keys the storage had no use for aren't set up */
+            if (key->kind != KEY_BTREE || key->attnum != entry->attnum
+                || !OidIsValid(key->cmp.fn_oid))
+                continue;
+
+            min = datumRestore(&payload, &isnull);
+            max = datumRestore(&payload, &isnull);
+
+            /* NULL never satisfies a btree operator, neither does an empty array */
+            if (key->isnull || (key->is_array && key->nelems == 0) || isnull)
+                return false;
+
+            if (key->is_array)
+                sort_array_key(key);
+            if (!range_may_match(key, min, max))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+/* The same for the keys of the scan and the statistics of its file */
+bool
+StorageFileMayMatch(StorageState *state)
+{
+    return StorageStatsMayMatch(state->file_stats, state->file_stats_size,
+                                state->keys, state->nkeys);
 }
 
+/*
+ * Prepare for reading the range of blocks selected by the scan keys (the
+ * whole file if there are none) in the given direction. Relies on the
+ * `sorted` declaration being true.
+ */
 void
-StorageInsertTuple(StorageState *state, HeapTuple tuple)
+StorageStartRangeScan(StorageState *state, bool backward)
 {
-    StorageTupleHeader st_header;
-    char *buf;
-    Size tuple_length = MAXALIGN(tuple->t_len + StorageTupleHeaderSize);
+    int     i;
 
-    if (tuple_length > BLOCK_SIZE)
-        elog(ERROR, "tuple_fdw: maximum tuple size exceeded");
+    Assert(state->readonly && !state->syncscan);
 
-    if (BlockIsInvalid(state->cur_block))
+    state->range_scan = true;
+    state->backward = backward;
+    state->finished = false;
+    state->array_key = NULL;
+
+    /* no need to even look at the blocks if the file is out of the range */
+    if (!StorageFileMayMatch(state))
     {
-        load_last_block(state);
-        find_last_tuple_offset(state);
+        state->finished = true;
+        return;
     }
 
-    /* does the tuple fit current block? */
-    if (state->cur_offset + tuple_length > BLOCK_SIZE)
+    if (!state->tail_loaded)
+        StorageOpenTail(state, false);
+
+    /* directory is built once and reused on rescans */
+    if (state->blocks == NULL)
+        build_block_directory(state);
+
+    for (i = 0; i < state->nkeys; i++)
     {
-        /* if not, create new block */
-        flush_last_block(state);
-        allocate_new_block(state);
+        StorageScanKey *key = &state->keys[i];
+
+        if (key->column < 0 && key->bloom < 0 && key->index < 0)
+            continue;
+
+        /* NULL never satisfies a btree operator, neither does an empty array */
+        if (key->isnull || (key->is_array && key->nelems == 0))
+        {
+            state->finished = true;
+            return;
+        }
+
+        if (key->is_array)
+        {
+            sort_array_key(key);
+            key->cur_elem = backward ? key->nelems - 1 : 0;
+
+            /* elements are looked up one by one if we can find their blocks */
+            if (state->array_key == NULL && state->range_stats && key->column == 0)
+                state->array_key = key;
+        }
+
+        if (key->bloom >= 0 || key->index >= 0)
+            hash_key(state, key);
     }
 
-    /* write tuple length and the tuple itself to the block */
-    st_header.length = MAXALIGN(tuple->t_len);
-    buf = state->cur_block.data + state->cur_offset;
-    memcpy(buf, &st_header, StorageTupleHeaderSize);
-    memcpy(buf + StorageTupleHeaderSize, tuple->t_data, tuple->t_len);
+    lookup_index_blocks(state);
+    if (state->use_index && state->nindex_blocks == 0)
+    {
+        state->finished = true;
+        return;
+    }
 
-    if (state->cur_block.status != BS_NEW)
-        state->cur_block.status = BS_MODIFIED;
+    state->positioned = !has_range_keys(state);
+    state->first_blockno = 0;
+    state->last_blockno = state->nblocks - 1;
 
-    /* advance the current offset */
-    state->cur_offset += tuple_length;
+    if (!state->positioned && state->range_stats)
+        narrow_block_range(state, 0, state->nblocks - 1);
+
+    state->cur_blockno = backward ? state->last_blockno + 1 : state->first_blockno - 1;
+    state->cur_tuple = -1;
+}
+
+/*
+ * Start the sequential scan over from where it has started. Range scans are
+ * restarted with `StorageStartRangeScan` as keys might have changed.
+ */
+void
+StorageRescan(StorageState *state)
+{
+    Assert(!state->range_scan);
+
+    state->cur_block.status = BS_INVALID;
+    state->cur_offset = 0;
+    state->wrapped = false;
+
+    /* the prefetcher has to start over as well */
+    if (state->prefetcher)
+    {
+        StorageStopPrefetch(state);
+        StorageStartPrefetch(state);
+    }
+}
+
+/*
+ * Move on to the next element of the array key, if any, and find the blocks
+ * it may be in. Elements are visited in the scan direction, so the search only
+ * has to look past the blocks of the previous one.
+ */
+static bool
+next_array_element(StorageState *state)
+{
+    StorageScanKey *key = state->array_key;
+
+    if (key == NULL)
+        return false;
+
+    for (;;)
+    {
+        key->cur_elem += state->backward ? -1 : 1;
+        if (key->cur_elem < 0 || key->cur_elem >= key->nelems)
+            return false;
+
+        if (state->backward)
+            narrow_block_range(state, 0, state->last_blockno);
+        else
+            narrow_block_range(state, state->first_blockno, state->nblocks - 1);
+
+        if (state->first_blockno <= state->last_blockno)
+            break;
+    }
+
+    state->positioned = false;
+    state->cur_blockno = state->backward ? state->last_blockno + 1 : state->first_blockno - 1;
+    state->cur_tuple = -1;
+
+    return true;
+}
+
+static HeapTuple
+read_tuple_ranged(StorageState *state)
+{
+    StorageTupleHeader *st_header;
+    HeapTuple   tuple;
+
+    for (;;)
+    {
+        if (state->finished)
+            return NULL;
+
+        /* step to the next block if the current one is exhausted */
+        while (state->cur_tuple < 0 || state->cur_tuple >= state->ntuples)
+        {
+            state->cur_blockno = next_blockno(state);
+            if (state->cur_blockno < state->first_blockno
+                || state->cur_blockno > state->last_blockno)
+            {
+                if (!next_array_element(state))
+                {
+                    state->finished = true;
+                    return NULL;
+                }
+                continue;
+            }
+
+            if (!block_may_match(state, &state->blocks[state->cur_blockno]))
+            {
+                state->cur_tuple = -1;
+                continue;
+            }
+
+            /*
+             * Repeated lookups (e.g. from a nested loop) often land on the
+             * block which is already decompressed.
+             */
+            if (state->cur_block.status != BS_LOADED
+                || state->cur_block.offset != state->blocks[state->cur_blockno].offset)
+            {
+                if (!read_block(state, state->blocks[state->cur_blockno].offset))
+                    elog(ERROR, "tuple_fdw: cannot read block at offset %zu",
+                         state->blocks[state->cur_blockno].offset);
+                collect_tuple_offsets(state);
+            }
+
+            if (state->positioned)
+                state->cur_tuple = state->backward ? state->ntuples - 1 : 0;
+            else
+            {
+                /* find the first tuple within the range */
+                state->cur_tuple = state->backward ?
+                    find_last_tuple(state) : find_first_tuple(state);
+                state->positioned = (state->cur_tuple >= 0
+                                     && state->cur_tuple < state->ntuples);
+            }
+        }
+
+        /* stop as soon as we're out of range */
+        if (has_range_keys(state))
+        {
+            Datum   value;
+            bool    isnull;
+
+            value = get_sort_key(state, state->cur_tuple, &isnull);
+            if (state->backward ?
+                !above_lower_bounds(state, value, isnull) :
+                !below_upper_bounds(state, value, isnull))
+            {
+                if (!next_array_element(state))
+                {
+                    state->finished = true;
+                    return NULL;
+                }
+                continue;
+            }
+        }
+
+        break;
+    }
+
+    st_header = (StorageTupleHeader *)
+        (state->cur_block.data + state->tuple_offsets[state->cur_tuple]);
+    state->cur_tuple += state->backward ? -1 : 1;
+
+    tuple = palloc0(sizeof(HeapTupleData));
+    tuple->t_len = st_header->length;
+    tuple->t_data = (HeapTupleHeader) st_header->data;
+
+    return tuple;
 }
 
 HeapTuple
@@ -420,8 +3659,11 @@ StorageReadTuple(StorageState *state)
     StorageTupleHeader *st_header = GetCurrentTuple(state);
     HeapTuple   tuple;
 
-    /* TODO: cur_offset + sizeof(StorageTupleHeader) actually */
-    if (BlockIsInvalid(state->cur_block) || state->cur_offset > BLOCK_SIZE
+    if (state->range_scan)
+        return read_tuple_ranged(state);
+
+    if (BlockIsInvalid(state->cur_block)
+        || state->cur_offset + StorageTupleHeaderSize > BLOCK_SIZE
         || st_header->length == 0)
     {
         if (!load_next_block(state))
@@ -445,16 +3687,52 @@ StorageReadTuple(StorageState *state)
 void
 StorageRelease(StorageState *state)
 {
-    BlockStatus status = state->cur_block.status;
+    BlockStatus status;
 
-    /* flush pending block */
-    if (status == BS_NEW || status == BS_MODIFIED)
+    if (state->writer)
+        drain_block_writer(state);
+
+    /* flush pending block (a queued one may have been the last) */
+    status = state->cur_block.status;
+    if (state->cur_block.offset == TAIL_BLOCK_OFFSET)
+        ;   /* rows for the tail, see below */
+    else if ((status == BS_NEW && state->cur_block.ntuples > 0) || status == BS_MODIFIED)
         flush_last_block(state);
 
+    /* data first, then the header referring to it */
+    commit_storage_file(state);
+
+    if (state->tail)
+    {
+        if (state->cur_block.offset == TAIL_BLOCK_OFFSET
+            && state->cur_block.ntuples > 0)
+        {
+            tail_append(state->tail, state->cur_block.data, state->cur_offset,
+                        state->cur_block.ntuples);
+            tail_commit(state->tail, state->sync_mode != SYNC_NONE);
+        }
+        tail_close(state->tail);
+        state->tail = NULL;
+    }
+
+    if (state->index)
+    {
+        /* the index now matches the storage file */
+        if (!state->readonly)
+            block_index_sync(state->index,
+                             state->file_header.last_block_offset,
+                             state->file_header.ntuples);
+        block_index_close(state->index);
+        state->index = NULL;
+    }
+
+    StorageStopPrefetch(state);
+
     /*
      * mmaped file (if any) will automatically be unmmaped due to callback (see
-     * `unmap_file_callback`)
+     * `unmap_file_callback`); pooled ones have no file of their own
      */
 
-    FreeFile(state->file);
+    if (state->file)
+        FreeFile(state->file);
 }
@@ -2,10 +2,30 @@
 #define TUPLE_STORAGE_H
 
 #include "access/htup.h"
+#include "access/stratnum.h"
+#include "access/tupdesc.h"
+#include "executor/tuptable.h"
+#include "fmgr.h"
+#include "nodes/pg_list.h"
 #include "port/pg_crc32c.h"
 
+#include "blockindex.h"
+#include "blockwriter.h"
+#include "bloom.h"
+#include "filepool.h"
+#include "prefetcher.h"
+#include "segments.h"
+#include "syncscan.h"
+#include "tail.h"
 
-#define BLOCK_SIZE 1024 * 1024  /* 1 megabyte */
+
+#define BLOCK_SIZE (1024 * 1024)    /* 1 megabyte */
+
+/* blocks taking more than that on disk are read by the scan itself */
+#define PREFETCH_BUF_SIZE (BLOCK_SIZE + BLOCK_SIZE / 4)
+
+#define STORAGE_MAGIC   0x464C5054  /* "TPLF" */
+#define STORAGE_VERSION 1
 
 typedef enum
 {
@@ -20,23 +40,84 @@ typedef enum
 
 typedef struct
 {
+    uint32  magic;
+    uint32  version;
     Size    last_block_offset;
+    uint64  nblocks;
+    uint64  ntuples;
     /* TODO: compression type */
-    /* TODO: block size & version */
+    uint64      created;    /* creation time, tells a recreated file apart */
+    uint64      generation; /* incremented on every write */
+    pg_crc32c   checksum;   /* covers the fields above */
 } StorageFileHeader;
 
+/*
+ * Space reserved for the file header; the first block follows it. The header
+ * is written alternately to two slots, so that a torn write can't destroy the
+ * previous version.
+ */
+#define StorageFileHeaderSize 4096
+#define StorageFileHeaderSlotSize 512
+
+/*
+ * Ranges of the stats columns over all the rows of the file and its tail,
+ * written into the header slot right after the header: a sequence of
+ * BLOCK_META_MINMAX entries (see below). They only count along with the
+ * header of the same generation. Columns whose values don't fit are left out.
+ */
+typedef struct
+{
+    uint32      magic;
+    uint32      size;       /* of the entries following this struct */
+    uint64      generation; /* of the header written along */
+    pg_crc32c   checksum;   /* covers the fields above and the entries */
+} StorageFileStats;
+
+#define STORAGE_STATS_MAGIC 0x534C5054  /* "TPLS" */
+#define StorageFileStatsOffset MAXALIGN(sizeof(StorageFileHeader))
+#define StorageFileStatsSize MAXALIGN(sizeof(StorageFileStats))
+
+/* When data written to the storage file is fsynced */
+typedef enum
+{
+    SYNC_PER_BLOCK,     /* every block before the header refers to it */
+    SYNC_PER_STATEMENT, /* once, before the header is written at the end */
+    SYNC_NONE           /* left to the OS; the file may be lost on a crash */
+} StorageSyncMode;
+
 
 typedef struct
 {
     int32_t     compressed_size;
-    pg_crc32c   checksum;
-    /* TODO: store the last tuple offset */
-    char        data[];     /* compressed block data */
+    pg_crc32c   checksum;   /* covers both metadata and compressed data */
+    uint32      ntuples;
+    uint32      meta_size;
+    char        data[];     /* block metadata followed by compressed data */
 } StorageBlockHeader;
 
 #define StorageBlockHeaderSize offsetof(StorageBlockHeader, data)
 
 
+/*
+ * Block metadata is a sequence of entries, each describing a single column.
+ * Readers skip entries of unknown kinds or for columns they aren't
+ * interested in.
+ */
+typedef struct
+{
+    uint16      kind;
+    int16       attnum;
+    uint32      size;       /* payload size */
+    char        data[];
+} StorageMetaEntry;
+
+#define StorageMetaEntrySize offsetof(StorageMetaEntry, data)
+
+#define BLOCK_META_MINMAX   1   /* serialized min and max values */
+#define BLOCK_META_BLOOM    2   /* BloomFilter of value hashes */
+#define BLOCK_META_NGRAM    3   /* BloomFilter of value trigram hashes */
+
+
 typedef struct
 {
     Size    length;
@@ -53,31 +134,260 @@ typedef struct
     BlockStatus status;
     Size        offset;
     Size        compressed_size;
+    Size        meta_size;
+    uint32      ntuples;            /* number of tuples in the block */
+    uint32      flushed_ntuples;    /* ... as of the last flush */
     char        data[BLOCK_SIZE];
 } Block;
 
+/* Pseudo offset of the tail, which scans read as a block after the last one */
+#define TAIL_BLOCK_OFFSET ((Size) -1)
+
+#define BlockNextOffset(block) \
+    ((block).offset + StorageBlockHeaderSize + (block).meta_size + (block).compressed_size)
+
+
+/*
+ * Column for which we keep per block statistics (min and max values). The
+ * first one is always the leading sorted column, if any.
+ */
+typedef struct
+{
+    AttrNumber  attnum;
+    int16       typlen;
+    bool        typbyval;
+    Oid         collation;
+    FmgrInfo    cmp;        /* btree comparison function */
+
+    /* statistics of the block being filled */
+    bool        has_value;
+    Datum       min;
+    Datum       max;
+
+    /* writer only: range over the whole file, unless unknown (invalid) */
+    bool        file_valid;
+    bool        file_has_value;
+    Datum       file_min;
+    Datum       file_max;
+} StorageStatsColumn;
+
+/* Column for which we build per block Bloom filters */
+typedef struct
+{
+    uint16      kind;       /* BLOCK_META_BLOOM or BLOCK_META_NGRAM */
+    AttrNumber  attnum;
+    Oid         collation;
+    FmgrInfo    hash;       /* hash function of the default hash opclass */
+
+    /* hashes of the values of the block being filled */
+    uint32     *hashes;
+    int         nhashes;
+    int         capacity;
+} StorageBloomColumn;
+
+/* Column covered by the block index */
+typedef struct
+{
+    AttrNumber  attnum;
+    Oid         collation;
+    FmgrInfo    hash;       /* hash function of the default hash opclass */
+    int         position;   /* column number in the index file or -1 */
+
+    /* hashes of the values added to the block being filled */
+    uint32     *hashes;
+    int         nhashes;
+    int         capacity;
+} StorageIndexColumn;
+
+/* Statistics of a single column of a block as stored in the directory */
+typedef struct
+{
+    bool        present;    /* block has statistics for the column */
+    bool        has_value;  /* false if all values are NULL */
+    Datum       min;
+    Datum       max;
+} StorageBlockStats;
+
+/* Block directory entry */
+typedef struct
+{
+    Size        offset;
+    uint32      ntuples;
+    StorageBlockStats *stats;   /* array of `nstats` elements */
+    BloomFilter **blooms;       /* array of `nblooms` elements, may be NULL */
+} StorageBlockInfo;
+
+
+typedef enum
+{
+    KEY_BTREE,      /* btree operator */
+    KEY_LIKE,       /* text LIKE pattern */
+    KEY_ILIKE,      /* text ILIKE pattern */
+    KEY_REGEX       /* text ~ pattern */
+} StorageKeyKind;
+
+/*
+ * Scan key: `column <op> value` or `column = ANY(array)`. Keys on the leading
+ * sorted column narrow the range of blocks and tuples being read, equality
+ * keys on indexed columns restrict the scan to the blocks the index lists;
+ * keys on other columns with block statistics or Bloom filters let us skip
+ * whole blocks. Pattern keys are only checked against n-gram filters.
+ */
+typedef struct
+{
+    StorageKeyKind kind;
+    AttrNumber  attnum;
+    Oid         opno;       /* btree operator; the column is its left argument */
+    Datum       value;
+    bool        isnull;
+
+    /* array elements except NULLs; sorted and deduplicated by the storage */
+    bool        is_array;
+    Datum      *elems;
+    int         nelems;
+
+    /* filled in by the storage */
+    int         column;     /* index in the stats columns or -1 */
+    StrategyNumber strategy;
+    Oid         collation;
+    FmgrInfo    cmp;        /* compares column value with the key value */
+    FmgrInfo    elem_cmp;   /* compares array elements with each other */
+    int         cur_elem;   /* array element being looked up */
+    int         bloom;      /* index in the bloom columns or -1 */
+    int         index;      /* index in the block index columns or -1 */
+    FmgrInfo    hash_fn;    /* hashes the key value like the column values */
+    uint32      hash;       /* ...hash of the key value */
+    uint32     *elem_hashes;   /* ...or of array elements or pattern n-grams */
+    int         nhashes;
+} StorageScanKey;
+
 
 typedef struct
 {
     /* TODO: add exclusive write lock */
+    char       *filename;
     FILE       *file;
     char       *mmaped_file;    /* address of mmaped segment */
     Size        mmaped_size;    /* size of mmaped segment */
+    PooledFile *pooled;         /* mapping kept by the file pool, if any */
     bool        readonly;
+    MemoryContext mcxt;         /* memory context of the state itself */
     StorageFileHeader    file_header;
     Block       cur_block;
     Size        cur_offset;    /* offset within the last_block */
     int         lz4_acceleration;
+    StorageSyncMode sync_mode;
+    bool        header_dirty;   /* file header has changed since written */
+    char       *file_stats;     /* stats entries found along with the header */
+    Size        file_stats_size;
+    bool        file_stats_stale;   /* ...some of which the writer can't keep */
+    bool        unsynced;       /* data has been written since last fsync */
+    bool        async_compression;  /* compress full blocks in background */
+    int         compression_workers;    /* ...by that many threads */
+    BlockWriter *writer;        /* ...started with the first full block */
+
+    /* columns */
+    TupleDesc   tupdesc;
+    Datum      *values;         /* scratch space for forming tuples */
+    StorageStatsColumn *stats;
+    int         nstats;
+    bool        sorted;         /* stats[0] is the leading sorted column */
+    StorageBloomColumn *blooms;
+    int         nblooms;
+    StorageIndexColumn *indexes;
+    int         nindexes;
+    BlockIndex *index;          /* sidecar block index, if usable */
+
+    /*
+     * Range of the first stats column over the whole file, kept up to date
+     * by segment writers for the manifest
+     */
+    bool        track_range;
+    bool        range_has_value;
+    bool        range_has_nulls;
+    Datum       range_min;
+    Datum       range_max;
+
+    /* tail of uncompressed rows */
+    bool        use_tail;       /* writer appends rows to the tail */
+    StorageTail *tail;          /* writer only */
+    bool        tail_loaded;    /* reader only: the tail has been looked for */
+    char       *tail_data;      /* ...its tuples, if any */
+    Size        tail_length;
+    uint32      tail_ntuples;
+
+    BlockPrefetcher *prefetcher;    /* reads blocks ahead of the scan */
+
+    /* synchronized scan */
+    bool        syncscan;       /* take part in synchronized scanning */
+    StorageFileId file_id;
+    Size        start_offset;   /* offset of the block the scan started at */
+    bool        wrapped;        /* scan has reached the end and wrapped */
+
+    /* scan keys */
+    StorageScanKey *keys;
+    int         nkeys;
+    StorageScanKey *array_key;  /* array key looked up element by element */
+
+    /* range scan (in either direction) over the block directory */
+    bool        range_scan;
+    bool        backward;
+    bool        finished;
+    bool        positioned;     /* found the first tuple within the range */
+    StorageBlockInfo *blocks;   /* block directory */
+    int         nblocks;
+    bool        range_stats;    /* every block has stats of the sorted column */
+    int         first_blockno;  /* range of blocks to visit */
+    int         last_blockno;
+    int         cur_blockno;    /* position in the block directory */
+    bool        use_index;      /* only visit the blocks listed by the index */
+    int        *index_blocks;   /* ...sorted block numbers */
+    int         nindex_blocks;
+    uint32     *tuple_offsets;  /* offsets of tuples within current block */
+    int         tuple_offsets_capacity;
+    int         ntuples;
+    int         cur_tuple;      /* position in tuple_offsets */
 } StorageState;
 
 
+bool StorageReadFileInfo(const char *filename,
+            StorageFileHeader *header,
+            Size *file_size,
+            char **stats,
+            Size *stats_size);
 void StorageInit(StorageState *state,
             const char *filename,
             bool readonly,
             bool use_mmap);
+void StorageSetColumns(StorageState *state,
+            TupleDesc tupdesc,
+            List *attrs_sorted,
+            List *attrs_minmax);
+void StorageSetBloomColumns(StorageState *state, List *attrs, List *ngram_attrs);
+void StorageSetIndexColumns(StorageState *state, List *attrs);
+void StorageOpenTail(StorageState *state, bool use_tail);
+uint64 StorageCountTuples(const char *filename);
+void StorageTrackRange(StorageState *state, SegmentInfo *info);
+void StorageSerializeRange(StorageState *state, SegmentInfo *info);
+bool StorageSegmentMayMatch(StorageState *state, SegmentInfo *info);
+bool StorageFileMayMatch(StorageState *state);
+void StorageSetScanKeys(StorageState *state, StorageScanKey *keys, int nkeys);
+void StoragePrepareKeys(TupleDesc tupdesc, StorageScanKey *keys, int nkeys);
+bool StorageStatsMayMatch(const char *stats, Size stats_size,
+            StorageScanKey *keys, int nkeys);
+void StorageStartSyncScan(StorageState *state);
+void StorageStartPrefetch(StorageState *state);
+bool StorageTupleReady(StorageState *state);
+void StorageStopPrefetch(StorageState *state);
+void StorageStartRangeScan(StorageState *state, bool backward);
+void StorageRescan(StorageState *state);
 void StorageInsertTuple(StorageState *state, HeapTuple tuple);
+void StorageInsertSlot(StorageState *state, TupleTableSlot *slot);
 HeapTuple StorageReadTuple(StorageState *state);
 void StorageRelease(StorageState *state);
+void StorageStopCompression(StorageState *state);
+Size StorageCompressBlock(const char *data, StorageBlockHeader *block_header,
+            Size meta_size, int lz4_acceleration);
 void unmap_file(StorageState *state);
 
 #endif /* TUPLE_STORAGE_H */
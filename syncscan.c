@@ -0,0 +1,150 @@
+#include "postgres.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+#include "syncscan.h"
+
+
+/*
+ * Synchronized scans
+ * ------------------
+ *
+ * This is a stripped down version of heap's `syncscan.c`. When several
+ * backends sequentially scan the same large storage file at the same time
+ * we want them to move through the file together so that each block is read
+ * from disk (or page cache) once rather than once per scan. Every scan
+ * reports the offset of the block it has just read; a newly started scan
+ * looks up the last reported offset for the file and starts from there,
+ * wrapping around to the beginning of the file once it hits the end.
+ *
+ * Locations are kept in a small shared array indexed by file identity.
+ * When the array is full the least recently reported entry is evicted. The
+ * array is only available if the library is loaded via
+ * `shared_preload_libraries`; otherwise all scans simply start from the
+ * first block.
+ */
+
+#define SS_NELEM    20      /* how many files we keep track of */
+
+typedef struct
+{
+    StorageFileId   id;
+    Size            location;   /* offset of the last reported block */
+    uint64          stamp;      /* last time the entry was used */
+} ss_entry;
+
+typedef struct
+{
+    uint64      clock;
+    ss_entry    items[SS_NELEM];
+} ss_shared;
+
+
+bool tuple_synchronize_seqscans = true;
+
+static ss_shared   *scan_locations = NULL;
+static LWLock      *scan_locations_lock = NULL;
+
+
+void
+tuple_ss_request_shmem(void)
+{
+    RequestAddinShmemSpace(MAXALIGN(sizeof(ss_shared)));
+    RequestNamedLWLockTranche("tuple_fdw_syncscan", 1);
+}
+
+void
+tuple_ss_init_shmem(void)
+{
+    bool    found;
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    scan_locations = ShmemInitStruct("tuple_fdw syncscan locations",
+                                     sizeof(ss_shared),
+                                     &found);
+    if (!found)
+        memset(scan_locations, 0, sizeof(ss_shared));
+    scan_locations_lock = &(GetNamedLWLockTranche("tuple_fdw_syncscan"))->lock;
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Find an entry for the file or, if `create` is set, take over the least
+ * recently used one. Caller must hold the lock exclusively.
+ */
+static ss_entry *
+ss_search(StorageFileId *id, bool create)
+{
+    ss_entry   *victim = NULL;
+    int         i;
+
+    for (i = 0; i < SS_NELEM; i++)
+    {
+        ss_entry   *item = &scan_locations->items[i];
+
+        if (item->stamp != 0 && item->id.dev == id->dev && item->id.ino == id->ino
+            && item->id.created == id->created)
+        {
+            item->stamp = ++scan_locations->clock;
+            return item;
+        }
+
+        if (victim == NULL || item->stamp < victim->stamp)
+            victim = item;
+    }
+
+    if (!create)
+        return NULL;
+
+    victim->id = *id;
+    victim->location = 0;
+    victim->stamp = ++scan_locations->clock;
+
+    return victim;
+}
+
+/*
+ * Return the offset of the block a new scan of the file should start from.
+ * If nobody is scanning the file at the moment it is the first block.
+ */
+Size
+tuple_ss_get_location(StorageFileId *id, Size first_block_offset)
+{
+    ss_entry   *item;
+    Size        location;
+
+    if (scan_locations == NULL)
+        return first_block_offset;
+
+    LWLockAcquire(scan_locations_lock, LW_EXCLUSIVE);
+    item = ss_search(id, true);
+    if (item->location == 0)
+        item->location = first_block_offset;
+    location = item->location;
+    LWLockRelease(scan_locations_lock);
+
+    return location;
+}
+
+/*
+ * Remember the offset of the block the scan has just read. Like its heap
+ * counterpart we don't wait for the lock: if somebody else is updating the
+ * array right now, skipping a single report does no harm.
+ */
+void
+tuple_ss_report_location(StorageFileId *id, Size offset)
+{
+    if (scan_locations == NULL)
+        return;
+
+    if (LWLockConditionalAcquire(scan_locations_lock, LW_EXCLUSIVE))
+    {
+        ss_entry   *item = ss_search(id, true);
+
+        item->location = offset;
+        LWLockRelease(scan_locations_lock);
+    }
+}
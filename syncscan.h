@@ -0,0 +1,27 @@
+#ifndef TUPLE_SYNCSCAN_H
+#define TUPLE_SYNCSCAN_H
+
+#include <sys/types.h>
+
+
+/*
+ * Identity of a storage file; survives renames and differing paths. The inode
+ * of a removed file may be reused, so the creation time from the file header
+ * is a part of it too.
+ */
+typedef struct
+{
+    dev_t   dev;
+    ino_t   ino;
+    uint64  created;
+} StorageFileId;
+
+
+extern bool tuple_synchronize_seqscans;
+
+void tuple_ss_request_shmem(void);
+void tuple_ss_init_shmem(void);
+Size tuple_ss_get_location(StorageFileId *id, Size first_block_offset);
+void tuple_ss_report_location(StorageFileId *id, Size offset);
+
+#endif /* TUPLE_SYNCSCAN_H */
@@ -0,0 +1,227 @@
+#include "postgres.h"
+#include "storage/fd.h"
+
+#include "tail.h"
+
+#include <unistd.h>
+
+
+/*
+ * Tail
+ * ----
+ *
+ * Optional sidecar file (`<filename>.tail`) collecting rows inserted with
+ * `use_tail`. Appending to the last block of the storage file means
+ * decompressing it, walking its tuples and compressing it again, which for a
+ * statement inserting a row or two costs far more than the insert itself.
+ * Instead such rows are appended uncompressed to the tail, in the same layout
+ * as in a block. Once the tail can't take any more rows it is sealed: its
+ * contents become a new compressed block of the storage file and the tail
+ * starts over empty.
+ *
+ * Like the block index, the tail records the storage file state it follows.
+ * A block is sealed by writing it to the storage file and updating the file
+ * header first, and only then resetting the tail, so a tail which doesn't
+ * match the storage file (the crash happened in between) is stale: its rows
+ * are in the storage file already and it is ignored.
+ *
+ * Scans read the tail after the last block of the storage file as if it was
+ * one more block. As existing blocks and tail rows are never rewritten,
+ * scans may run concurrently with a writer using the tail; the only thing
+ * they have to watch out for is the tail being sealed and reset while they
+ * read it (see `tail_is_intact`).
+ */
+
+static pg_crc32c
+tail_header_checksum(TailHeader *header)
+{
+    pg_crc32c   crc;
+
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, header, offsetof(TailHeader, checksum));
+    FIN_CRC32C(crc);
+
+    return crc;
+}
+
+static bool
+header_is_valid(TailHeader *header)
+{
+    return header->magic == TAIL_MAGIC
+        && header->version == TAIL_VERSION
+        && EQ_CRC32C(header->checksum, tail_header_checksum(header));
+}
+
+/* Find the latest valid header slot */
+static bool
+read_latest_header(FILE *file, TailHeader *header)
+{
+    TailHeader  slots[2];
+    bool        found = false;
+    int         i;
+
+    memset(slots, 0, sizeof(slots));
+    for (i = 0; i < 2; i++)
+    {
+        if (pread(fileno(file), &slots[i], sizeof(TailHeader),
+                  i * TailHeaderSlotSize) != sizeof(TailHeader))
+            continue;
+
+        if (header_is_valid(&slots[i])
+            && (!found || slots[i].generation > header->generation))
+        {
+            *header = slots[i];
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+static void
+tail_write(StorageTail *tail, Size pos, const void *ptr, Size size)
+{
+    if (fseek(tail->file, pos, SEEK_SET) != 0
+        || fwrite(ptr, 1, size, tail->file) != size)
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot write tail '%s': %s", tail->filename, err);
+    }
+}
+
+static void
+tail_sync(StorageTail *tail, bool sync)
+{
+    if (fflush(tail->file) != 0 || (sync && fsync(fileno(tail->file)) != 0))
+    {
+        const char *err = strerror(errno);
+
+        elog(ERROR, "tuple_fdw: cannot sync tail '%s': %s", tail->filename, err);
+    }
+}
+
+/*
+ * Open the tail. Returns NULL if there is no tail and it isn't to be created
+ * or, for readers, if it's invalid. Writers get an empty tail in place of an
+ * invalid one.
+ */
+StorageTail *
+tail_open(const char *filename, bool readonly, bool create)
+{
+    StorageTail *tail;
+    FILE       *file;
+
+    file = AllocateFile(filename, readonly ? "r" : "r+");
+    if (file == NULL && create && !readonly && errno == ENOENT)
+        file = AllocateFile(filename, "w+");
+    if (file == NULL)
+    {
+        const char *err = strerror(errno);
+
+        if (errno == ENOENT)
+            return NULL;
+        elog(ERROR, "tuple_fdw: cannot open tail '%s': %s", filename, err);
+    }
+
+    tail = palloc0(sizeof(StorageTail));
+    tail->filename = pstrdup(filename);
+    tail->file = file;
+    tail->readonly = readonly;
+
+    if (!read_latest_header(file, &tail->header))
+    {
+        if (readonly)
+        {
+            tail_close(tail);
+            return NULL;
+        }
+        tail->header.magic = TAIL_MAGIC;
+        tail->header.version = TAIL_VERSION;
+    }
+
+    return tail;
+}
+
+bool
+tail_is_current(StorageTail *tail, Size last_block_offset, uint64 ntuples)
+{
+    return tail->header.magic == TAIL_MAGIC
+        && tail->header.last_block_offset == last_block_offset
+        && tail->header.ntuples == ntuples;
+}
+
+/*
+ * Check that the tail hasn't been reset since it was opened, which means that
+ * the data read from it is still valid; rows appended since don't matter, they
+ * go past it. A reset tail follows another storage file state.
+ */
+bool
+tail_is_intact(StorageTail *tail)
+{
+    TailHeader  header;
+
+    return read_latest_header(tail->file, &header)
+        && header.last_block_offset == tail->header.last_block_offset
+        && header.ntuples == tail->header.ntuples;
+}
+
+/* Start over with an empty tail following the storage file state */
+void
+tail_reset(StorageTail *tail, Size last_block_offset, uint64 ntuples)
+{
+    Assert(!tail->readonly);
+
+    tail->header.last_block_offset = last_block_offset;
+    tail->header.ntuples = ntuples;
+    tail->header.length = 0;
+    tail->header.tail_ntuples = 0;
+}
+
+/* Read the tuple data into `buf` of at least `header.length` bytes */
+void
+tail_read(StorageTail *tail, char *buf)
+{
+    Size    length = tail->header.length;
+
+    if (pread(fileno(tail->file), buf, length, TailDataOffset) != (ssize_t) length)
+        elog(ERROR, "tuple_fdw: tail '%s' is truncated", tail->filename);
+}
+
+/* Append tuples; they are only visible once the tail is committed */
+void
+tail_append(StorageTail *tail, const char *data, Size size, uint32 ntuples)
+{
+    Assert(!tail->readonly);
+
+    tail_write(tail, TailDataOffset + tail->header.length, data, size);
+    tail->header.length += size;
+    tail->header.tail_ntuples += ntuples;
+}
+
+/*
+ * Write the header into the slot not holding the current one, after the data
+ * it refers to (if `sync` is set, both are fsynced).
+ */
+void
+tail_commit(StorageTail *tail, bool sync)
+{
+    Assert(!tail->readonly);
+
+    tail_sync(tail, sync);
+
+    tail->header.generation++;
+    tail->header.checksum = tail_header_checksum(&tail->header);
+    tail_write(tail, (tail->header.generation % 2) * TailHeaderSlotSize,
+               &tail->header, sizeof(TailHeader));
+
+    tail_sync(tail, sync);
+}
+
+void
+tail_close(StorageTail *tail)
+{
+    FreeFile(tail->file);
+    pfree(tail->filename);
+    pfree(tail);
+}
@@ -0,0 +1,54 @@
+#ifndef TUPLE_TAIL_H
+#define TUPLE_TAIL_H
+
+#include "port/pg_crc32c.h"
+
+#include <stdio.h>
+
+
+#define TAIL_MAGIC      0x4C545054  /* "TPTL" */
+#define TAIL_VERSION    1
+
+typedef struct
+{
+    uint32  magic;
+    uint32  version;
+
+    /* storage file state the tail follows */
+    uint64  last_block_offset;
+    uint64  ntuples;
+
+    /* tuples appended so far */
+    uint64  length;         /* bytes of tuple data */
+    uint64  tail_ntuples;
+
+    uint64      generation; /* incremented on every write */
+    pg_crc32c   checksum;   /* covers the fields above */
+} TailHeader;
+
+/*
+ * The header is written alternately to two slots like the storage file
+ * header; tuple data follows them.
+ */
+#define TailHeaderSlotSize  512
+#define TailDataOffset      (2 * TailHeaderSlotSize)
+
+typedef struct
+{
+    char       *filename;
+    FILE       *file;
+    bool        readonly;
+    TailHeader  header;
+} StorageTail;
+
+
+StorageTail *tail_open(const char *filename, bool readonly, bool create);
+bool tail_is_current(StorageTail *tail, Size last_block_offset, uint64 ntuples);
+bool tail_is_intact(StorageTail *tail);
+void tail_reset(StorageTail *tail, Size last_block_offset, uint64 ntuples);
+void tail_read(StorageTail *tail, char *buf);
+void tail_append(StorageTail *tail, const char *data, Size size, uint32 ntuples);
+void tail_commit(StorageTail *tail, bool sync);
+void tail_close(StorageTail *tail);
+
+#endif /* TUPLE_TAIL_H */
@@ -0,0 +1,12 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION tuple_fdw UPDATE TO '0.2'" to load this file. \quit
+
+-- Storage files written by 0.1 aren't converted and can't be read any more;
+-- their data has to be reloaded into new files.
+
+CREATE FUNCTION tuple_fdw_drop_before(regclass, anyelement)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION tuple_fdw_drop_before(regclass, anyelement) FROM PUBLIC;
@@ -0,0 +1,23 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION tuple_fdw" to load this file. \quit
+
+CREATE FUNCTION tuple_fdw_handler()
+RETURNS fdw_handler
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION tuple_fdw_validator(text[], oid)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FOREIGN DATA WRAPPER tuple_fdw
+  HANDLER tuple_fdw_handler
+  VALIDATOR tuple_fdw_validator;
+
+CREATE FUNCTION tuple_fdw_drop_before(regclass, anyelement)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION tuple_fdw_drop_before(regclass, anyelement) FROM PUBLIC;
@@ -1,42 +1,199 @@
 #include <errno.h>
+#include <glob.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "postgres.h"
 
+#include "access/parallel.h"
 #include "access/reloptions.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#else
+#include "access/heapam.h"
+#endif
+#include "catalog/objectaddress.h"
 #include "catalog/pg_foreign_table.h"
 #include "commands/defrem.h"
+#if PG_VERSION_NUM >= 140000
+#include "executor/execAsync.h"
+#endif
+#include "executor/executor.h"
 #include "foreign/fdwapi.h"
 #include "foreign/foreign.h"
+#include "miscadmin.h"
 #include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/cost.h"
 #include "optimizer/pathnode.h"
 #include "optimizer/paths.h"
 #include "optimizer/planmain.h"
+#include "optimizer/restrictinfo.h"
+#if PG_VERSION_NUM >= 120000
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/clauses.h"
+#include "optimizer/var.h"
+#endif
 #include "parser/parse_oper.h"
 #include "parser/parsetree.h"
+#include "port/atomics.h"
 #include "storage/fd.h"
+#include "storage/ipc.h"
+#if PG_VERSION_NUM >= 140000
+#include "storage/latch.h"
+#endif
 #include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/elog.h"
+#include "utils/fmgroids.h"
+#include "utils/guc.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/selfuncs.h"
+#include "utils/typcache.h"
 
+#include "metacache.h"
+#include "segments.h"
 #include "storage.h"
+#include "syncscan.h"
 
 
 PG_MODULE_MAGIC;
 
 #define ELOG_PREFIX "tuple_fdw: "
 
+/* rows per batch insert unless the `batch_size` option says otherwise */
+#define DEFAULT_BATCH_SIZE  100
+
+
+/* The order in which a scan has to return tuples */
+typedef enum
+{
+    SCAN_UNORDERED,
+    SCAN_FORWARD,       /* storage order */
+    SCAN_BACKWARD       /* reverse storage order */
+} ScanOrder;
+
+/*
+ * Indexes of items in fdw_private lists. The first ones are produced by
+ * `fdw_options_to_list` and are shared by scans and modifications.
+ */
+enum FdwPrivateIndex
+{
+    FdwPrivateFilename,
+    FdwPrivateDirectory,
+    FdwPrivateFilenames,
+    FdwPrivateUseMmap,
+    FdwPrivateLz4Acceleration,
+    FdwPrivateAsyncCompression,
+    FdwPrivateCompressionWorkers,
+    FdwPrivateSyncMode,
+    FdwPrivateUseTail,
+    FdwPrivateSegmentBlocks,
+    FdwPrivateAttrsSorted,
+    FdwPrivateAttrsMinmax,
+    FdwPrivateAttrsBloom,
+    FdwPrivateAttrsNgram,
+    FdwPrivateAttrsIndex,
+    /* scan only */
+    FdwPrivateScanOrder,
+    FdwPrivateKeyAttnums,
+    FdwPrivateKeyOperators,
+    FdwPrivateKeyArrays,
+    FdwPrivateKeyKinds
+};
 
 struct fdw_options
 {
     char   *filename;
+    char   *directory;      /* segmented storage instead of a single file */
+    char   *filenames;      /* read only set of files, may contain wildcards */
     List   *attrs_sorted;
+    List   *attrs_minmax;
+    List   *attrs_bloom;
+    List   *attrs_ngram;
+    List   *attrs_index;
     bool    use_mmap;
     int     lz4_acceleration;
+    bool    async_compression;
+    int     compression_workers;
+    StorageSyncMode sync_mode;
+    bool    use_tail;
+    int     segment_blocks;
+    int     batch_size;
+    bool    async_prefetch; /* planner only */
+
+    /* planner only: file summary taken from the storage headers */
+    double  nblocks;
+    Size    file_size;
+    int     nfiles;
 };
 
+/*
+ * Shared state of a parallel scan. Participants claim whole files one at a
+ * time. The leader lists the files, so that all of them agree on the set.
+ */
+typedef struct
+{
+    pg_atomic_uint32 next_file;
+    int         nfiles;
+    char        filenames[FLEXIBLE_ARRAY_MEMBER];   /* NUL terminated each */
+} TupleParallelScan;
+
+/* Execution state of a foreign scan */
+typedef struct
+{
+    StorageState   *storage;
+    ScanOrder       order;
+
+    /*
+     * Key values may depend on parameters supplied by the outer side of a
+     * nested loop, so they are (re)evaluated whenever the scan (re)starts.
+     */
+    StorageScanKey *keys;
+    List           *key_exprs;  /* ExprStates */
+    int             nkeys;
+    MemoryContext   keys_cxt;   /* by-reference key values */
+    StorageScanKey *file_keys;  /* copy of the keys checked against file headers */
+    bool            started;
+    bool            prefetch;   /* read blocks ahead for an async Append */
+
+    /*
+     * Segmented storage or the `filenames` option: files are scanned one
+     * after another
+     */
+    bool            segmented;
+    List           *segments;   /* file names */
+    List           *manifest;   /* SegmentInfos, only read for range scans */
+    int             next_segment;
+    MemoryContext   segment_cxt;    /* storage state of the current one */
+    TupleParallelScan *pscan;   /* files are claimed from there if parallel */
+} TupleScanState;
+
+/* Execution state of an insertion */
+typedef struct
+{
+    StorageState   *storage;
+    Relation        rel;
+    List           *fdw_private;
+    MemoryContext   cxt;
+
+    /* segmented storage */
+    char           *directory;
+    int             segment_blocks; /* blocks per segment, 0 if unlimited */
+    int             segment_lock;   /* descriptor holding the segment lock */
+    MemoryContext   segment_cxt;    /* storage state of the current segment */
+} TupleModifyState;
+
+/* scans that have to follow the storage order or the key range */
+#define IsRangeScan(fsstate) \
+    ((fsstate)->order == SCAN_BACKWARD || (fsstate)->nkeys > 0)
+
 
 void _PG_init(void);
 
@@ -56,7 +213,22 @@ static ForeignScan *tupleGetForeignPlan(PlannerInfo *root,
                       Plan *outer_plan);
 static TupleTableSlot *tupleIterateForeignScan(ForeignScanState *node);
 static void tupleBeginForeignScan(ForeignScanState *node, int eflags);
+static void tupleReScanForeignScan(ForeignScanState *node);
 static void tupleEndForeignScan(ForeignScanState *node);
+static bool tupleIsForeignScanParallelSafe(PlannerInfo *root,
+                               RelOptInfo *rel,
+                               RangeTblEntry *rte);
+static Size tupleEstimateDSMForeignScan(ForeignScanState *node,
+                            ParallelContext *pcxt);
+static void tupleInitializeDSMForeignScan(ForeignScanState *node,
+                              ParallelContext *pcxt,
+                              void *coordinate);
+static void tupleReInitializeDSMForeignScan(ForeignScanState *node,
+                                ParallelContext *pcxt,
+                                void *coordinate);
+static void tupleInitializeWorkerForeignScan(ForeignScanState *node,
+                                 shm_toc *toc,
+                                 void *coordinate);
 static List *tuplePlanForeignModify(PlannerInfo *root,
 						  ModifyTable *plan,
 						  Index resultRelation,
@@ -72,12 +244,94 @@ static TupleTableSlot *tupleExecForeignInsert(EState *estate,
 						  TupleTableSlot *planSlot);
 static void tupleEndForeignModify(EState *estate,
                       ResultRelInfo *resultRelInfo);
+#if PG_VERSION_NUM >= 110000
+static void tupleBeginForeignInsert(ModifyTableState *mtstate,
+                        ResultRelInfo *resultRelInfo);
+static void tupleEndForeignInsert(EState *estate,
+                      ResultRelInfo *resultRelInfo);
+#endif
+#if PG_VERSION_NUM >= 140000
+static bool tupleIsForeignPathAsyncCapable(ForeignPath *path);
+static void tupleForeignAsyncRequest(AsyncRequest *areq);
+static void tupleForeignAsyncConfigureWait(AsyncRequest *areq);
+static void tupleForeignAsyncNotify(AsyncRequest *areq);
+static int tupleGetForeignModifyBatchSize(ResultRelInfo *resultRelInfo);
+static TupleTableSlot **tupleExecForeignBatchInsert(EState *estate,
+                            ResultRelInfo *resultRelInfo,
+                            TupleTableSlot **slots,
+                            TupleTableSlot **planSlots,
+                            int *numSlots);
+#endif
+
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static void
+tuple_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    tuple_ss_request_shmem();
+}
+#endif
 
+static void
+tuple_shmem_startup(void)
+{
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    tuple_ss_init_shmem();
+}
 
 void
 _PG_init(void)
 {
-    // Nothing yet
+    DefineCustomBoolVariable("tuple_fdw.synchronize_seqscans",
+                             "Enable synchronized sequential scans of storage files.",
+                             NULL,
+                             &tuple_synchronize_seqscans,
+                             true,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+
+    DefineCustomIntVariable("tuple_fdw.mmap_pool_size",
+                            "Number of mmaped storage files a backend keeps open between scans.",
+                            "Zero disables the pool.",
+                            &tuple_mmap_pool_size,
+                            64,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    /*
+     * Shared memory is only available when loaded via
+     * shared_preload_libraries. Otherwise synchronized scans are silently
+     * disabled.
+     */
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = tuple_shmem_request;
+#else
+    tuple_ss_request_shmem();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = tuple_shmem_startup;
 }
 
 PG_FUNCTION_INFO_V1(tuple_fdw_handler);
@@ -91,15 +345,76 @@ tuple_fdw_handler(PG_FUNCTION_ARGS)
     routine->GetForeignPlan = tupleGetForeignPlan;
     routine->BeginForeignScan = tupleBeginForeignScan;
     routine->IterateForeignScan = tupleIterateForeignScan;
+    routine->ReScanForeignScan = tupleReScanForeignScan;
     routine->EndForeignScan = tupleEndForeignScan;
+    routine->IsForeignScanParallelSafe = tupleIsForeignScanParallelSafe;
+    routine->EstimateDSMForeignScan = tupleEstimateDSMForeignScan;
+    routine->InitializeDSMForeignScan = tupleInitializeDSMForeignScan;
+    routine->ReInitializeDSMForeignScan = tupleReInitializeDSMForeignScan;
+    routine->InitializeWorkerForeignScan = tupleInitializeWorkerForeignScan;
 	routine->PlanForeignModify = tuplePlanForeignModify;
 	routine->BeginForeignModify = tupleBeginForeignModify;
 	routine->ExecForeignInsert = tupleExecForeignInsert;
 	routine->EndForeignModify = tupleEndForeignModify;
+#if PG_VERSION_NUM >= 110000
+    routine->BeginForeignInsert = tupleBeginForeignInsert;
+    routine->EndForeignInsert = tupleEndForeignInsert;
+#endif
+#if PG_VERSION_NUM >= 140000
+    routine->IsForeignPathAsyncCapable = tupleIsForeignPathAsyncCapable;
+    routine->ForeignAsyncRequest = tupleForeignAsyncRequest;
+    routine->ForeignAsyncConfigureWait = tupleForeignAsyncConfigureWait;
+    routine->ForeignAsyncNotify = tupleForeignAsyncNotify;
+    routine->GetForeignModifyBatchSize = tupleGetForeignModifyBatchSize;
+    routine->ExecForeignBatchInsert = tupleExecForeignBatchInsert;
+#endif
 
     PG_RETURN_POINTER(routine);
 }
 
+static StorageSyncMode
+parse_sync_mode(DefElem *def)
+{
+    char   *value = defGetString(def);
+
+    if (strcmp(value, "per_block") == 0)
+        return SYNC_PER_BLOCK;
+    if (strcmp(value, "per_statement") == 0)
+        return SYNC_PER_STATEMENT;
+    if (strcmp(value, "none") == 0)
+        return SYNC_NONE;
+
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg(ELOG_PREFIX "sync_mode must be one of 'per_block', 'per_statement' or 'none', got '%s'",
+                    value)));
+    return SYNC_PER_BLOCK;      /* keep compiler quiet */
+}
+
+/* Parse an option which takes a positive integer not exceeding `max` */
+static int
+parse_positive_int(DefElem *def, int max)
+{
+    char   *value = defGetString(def);
+    char   *end;
+    long    result;
+
+    errno = 0;
+    result = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0'
+        || result <= 0 || result > PG_INT32_MAX)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg(ELOG_PREFIX "%s requires a positive integer, got '%s'",
+                        def->defname, value)));
+    if (result > max)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg(ELOG_PREFIX "%s must not exceed %d", def->defname, max)));
+
+    return (int) result;
+}
+
 static List *
 parse_attributes_list(char *start, Oid relid)
 {
@@ -126,7 +441,7 @@ tuple_fdw_validator(PG_FUNCTION_ARGS)
     List       *options_list = untransformRelOptions(PG_GETARG_DATUM(0));
     Oid         catalog = PG_GETARG_OID(1);
     ListCell   *lc;
-    bool        filename_provided = false;
+    int         nlocations = 0;
 
     /* Only check table options */
     if (catalog != ForeignTableRelationId)
@@ -154,9 +469,37 @@ tuple_fdw_validator(PG_FUNCTION_ARGS)
 
                 FreeFile(fd);
             }
-            filename_provided = true;
+            nlocations++;
         }
-        else if (strcmp(def->defname, "sorted") == 0)
+        else if (strcmp(def->defname, "directory") == 0)
+        {
+            const char *directory = defGetString(def);
+
+            if (access(directory, F_OK) == -1)
+            {
+                elog(WARNING,
+                     ELOG_PREFIX "directory '%s' does not exist; it will be created automatically",
+                     directory);
+
+                if (mkdir(directory, S_IRWXU) != 0)
+                {
+                    const char *err = strerror(errno);
+
+                    elog(ERROR, "cannot create directory '%s': %s", directory, err);
+                }
+            }
+            nlocations++;
+        }
+        else if (strcmp(def->defname, "filenames") == 0)
+        {
+            /* patterns may match nothing yet */
+            nlocations++;
+        }
+        else if (strcmp(def->defname, "sorted") == 0 ||
+                 strcmp(def->defname, "minmax_columns") == 0 ||
+                 strcmp(def->defname, "bloom_columns") == 0 ||
+                 strcmp(def->defname, "ngram_columns") == 0 ||
+                 strcmp(def->defname, "index_columns") == 0)
         {
             /* 
              * TODO: we can't check that those are actual column names. But
@@ -164,7 +507,10 @@ tuple_fdw_validator(PG_FUNCTION_ARGS)
              * list
              */
         }
-        else if (strcmp(def->defname, "use_mmap") == 0)
+        else if (strcmp(def->defname, "use_mmap") == 0 ||
+                 strcmp(def->defname, "async_compression") == 0 ||
+                 strcmp(def->defname, "use_tail") == 0 ||
+                 strcmp(def->defname, "async_prefetch") == 0)
         {
             defGetBoolean(def);
         }
@@ -172,6 +518,22 @@ tuple_fdw_validator(PG_FUNCTION_ARGS)
         {
             /* TODO: validate it's an integer */
         }
+        else if (strcmp(def->defname, "batch_size") == 0)
+        {
+            parse_positive_int(def, PG_INT32_MAX);
+        }
+        else if (strcmp(def->defname, "compression_workers") == 0)
+        {
+            parse_positive_int(def, BLOCK_WRITER_MAX_THREADS);
+        }
+        else if (strcmp(def->defname, "segment_blocks") == 0)
+        {
+            parse_positive_int(def, PG_INT32_MAX);
+        }
+        else if (strcmp(def->defname, "sync_mode") == 0)
+        {
+            parse_sync_mode(def);
+        }
         else
         {
             ereport(ERROR,
@@ -180,8 +542,10 @@ tuple_fdw_validator(PG_FUNCTION_ARGS)
         }
     }
 
-    if (!filename_provided)
-        elog(ERROR, ELOG_PREFIX "filename is required");
+    if (nlocations == 0)
+        elog(ERROR, ELOG_PREFIX "filename, filenames or directory is required");
+    if (nlocations > 1)
+        elog(ERROR, ELOG_PREFIX "only one of filename, filenames or directory can be used");
 
     PG_RETURN_VOID();
 }
@@ -192,7 +556,10 @@ extract_table_options(Oid relid, struct fdw_options *options)
 	ForeignTable   *table;
     ListCell       *lc;
 
+    memset(options, 0, sizeof(struct fdw_options));
     options->lz4_acceleration = 1;  /* default acceleration */
+    options->batch_size = DEFAULT_BATCH_SIZE;
+    options->compression_workers = 1;
 
     table = GetForeignTable(relid);
     foreach(lc, table->options)
@@ -203,11 +570,39 @@ extract_table_options(Oid relid, struct fdw_options *options)
         {
             options->filename = defGetString(def);
         }
+        else if (strcmp(def->defname, "directory") == 0)
+        {
+            options->directory = defGetString(def);
+        }
+        else if (strcmp(def->defname, "filenames") == 0)
+        {
+            options->filenames = defGetString(def);
+        }
         else if (strcmp(def->defname, "sorted") == 0)
         {
             options->attrs_sorted =
                 parse_attributes_list(defGetString(def), relid);
         }
+        else if (strcmp(def->defname, "minmax_columns") == 0)
+        {
+            options->attrs_minmax =
+                parse_attributes_list(defGetString(def), relid);
+        }
+        else if (strcmp(def->defname, "bloom_columns") == 0)
+        {
+            options->attrs_bloom =
+                parse_attributes_list(defGetString(def), relid);
+        }
+        else if (strcmp(def->defname, "ngram_columns") == 0)
+        {
+            options->attrs_ngram =
+                parse_attributes_list(defGetString(def), relid);
+        }
+        else if (strcmp(def->defname, "index_columns") == 0)
+        {
+            options->attrs_index =
+                parse_attributes_list(defGetString(def), relid);
+        }
         else if (strcmp(def->defname, "use_mmap") == 0)
         {
             options->use_mmap = defGetBoolean(def);
@@ -216,6 +611,35 @@ extract_table_options(Oid relid, struct fdw_options *options)
         {
             options->lz4_acceleration = pg_atoi(defGetString(def), 4, 0);
         }
+        else if (strcmp(def->defname, "async_compression") == 0)
+        {
+            options->async_compression = defGetBoolean(def);
+        }
+        else if (strcmp(def->defname, "use_tail") == 0)
+        {
+            options->use_tail = defGetBoolean(def);
+        }
+        else if (strcmp(def->defname, "async_prefetch") == 0)
+        {
+            options->async_prefetch = defGetBoolean(def);
+        }
+        else if (strcmp(def->defname, "batch_size") == 0)
+        {
+            options->batch_size = parse_positive_int(def, PG_INT32_MAX);
+        }
+        else if (strcmp(def->defname, "compression_workers") == 0)
+        {
+            options->compression_workers =
+                parse_positive_int(def, BLOCK_WRITER_MAX_THREADS);
+        }
+        else if (strcmp(def->defname, "sync_mode") == 0)
+        {
+            options->sync_mode = parse_sync_mode(def);
+        }
+        else if (strcmp(def->defname, "segment_blocks") == 0)
+        {
+            options->segment_blocks = parse_positive_int(def, PG_INT32_MAX);
+        }
     }
 }
 
@@ -224,40 +648,154 @@ fdw_options_to_list(struct fdw_options *o)
 {
     List *lst = NIL;
 
-    lst = lappend(lst, makeString(o->filename));
+    /* whichever isn't used is an empty string */
+    lst = lappend(lst, makeString(o->filename ? o->filename : ""));
+    lst = lappend(lst, makeString(o->directory ? o->directory : ""));
+    lst = lappend(lst, makeString(o->filenames ? o->filenames : ""));
     lst = lappend(lst, makeInteger(o->use_mmap));
     lst = lappend(lst, makeInteger(o->lz4_acceleration));
-    /* 
-     * We don't pass `attrs_sorted` further to the executer as it is only used
-     * in the planner
+    lst = lappend(lst, makeInteger(o->async_compression));
+    lst = lappend(lst, makeInteger(o->compression_workers));
+    lst = lappend(lst, makeInteger(o->sync_mode));
+    lst = lappend(lst, makeInteger(o->use_tail));
+    lst = lappend(lst, makeInteger(o->segment_blocks));
+    /*
+     * block statistics are maintained for sorted and minmax columns, Bloom
+     * filters for bloom and ngram columns, the block index for index columns
      */
+    lst = lappend(lst, o->attrs_sorted);
+    lst = lappend(lst, o->attrs_minmax);
+    lst = lappend(lst, o->attrs_bloom);
+    lst = lappend(lst, o->attrs_ngram);
+    lst = lappend(lst, o->attrs_index);
 
     return lst;
 }
 
+/*
+ * Expand the `filenames` option: a space separated list of paths which may
+ * contain shell wildcards. Matches of a pattern come sorted by name; patterns
+ * matching nothing are skipped.
+ */
+static List *
+expand_filenames(const char *patterns)
+{
+    List   *files = NIL;
+    char   *start = pstrdup(patterns);
+    char   *token;
+
+    while ((token = strtok(start, " ")) != NULL)
+    {
+        glob_t  matches;
+        int     ret;
+        size_t  i;
+
+        ret = glob(token, 0, NULL, &matches);
+        if (ret == 0)
+        {
+            for (i = 0; i < matches.gl_pathc; i++)
+                files = lappend(files, pstrdup(matches.gl_pathv[i]));
+        }
+        globfree(&matches);
+
+        if (ret != 0 && ret != GLOB_NOMATCH)
+            elog(ERROR, ELOG_PREFIX "cannot expand pattern '%s'", token);
+        start = NULL;
+    }
+
+    return files;
+}
+
+static int plan_time_keys(PlannerInfo *root, RelOptInfo *baserel,
+                          struct fdw_options *options, StorageScanKey **keys);
+
 static void
 tupleGetForeignRelSize(PlannerInfo *root,
                        RelOptInfo *baserel,
                        Oid foreigntableid)
 {
     struct fdw_options *options;
+    FileMeta            meta;
+    Selectivity         sel;
+    List               *files;
+    ListCell           *lc;
+    StorageScanKey     *keys;
+    int                 nkeys;
+    double              ntuples = 0;
 
     options = palloc0(sizeof(struct fdw_options));
     extract_table_options(foreigntableid, options);
 
+    /*
+     * The file header keeps the number of blocks and tuples which is all we
+     * need for estimates. A missing or not yet initialized file is empty.
+     * Segmented storage and `filenames` add up the headers of the files.
+     * Headers are cached across queries (see metacache.c).
+     */
+    if (options->directory)
+        files = segment_list(options->directory);
+    else if (options->filenames)
+        files = expand_filenames(options->filenames);
+    else
+        files = list_make1(options->filename);
+    options->nfiles = list_length(files);
+
+    /*
+     * Files whose headers say they have nothing in the range of the keys
+     * known by now are left out: the scan skips them (checking again, the
+     * plan may outlive the ranges).
+     */
+    nkeys = plan_time_keys(root, baserel, options, &keys);
+    if (nkeys > 0)
+    {
+        Relation    rel = relation_open(foreigntableid, NoLock);
+
+        StoragePrepareKeys(RelationGetDescr(rel), keys, nkeys);
+        relation_close(rel, NoLock);
+    }
+
+    baserel->tuples = 0;
+    foreach (lc, files)
+    {
+        if (!metacache_lookup(foreigntableid, (char *) lfirst(lc), &meta))
+            continue;
+
+        ntuples += meta.header.ntuples;
+        if (nkeys > 0
+            && !StorageStatsMayMatch(meta.stats, meta.stats_size, keys, nkeys))
+            continue;
+
+        options->nblocks += meta.header.nblocks;
+        options->file_size += meta.file_size;
+        baserel->tuples += meta.header.ntuples;
+    }
+
+    baserel->pages = options->file_size / BLCKSZ;
+
+    /* the files left out can't contribute any rows */
+    sel = clauselist_selectivity(root, baserel->baserestrictinfo, 0,
+                                 JOIN_INNER, NULL);
+    baserel->rows = clamp_row_est(Min(ntuples * sel, baserel->tuples));
+
     baserel->fdw_private = options;
 }
 
-static void
-tupleGetForeignPaths(PlannerInfo *root,
-					RelOptInfo *baserel,
-					Oid foreigntableid)
+/*
+ * Build pathkeys matching the storage order (or the reverse one) declared by
+ * the `sorted` option.
+ */
+static List *
+build_sorted_pathkeys(PlannerInfo *root,
+                      RelOptInfo *baserel,
+                      struct fdw_options *options,
+                      bool reverse)
 {
-    double  startup_cost = 0;
-    double  total_cost = 100;
     List   *pathkeys = NIL;
     ListCell *lc;
-    struct fdw_options *options = (struct fdw_options *) baserel->fdw_private;
+
+    /* segments and files are only sorted each on its own */
+    if (options->directory || options->filenames)
+        return NIL;
 
     foreach (lc, options->attrs_sorted)
     {
@@ -266,7 +804,8 @@ tupleGetForeignPaths(PlannerInfo *root,
         Oid         typid,
                     collid;
         int32       typmod;
-        Oid         sort_op;
+        Oid         lt_op,
+                    gt_op;
         Var        *var;
         List       *attr_pathkey;
 
@@ -274,187 +813,1694 @@ tupleGetForeignPaths(PlannerInfo *root,
         get_atttypetypmodcoll(relid, attnum, &typid, &typmod, &collid);
         var = makeVar(baserel->relid, attnum, typid, typmod, collid, 0);
 
-        /* Lookup sorting operator for the attribute type */
+        /* Lookup sorting operators for the attribute type */
         get_sort_group_operators(typid,
-                                 true, false, false,
-                                 &sort_op, NULL, NULL,
+                                 true, false, true,
+                                 &lt_op, NULL, &gt_op,
                                  NULL);
 
         attr_pathkey = build_expression_pathkey(root, (Expr *) var, NULL,
-                                                sort_op, baserel->relids,
+                                                reverse ? gt_op : lt_op,
+                                                baserel->relids,
                                                 true);
         pathkeys = list_concat(pathkeys, attr_pathkey);
     }
 
-	add_path(baserel, (Path *)
-			 create_foreignscan_path(root, baserel,
-                                     NULL,	/* default pathtarget */
-                                     baserel->rows,
-                                     startup_cost,
-                                     total_cost,
-                                     pathkeys,  /* no info on sorting */
-                                     NULL,	/* no outer rel either */
-                                     NULL,	/* no extra plan */
-                                     NULL));
+    /*
+     * Don't advertise the ordering unless someone can make use of it: scans
+     * which don't have to preserve the storage order may be synchronized with
+     * other scans of the same file.
+     */
+    return truncate_useless_pathkeys(root, baserel, pathkeys);
 }
 
-static ForeignScan *
-tupleGetForeignPlan(PlannerInfo *root,
-                      RelOptInfo *baserel,
-                      Oid foreigntableid,
-                      ForeignPath *best_path,
-                      List *tlist,
-                      List *scan_clauses,
-                      Plan *outer_plan)
+static Node *
+strip_relabel(Node *node)
 {
-    List               *fdw_private = NIL;
+    while (node && IsA(node, RelabelType))
+        node = (Node *) ((RelabelType *) node)->arg;
+    return node;
+}
 
-    fdw_private = fdw_options_to_list((struct fdw_options *) baserel->fdw_private);
+static bool
+is_column_var(Node *node, RelOptInfo *baserel, AttrNumber attnum)
+{
+    Var    *var = (Var *) strip_relabel(node);
 
-	/* Create the ForeignScan node */
-	return make_foreignscan(tlist,
-                            scan_clauses,
-                            baserel->relid,
-                            NIL,	/* no expressions to evaluate */
-                            fdw_private,
-                            NIL,	/* no custom tlist */
-                            NIL,	/* no remote quals */
-                            outer_plan);
+    return var != NULL && IsA(var, Var)
+        && var->varno == baserel->relid
+        && var->varattno == attnum
+        && var->varlevelsup == 0;
 }
 
-static void
-unmap_file_callback(void *arg)
+/*
+ * The value has to be known by the time the scan starts. Besides constants
+ * and parameters it may reference other relations, which then have to be
+ * supplied by the outer side of a nested loop.
+ */
+static bool
+is_key_value(PlannerInfo *root, RelOptInfo *baserel, Expr *value)
 {
-    StorageState *state = (StorageState *) arg;
+    Relids      varnos;
 
-    unmap_file(state);
+#if PG_VERSION_NUM >= 140000
+    varnos = pull_varnos(root, (Node *) value);
+#else
+    varnos = pull_varnos((Node *) value);
+#endif
+    return !bms_is_member(baserel->relid, varnos)
+        && !contain_volatile_functions((Node *) value);
 }
 
-static void
-tupleBeginForeignScan(ForeignScanState *node, int eflags)
+/*
+ * Check whether the clause is of form `column <op> value` (or the commuted
+ * one) where <op> belongs to the btree operator family of the column type, or
+ * `column = ANY(array)`. Returns the operator with the column as its left
+ * argument and the value expression.
+ */
+static bool
+match_key_clause(PlannerInfo *root, RelOptInfo *baserel, Expr *clause,
+                 AttrNumber attnum, Oid *opno, Expr **value, bool *is_array)
 {
-    StorageState   *state;
-    ForeignScan    *plan = (ForeignScan *) node->ss.ps.plan;
-    List           *fdw_private = plan->fdw_private;
-    char           *filename;
-    bool            use_mmap;
+    Var            *var;
+    Oid             inputcollid;
+    TypeCacheEntry *typentry;
+    int             strategy;
 
-    state = palloc0(sizeof(StorageState));
-
-    Assert(list_length(fdw_private) == 3);
-    filename = strVal(linitial(fdw_private));
-    use_mmap = intVal(lsecond(fdw_private));
+    if (IsA(clause, ScalarArrayOpExpr))
+    {
+        ScalarArrayOpExpr *saop = (ScalarArrayOpExpr *) clause;
 
-    /* open file */
-    StorageInit(state, filename, true, use_mmap);
+        if (!saop->useOr || !is_column_var(linitial(saop->args), baserel, attnum))
+            return false;
 
-    if (use_mmap)
+        var = (Var *) strip_relabel(linitial(saop->args));
+        *value = (Expr *) lsecond(saop->args);
+        *opno = saop->opno;
+        *is_array = true;
+        inputcollid = saop->inputcollid;
+    }
+    else if (IsA(clause, OpExpr) && list_length(((OpExpr *) clause)->args) == 2)
     {
-        EState     *estate = node->ss.ps.state;
-        MemoryContextCallback *callback;
+        OpExpr     *op = (OpExpr *) clause;
 
-        /* unmap files automatically by using memory context callback */
-        callback = palloc0(sizeof(MemoryContextCallback));
-        callback->func = unmap_file_callback;
-        callback->arg = (void *) state;
-        MemoryContextRegisterResetCallback(estate->es_query_cxt, callback);
-    }
+        if (is_column_var(linitial(op->args), baserel, attnum))
+        {
+            var = (Var *) strip_relabel(linitial(op->args));
+            *value = (Expr *) lsecond(op->args);
+            *opno = op->opno;
+        }
+        else if (is_column_var(lsecond(op->args), baserel, attnum))
+        {
+            var = (Var *) strip_relabel(lsecond(op->args));
+            *value = (Expr *) linitial(op->args);
+            *opno = get_commutator(op->opno);
+        }
+        else
+            return false;
 
-    node->fdw_state = state;
-}
+        *is_array = false;
+        inputcollid = op->inputcollid;
+    }
+    else
+        return false;
 
-static TupleTableSlot *
-tupleIterateForeignScan(ForeignScanState *node)
-{
-    StorageState   *state = (StorageState *) node->fdw_state;
-    TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
-    HeapTuple tuple;
+    if (!OidIsValid(*opno) || !is_key_value(root, baserel, *value))
+        return false;
 
-	ExecClearTuple(slot);
+    /* the storage is ordered according to the default btree opclass */
+    typentry = lookup_type_cache(var->vartype, TYPECACHE_BTREE_OPFAMILY);
+    if (!OidIsValid(typentry->btree_opf))
+        return false;
 
-    if ((tuple = StorageReadTuple(state)) == NULL)
-        return slot;
+    strategy = get_op_opfamily_strategy(*opno, typentry->btree_opf);
+    if (strategy == 0 || (*is_array && strategy != BTEqualStrategyNumber))
+        return false;
 
-#if PG_VERSION_NUM < 120000
-    ExecStoreTuple(tuple, slot, InvalidBuffer, false);
-#else
-    ExecStoreHeapTuple(tuple, slot, false);
-#endif
+    /* ...and the column collation */
+    if (inputcollid != var->varcollid)
+        return false;
 
-    return slot;
+    return true;
 }
 
-static void
-tupleEndForeignScan(ForeignScanState *node)
+/*
+ * Check whether the clause is of form `column LIKE pattern`, `column ILIKE
+ * pattern` or `column ~ pattern` on a text column, which n-gram filters can
+ * be checked against.
+ */
+static bool
+match_pattern_clause(PlannerInfo *root, RelOptInfo *baserel, Expr *clause,
+                     AttrNumber attnum, StorageKeyKind *kind, Expr **value)
 {
-	StorageState *state = (StorageState *) node->fdw_state;
+    OpExpr     *op = (OpExpr *) clause;
+    Var        *var;
 
-    StorageRelease(state);
-}
+    if (!IsA(clause, OpExpr) || list_length(op->args) != 2
+        || !is_column_var(linitial(op->args), baserel, attnum))
+        return false;
 
-static List *
-tuplePlanForeignModify(PlannerInfo *root,
-                       ModifyTable *plan,
-                       Index resultRelation,
-                       int subplan_index)
-{
-    struct fdw_options  options;
-	RangeTblEntry      *rte = planner_rt_fetch(resultRelation, root);
+    switch (get_opcode(op->opno))
+    {
+        case F_TEXTLIKE:
+            *kind = KEY_LIKE;
+            break;
+        case F_TEXTICLIKE:
+            *kind = KEY_ILIKE;
+            break;
+        case F_TEXTREGEXEQ:
+            *kind = KEY_REGEX;
+            break;
+        default:
+            return false;
+    }
 
-    extract_table_options(rte->relid, &options);
-    return fdw_options_to_list(&options);
+    var = (Var *) strip_relabel(linitial(op->args));
+    *value = (Expr *) lsecond(op->args);
+
+    /* ILIKE lowers strings according to the collation */
+    return op->inputcollid == var->varcollid && is_key_value(root, baserel, *value);
 }
 
-static void
-tupleBeginForeignModify(ModifyTableState *mtstate,
-                        ResultRelInfo *resultRelInfo,
-                        List *fdw_private,
-                        int subplan_index,
-                        int eflags)
+/*
+ * Columns with block statistics, Bloom filters or the block index. Keys on
+ * the leading sorted column and on indexed columns (the only ones if
+ * `range_only` is set) narrow down the blocks to read, keys on the others are
+ * checked against the statistics and filters to skip blocks.
+ */
+static List *
+key_columns(struct fdw_options *options, bool range_only)
 {
-    Relation        rel = resultRelInfo->ri_RelationDesc;
-    StorageState   *state = palloc0(sizeof(StorageState));
-    char           *filename = strVal(linitial(fdw_private));
+    List   *columns = NIL;
 
-    /*
-     * Prevent relation from being modified concurrently or being modified and
-     * read at the same time. The storage itself doesn't have any internal
-     * mechanisms to resolve concurrent access.
-     */
-    LockRelation(rel, AccessExclusiveLock);
+    if (options->attrs_sorted != NIL)
+        columns = list_make1_int(linitial_int(options->attrs_sorted));
+    columns = list_concat_unique_int(columns, options->attrs_index);
 
-    StorageInit(state, filename, false, false);
-    state->lz4_acceleration = intVal(lthird(fdw_private));
+    if (range_only)
+        return columns;
 
-	resultRelInfo->ri_FdwState = state;
+    columns = list_concat_unique_int(columns, options->attrs_sorted);
+    columns = list_concat_unique_int(columns, options->attrs_minmax);
+    return list_concat_unique_int(columns, options->attrs_bloom);
 }
 
-static TupleTableSlot *
-tupleExecForeignInsert(EState *estate,
-                       ResultRelInfo *resultRelInfo,
-                       TupleTableSlot *slot,
-                       TupleTableSlot *planSlot)
+static bool
+match_key_columns(PlannerInfo *root, RelOptInfo *baserel, Expr *clause,
+                  List *columns, AttrNumber *attnum, Oid *opno, Expr **value,
+                  bool *is_array)
 {
-	StorageState  *state = (StorageState *) resultRelInfo->ri_FdwState;
-	TupleTableSlot *rslot = slot;
-    HeapTuple       tuple;
+    ListCell   *lc;
 
-#if PG_VERSION_NUM < 120000
-	tuple = ExecCopySlotTuple(slot);
-#else
-	tuple = ExecCopySlotHeapTuple(slot);
-#endif
+    foreach (lc, columns)
+    {
+        *attnum = lfirst_int(lc);
+        if (match_key_clause(root, baserel, clause, *attnum, opno, value, is_array))
+            return true;
+    }
 
-    StorageInsertTuple(state, tuple);
+    return false;
+}
+
+/* Select clauses which could be used as scan keys */
+static List *
+select_key_clauses(PlannerInfo *root,
+                   RelOptInfo *baserel,
+                   struct fdw_options *options,
+                   List *clauses,
+                   bool range_only)
+{
+    List       *result = NIL;
+    List       *columns = key_columns(options, range_only);
+    ListCell   *lc;
+
+    foreach (lc, clauses)
+    {
+        RestrictInfo   *rinfo = lfirst_node(RestrictInfo, lc);
+        AttrNumber      attnum;
+        Oid             opno;
+        Expr           *value;
+        bool            is_array;
+
+        if (match_key_columns(root, baserel, rinfo->clause, columns,
+                              &attnum, &opno, &value, &is_array))
+            result = lappend(result, rinfo);
+    }
+
+    return result;
+}
+
+static void
+extract_key_clauses(PlannerInfo *root,
+                    RelOptInfo *baserel,
+                    List *scan_clauses,
+                    struct fdw_options *options,
+                    List **key_attnums,
+                    List **key_ops,
+                    List **key_arrays,
+                    List **key_kinds,
+                    List **key_exprs)
+{
+    List       *columns = key_columns(options, false);
+    ListCell   *lc;
+
+    foreach (lc, scan_clauses)
+    {
+        RestrictInfo   *rinfo = lfirst_node(RestrictInfo, lc);
+        AttrNumber      attnum;
+        Oid             opno;
+        Expr           *value;
+        bool            is_array;
+        ListCell       *lc2;
+
+        if (match_key_columns(root, baserel, rinfo->clause, columns,
+                              &attnum, &opno, &value, &is_array))
+        {
+            *key_attnums = lappend_int(*key_attnums, attnum);
+            *key_ops = lappend_oid(*key_ops, opno);
+            *key_arrays = lappend_int(*key_arrays, is_array);
+            *key_kinds = lappend_int(*key_kinds, KEY_BTREE);
+            *key_exprs = lappend(*key_exprs, value);
+            continue;
+        }
+
+        foreach (lc2, options->attrs_ngram)
+        {
+            StorageKeyKind  kind;
+
+            attnum = lfirst_int(lc2);
+            if (match_pattern_clause(root, baserel, rinfo->clause, attnum,
+                                     &kind, &value))
+            {
+                *key_attnums = lappend_int(*key_attnums, attnum);
+                *key_ops = lappend_oid(*key_ops, ((OpExpr *) rinfo->clause)->opno);
+                *key_arrays = lappend_int(*key_arrays, false);
+                *key_kinds = lappend_int(*key_kinds, kind);
+                *key_exprs = lappend(*key_exprs, value);
+                break;
+            }
+        }
+    }
+}
+
+/* Extract array elements; NULLs are left out as they never match */
+static void
+deconstruct_array_key(StorageScanKey *key)
+{
+    ArrayType  *array = DatumGetArrayTypeP(key->value);
+    int16       elmlen;
+    bool        elmbyval;
+    char        elmalign;
+    bool       *nulls;
+    int         nelems;
+    int         i;
+
+    get_typlenbyvalalign(ARR_ELEMTYPE(array), &elmlen, &elmbyval, &elmalign);
+    deconstruct_array(array, ARR_ELEMTYPE(array), elmlen, elmbyval, elmalign,
+                      &key->elems, &nulls, &nelems);
+
+    key->nelems = 0;
+    for (i = 0; i < nelems; i++)
+        if (!nulls[i])
+            key->elems[key->nelems++] = key->elems[i];
+}
+
+/*
+ * Key clauses on columns with statistics whose values are known at plan time
+ * (or can be estimated, like `now()`). The planner checks the ranges kept in
+ * the file headers against them.
+ */
+static int
+plan_time_keys(PlannerInfo *root, RelOptInfo *baserel,
+               struct fdw_options *options, StorageScanKey **keys)
+{
+    List       *columns;
+    ListCell   *lc;
+    int         nkeys = 0;
+
+    columns = list_concat_unique_int(list_copy(options->attrs_sorted),
+                                     options->attrs_minmax);
+    *keys = palloc0(sizeof(StorageScanKey) * list_length(baserel->baserestrictinfo));
+
+    foreach (lc, baserel->baserestrictinfo)
+    {
+        RestrictInfo   *rinfo = lfirst_node(RestrictInfo, lc);
+        StorageScanKey *key = &(*keys)[nkeys];
+        AttrNumber      attnum;
+        Oid             opno;
+        Expr           *value;
+        bool            is_array;
+        Const          *con;
+
+        if (!match_key_columns(root, baserel, rinfo->clause, columns,
+                               &attnum, &opno, &value, &is_array))
+            continue;
+
+        con = (Const *) estimate_expression_value(root, (Node *) value);
+        if (!IsA(con, Const))
+            continue;
+
+        key->kind = KEY_BTREE;
+        key->attnum = attnum;
+        key->opno = opno;
+        key->is_array = is_array;
+        key->value = con->constvalue;
+        key->isnull = con->constisnull;
+        if (key->is_array && !key->isnull)
+            deconstruct_array_key(key);
+        nkeys++;
+    }
+
+    return nkeys;
+}
+
+/*
+ * Estimate the cost of a scan. Every block visited is read and decompressed
+ * as a whole (we charge one operator per page of uncompressed data for the
+ * latter), tuples are then checked against the quals. Key clauses on the
+ * sorted column limit the scan to the blocks and tuples within the key range,
+ * which is found by binary search over the block directory; key clauses on
+ * indexed columns limit it to the blocks found in the index. An array key
+ * takes a search per element.
+ */
+static void
+estimate_costs(PlannerInfo *root,
+               RelOptInfo *baserel,
+               List *key_clauses,
+               ParamPathInfo *param_info,
+               Cost *startup_cost,
+               Cost *total_cost)
+{
+    struct fdw_options *options = (struct fdw_options *) baserel->fdw_private;
+    double      nblocks = options->nblocks;
+    double      ntuples = baserel->tuples;
+    double      block_pages;
+    QualCost    qual_cost = baserel->baserestrictcost;
+    Cost        run_cost;
+
+    /* average compressed size of a block */
+    block_pages = nblocks > 0 ? options->file_size / nblocks / BLCKSZ : 0;
+
+    /* join clauses moved into the scan are checked by it as well */
+    if (param_info)
+    {
+        QualCost    join_cost;
+
+        cost_qual_eval(&join_cost, param_info->ppi_clauses, root);
+        qual_cost.startup += join_cost.startup;
+        qual_cost.per_tuple += join_cost.per_tuple;
+    }
+
+    *startup_cost = qual_cost.startup;
+    run_cost = 0;
+
+    if (key_clauses != NIL && nblocks > 0)
+    {
+        Selectivity sel;
+        double      nprobes = 1;
+        ListCell   *lc;
+
+        sel = clauselist_selectivity(root, key_clauses, baserel->relid,
+                                     JOIN_INNER, NULL);
+
+        foreach (lc, key_clauses)
+        {
+            Expr   *clause = lfirst_node(RestrictInfo, lc)->clause;
+
+            if (IsA(clause, ScalarArrayOpExpr))
+            {
+                Node   *array = lsecond(((ScalarArrayOpExpr *) clause)->args);
+
+                nprobes = Max(nprobes, estimate_array_length(array));
+            }
+        }
+
+        *startup_cost += nprobes * ceil(log2(nblocks + 1)) * cpu_operator_cost;
+        nprobes = Min(nprobes, nblocks);
+        nblocks = Max(nprobes, Min(nblocks, ceil(nblocks * sel)));
+        ntuples = clamp_row_est(ntuples * sel);
+
+        /* the first block of each range is located at random */
+        run_cost += nprobes * (random_page_cost - seq_page_cost) * block_pages;
+    }
+
+    run_cost += nblocks * (seq_page_cost * block_pages
+                           + cpu_operator_cost * (BLOCK_SIZE / BLCKSZ));
+    run_cost += ntuples * (cpu_tuple_cost + qual_cost.per_tuple);
+
+    *total_cost = *startup_cost + run_cost;
+}
+
+/* Equivalence class member callback: is it the given column of the rel? */
+static bool
+ec_member_matches_key(PlannerInfo *root,
+                      RelOptInfo *rel,
+                      EquivalenceClass *ec,
+                      EquivalenceMember *em,
+                      void *arg)
+{
+    return is_column_var((Node *) em->em_expr, rel, *(AttrNumber *) arg);
+}
+
+/*
+ * Find join clauses on the leading sorted column or on indexed columns and
+ * return the distinct parameterizations under which they could be used as
+ * scan keys. Each outer row then only costs a binary search over the block
+ * directory (or an index lookup) and reading the blocks found.
+ */
+static List *
+collect_param_infos(PlannerInfo *root,
+                    RelOptInfo *baserel,
+                    struct fdw_options *options)
+{
+    List       *ppi_list = NIL;
+    List       *join_clauses = NIL;
+    ListCell   *lc;
+    ListCell   *lc2;
+
+    foreach (lc, baserel->joininfo)
+    {
+        RestrictInfo   *rinfo = lfirst_node(RestrictInfo, lc);
+
+        if (join_clause_is_movable_to(rinfo, baserel))
+            join_clauses = lappend(join_clauses, rinfo);
+    }
+
+    foreach (lc2, key_columns(options, true))
+    {
+        AttrNumber  attnum = lfirst_int(lc2);
+        List       *clauses = list_copy(join_clauses);
+
+        /* equality join clauses are kept in equivalence classes */
+        if (baserel->has_eclass_joins)
+            clauses = list_concat(clauses,
+                                  generate_implied_equalities_for_column(root,
+                                                                         baserel,
+                                                                         ec_member_matches_key,
+                                                                         (void *) &attnum,
+                                                                         baserel->lateral_referencers));
+
+        foreach (lc, clauses)
+        {
+            RestrictInfo   *rinfo = lfirst_node(RestrictInfo, lc);
+            Relids          required_outer;
+            Oid             opno;
+            Expr           *value;
+            bool            is_array;
+
+            if (!match_key_clause(root, baserel, rinfo->clause, attnum,
+                                  &opno, &value, &is_array))
+                continue;
+
+            required_outer = bms_union(rinfo->clause_relids, baserel->lateral_relids);
+            required_outer = bms_del_member(required_outer, baserel->relid);
+            if (bms_is_empty(required_outer))
+                continue;
+
+            ppi_list = list_append_unique_ptr(ppi_list,
+                                              get_baserel_parampathinfo(root, baserel,
+                                                                        required_outer));
+        }
+    }
+
+    return ppi_list;
+}
+
+/* Share of the work done by each participant, as the core planner counts it */
+static double
+parallel_divisor(int nworkers)
+{
+    double      divisor = nworkers;
+
+#if PG_VERSION_NUM >= 110000
+    if (parallel_leader_participation)
+#endif
+    {
+        double      leader_contribution = 1.0 - (0.3 * nworkers);
+
+        if (leader_contribution > 0)
+            divisor += leader_contribution;
+    }
+
+    return divisor;
+}
+
+/*
+ * Tables stored in several files can be scanned by parallel workers, each of
+ * them claiming whole files. There's no point in having more workers than
+ * files. The cost of the scan is split among the participants.
+ */
+static void
+add_partial_scan_path(PlannerInfo *root,
+                      RelOptInfo *baserel,
+                      struct fdw_options *options,
+                      Cost startup_cost,
+                      Cost total_cost)
+{
+    ForeignPath *path;
+    int         nworkers;
+    double      divisor;
+
+#if PG_VERSION_NUM >= 110000
+    nworkers = compute_parallel_worker(baserel, baserel->pages, -1,
+                                       max_parallel_workers_per_gather);
+#else
+    nworkers = compute_parallel_worker(baserel, baserel->pages, -1);
+#endif
+    nworkers = Min(nworkers, options->nfiles);
+    if (nworkers <= 0)
+        return;
+
+    divisor = parallel_divisor(nworkers);
+    path = create_foreignscan_path(root, baserel,
+                                   NULL,	/* default pathtarget */
+                                   clamp_row_est(baserel->rows / divisor),
+                                   startup_cost,
+                                   startup_cost + (total_cost - startup_cost) / divisor,
+                                   NIL,	/* files are read in any order */
+                                   NULL,	/* no outer rel either */
+                                   NULL,	/* no extra plan */
+                                   list_make1(makeInteger(false)));
+    path->path.parallel_aware = true;
+    path->path.parallel_workers = nworkers;
+
+    add_partial_path(baserel, (Path *) path);
+}
+
+static void
+tupleGetForeignPaths(PlannerInfo *root,
+					RelOptInfo *baserel,
+					Oid foreigntableid)
+{
+    struct fdw_options *options = (struct fdw_options *) baserel->fdw_private;
+    Cost        startup_cost;
+    Cost        total_cost;
+    List       *key_clauses;
+    List       *pathkeys;
+    List       *reverse_pathkeys;
+    List       *ppi_list;
+    ListCell   *lc;
+
+    key_clauses = select_key_clauses(root, baserel, options,
+                                     baserel->baserestrictinfo, true);
+    estimate_costs(root, baserel, key_clauses, NULL,
+                   &startup_cost, &total_cost);
+
+    pathkeys = build_sorted_pathkeys(root, baserel, options, false);
+
+	add_path(baserel, (Path *)
+			 create_foreignscan_path(root, baserel,
+                                     NULL,	/* default pathtarget */
+                                     baserel->rows,
+                                     startup_cost,
+                                     total_cost,
+                                     pathkeys,
+                                     baserel->lateral_relids,
+                                     NULL,	/* no extra plan */
+                                     list_make1(makeInteger(false))));
+
+    if (baserel->consider_parallel && baserel->lateral_relids == NULL
+        && options->nfiles > 1)
+        add_partial_scan_path(root, baserel, options, startup_cost, total_cost);
+
+    /* reading the storage backwards gives the reverse order */
+    reverse_pathkeys = build_sorted_pathkeys(root, baserel, options, true);
+    if (reverse_pathkeys != NIL)
+        add_path(baserel, (Path *)
+                 create_foreignscan_path(root, baserel,
+                                         NULL,	/* default pathtarget */
+                                         baserel->rows,
+                                         startup_cost,
+                                         total_cost,
+                                         reverse_pathkeys,
+                                         baserel->lateral_relids,
+                                         NULL,	/* no extra plan */
+                                         list_make1(makeInteger(true))));
+
+    /* lookups on the sorted or indexed keys for each row of the outer relation */
+    ppi_list = collect_param_infos(root, baserel, options);
+    foreach (lc, ppi_list)
+    {
+        ParamPathInfo  *param_info = (ParamPathInfo *) lfirst(lc);
+        List           *clauses;
+
+        clauses = list_concat(list_copy(baserel->baserestrictinfo),
+                              list_copy(param_info->ppi_clauses));
+        key_clauses = select_key_clauses(root, baserel, options, clauses, true);
+        estimate_costs(root, baserel, key_clauses, param_info,
+                       &startup_cost, &total_cost);
+
+        add_path(baserel, (Path *)
+                 create_foreignscan_path(root, baserel,
+                                         NULL,	/* default pathtarget */
+                                         param_info->ppi_rows,
+                                         startup_cost,
+                                         total_cost,
+                                         pathkeys,
+                                         param_info->ppi_req_outer,
+                                         NULL,	/* no extra plan */
+                                         list_make1(makeInteger(false))));
+    }
+}
+
+static ForeignScan *
+tupleGetForeignPlan(PlannerInfo *root,
+                      RelOptInfo *baserel,
+                      Oid foreigntableid,
+                      ForeignPath *best_path,
+                      List *tlist,
+                      List *scan_clauses,
+                      Plan *outer_plan)
+{
+    struct fdw_options *options = (struct fdw_options *) baserel->fdw_private;
+    List               *fdw_private = NIL;
+    List               *key_attnums = NIL;
+    List               *key_ops = NIL;
+    List               *key_arrays = NIL;
+    List               *key_kinds = NIL;
+    List               *key_exprs = NIL;
+    ScanOrder           order;
+
+    if (best_path->path.pathkeys == NIL)
+        order = SCAN_UNORDERED;
+    else if (intVal(linitial(best_path->fdw_private)))
+        order = SCAN_BACKWARD;
+    else
+        order = SCAN_FORWARD;
+
+    /*
+     * For parameterized paths scan clauses include the join clauses; the
+     * outer relation's Vars are replaced with Params by the caller.
+     */
+    extract_key_clauses(root, baserel, scan_clauses, options,
+                        &key_attnums, &key_ops, &key_arrays, &key_kinds,
+                        &key_exprs);
+
+    fdw_private = fdw_options_to_list(options);
+    fdw_private = lappend(fdw_private, makeInteger(order));
+    fdw_private = lappend(fdw_private, key_attnums);
+    fdw_private = lappend(fdw_private, key_ops);
+    fdw_private = lappend(fdw_private, key_arrays);
+    fdw_private = lappend(fdw_private, key_kinds);
+
+    /*
+     * Key clauses only help to skip data; all the clauses are still checked
+     * by the executor.
+     */
+    scan_clauses = extract_actual_clauses(scan_clauses, false);
+
+	/* Create the ForeignScan node */
+	return make_foreignscan(tlist,
+                            scan_clauses,
+                            baserel->relid,
+                            key_exprs,
+                            fdw_private,
+                            NIL,	/* no custom tlist */
+                            NIL,	/* no remote quals */
+                            outer_plan);
+}
+
+/* Don't leave the prefetching thread running if the scan fails */
+static void
+stop_prefetch_callback(void *arg)
+{
+    StorageState *state = (StorageState *) arg;
+
+    StorageStopPrefetch(state);
+}
+
+static void
+unmap_file_callback(void *arg)
+{
+    StorageState *state = (StorageState *) arg;
+
+    unmap_file(state);
+}
+
+/* Don't leave the compression thread running if the insert fails */
+static void
+stop_compression_callback(void *arg)
+{
+    StorageState *state = (StorageState *) arg;
+
+    StorageStopCompression(state);
+}
+
+/*
+ * Set up scan keys; they are passed over to the storage once it's open. Key
+ * values are filled in by `eval_scan_keys` when the scan starts.
+ */
+static void
+init_scan_keys(ForeignScanState *node, TupleScanState *fsstate)
+{
+    ForeignScan    *plan = (ForeignScan *) node->ss.ps.plan;
+    EState         *estate = node->ss.ps.state;
+    List           *key_attnums;
+    List           *key_ops;
+    List           *key_arrays;
+    List           *key_kinds;
+    ListCell       *lc1,
+                   *lc2,
+                   *lc3;
+    int             i = 0;
+
+    fsstate->nkeys = list_length(plan->fdw_exprs);
+    if (fsstate->nkeys == 0)
+        return;
+
+    key_attnums = (List *) list_nth(plan->fdw_private, FdwPrivateKeyAttnums);
+    key_ops = (List *) list_nth(plan->fdw_private, FdwPrivateKeyOperators);
+    key_arrays = (List *) list_nth(plan->fdw_private, FdwPrivateKeyArrays);
+    key_kinds = (List *) list_nth(plan->fdw_private, FdwPrivateKeyKinds);
+    fsstate->keys = palloc0(sizeof(StorageScanKey) * fsstate->nkeys);
+
+    forthree (lc1, key_attnums, lc2, key_ops, lc3, plan->fdw_exprs)
+    {
+        StorageScanKey *key = &fsstate->keys[i];
+        Expr       *expr = (Expr *) lfirst(lc3);
+
+        key->attnum = lfirst_int(lc1);
+        key->opno = lfirst_oid(lc2);
+        key->kind = list_nth_int(key_kinds, i);
+        key->is_array = list_nth_int(key_arrays, i++);
+        fsstate->key_exprs = lappend(fsstate->key_exprs,
+                                     ExecInitExpr(expr, (PlanState *) node));
+    }
+
+    fsstate->keys_cxt = AllocSetContextCreate(estate->es_query_cxt,
+                                              "tuple_fdw scan keys",
+                                              ALLOCSET_SMALL_SIZES);
+
+    /* storage states set up the keys their own way, see `file_may_match` */
+    fsstate->file_keys = palloc(sizeof(StorageScanKey) * fsstate->nkeys);
+    memcpy(fsstate->file_keys, fsstate->keys, sizeof(StorageScanKey) * fsstate->nkeys);
+    StoragePrepareKeys(RelationGetDescr(node->ss.ss_currentRelation),
+                       fsstate->file_keys, fsstate->nkeys);
+}
+
+/*
+ * Evaluate key values. Done every time the scan (re)starts as they may
+ * depend on the current row of the outer relation.
+ */
+static void
+eval_scan_keys(ForeignScanState *node, TupleScanState *fsstate)
+{
+    ExprContext    *econtext = node->ss.ps.ps_ExprContext;
+    ListCell       *lc;
+    int             i = 0;
+
+    MemoryContextReset(fsstate->keys_cxt);
+
+    foreach (lc, fsstate->key_exprs)
+    {
+        StorageScanKey *key = &fsstate->keys[i++];
+        ExprState  *exprstate = (ExprState *) lfirst(lc);
+        Datum       value;
+        int16       typlen;
+        bool        typbyval;
+
+        value = ExecEvalExpr(exprstate, econtext, &key->isnull);
+
+        /* the value must survive expression context resets */
+        if (!key->isnull)
+        {
+            MemoryContext oldcxt;
+
+            get_typlenbyval(exprType((Node *) exprstate->expr), &typlen, &typbyval);
+            oldcxt = MemoryContextSwitchTo(fsstate->keys_cxt);
+            key->value = datumCopy(value, typbyval, typlen);
+
+            if (key->is_array)
+                deconstruct_array_key(key);
+            MemoryContextSwitchTo(oldcxt);
+        }
+    }
+
+    /* the storage sorts array elements in place, so they get a copy */
+    for (i = 0; i < fsstate->nkeys; i++)
+    {
+        StorageScanKey *key = &fsstate->keys[i];
+        StorageScanKey *file_key = &fsstate->file_keys[i];
+
+        file_key->value = key->value;
+        file_key->isnull = key->isnull;
+        file_key->nelems = key->nelems;
+        file_key->elems = NULL;
+        if (!key->isnull && key->is_array && key->nelems > 0)
+        {
+            file_key->elems = MemoryContextAlloc(fsstate->keys_cxt,
+                                                 sizeof(Datum) * key->nelems);
+            memcpy(file_key->elems, key->elems, sizeof(Datum) * key->nelems);
+        }
+    }
+}
+
+/*
+ * Check the ranges of the file (see `metacache.c`) against the key values
+ * before opening it, so that files out of the range aren't even opened. A
+ * file whose header can't be read is left for the storage to complain about.
+ */
+static bool
+file_may_match(ForeignScanState *node, TupleScanState *fsstate,
+               const char *filename)
+{
+    FileMeta    meta;
+
+    if (!metacache_lookup(RelationGetRelid(node->ss.ss_currentRelation),
+                          filename, &meta))
+        return true;
+
+    return StorageStatsMayMatch(meta.stats, meta.stats_size,
+                                fsstate->file_keys, fsstate->nkeys);
+}
+
+/*
+ * Open the storage file for the scan. The state and everything else the
+ * storage allocates goes to the current memory context. Returns NULL if the
+ * manifest entry of the segment (`info`) says it has no rows in the key range.
+ */
+static StorageState *
+open_scan_storage(ForeignScanState *node, TupleScanState *fsstate,
+                  const char *filename, SegmentInfo *info)
+{
+    StorageState   *state;
+    ForeignScan    *plan = (ForeignScan *) node->ss.ps.plan;
+    List           *fdw_private = plan->fdw_private;
+    Relation        rel = node->ss.ss_currentRelation;
+    bool            use_mmap;
+    List           *attrs_sorted;
+    List           *attrs_minmax;
+    List           *attrs_bloom;
+    List           *attrs_ngram;
+    List           *attrs_index;
+
+    use_mmap = intVal(list_nth(fdw_private, FdwPrivateUseMmap));
+    attrs_sorted = (List *) list_nth(fdw_private, FdwPrivateAttrsSorted);
+    attrs_minmax = (List *) list_nth(fdw_private, FdwPrivateAttrsMinmax);
+    attrs_bloom = (List *) list_nth(fdw_private, FdwPrivateAttrsBloom);
+    attrs_ngram = (List *) list_nth(fdw_private, FdwPrivateAttrsNgram);
+    attrs_index = (List *) list_nth(fdw_private, FdwPrivateAttrsIndex);
+
+    /* open file */
+    state = palloc0(sizeof(StorageState));
+
+    /*
+     * Unmap files automatically by using memory context callback. It's set up
+     * first so that a pooled mapping is given back even if opening fails.
+     */
+    if (use_mmap)
+    {
+        MemoryContextCallback *callback;
+
+        callback = palloc0(sizeof(MemoryContextCallback));
+        callback->func = unmap_file_callback;
+        callback->arg = (void *) state;
+        MemoryContextRegisterResetCallback(CurrentMemoryContext, callback);
+    }
+
+    StorageInit(state, filename, true, use_mmap);
+
+    StorageSetColumns(state, RelationGetDescr(rel), attrs_sorted, attrs_minmax);
+    StorageSetBloomColumns(state, attrs_bloom, attrs_ngram);
+    StorageSetIndexColumns(state, attrs_index);
+    if (fsstate->nkeys > 0)
+        StorageSetScanKeys(state, fsstate->keys, fsstate->nkeys);
+
+    /* the entry only counts if it describes all the rows there are */
+    if (info != NULL && !StorageSegmentMayMatch(state, info)
+        && StorageCountTuples(filename) == info->ntuples)
+    {
+        StorageRelease(state);
+        return NULL;
+    }
+
+    /*
+     * Range scans read the tail when they start: with the key values known
+     * (parameters of prepared statements too) the file may turn out to have
+     * nothing for them.
+     */
+    if (!IsRangeScan(fsstate))
+        StorageOpenTail(state, false);
+
+    /*
+     * Scans that must follow the storage order can't start halfway. Range
+     * scans are started on the first fetch, once the key values are known.
+     */
+    if (fsstate->order == SCAN_UNORDERED && fsstate->nkeys == 0
+        && tuple_synchronize_seqscans)
+        StorageStartSyncScan(state);
+
+    if (fsstate->prefetch)
+    {
+        MemoryContextCallback *callback;
+
+        callback = palloc0(sizeof(MemoryContextCallback));
+        callback->func = stop_prefetch_callback;
+        callback->arg = (void *) state;
+        MemoryContextRegisterResetCallback(CurrentMemoryContext, callback);
+
+        StorageStartPrefetch(state);
+    }
+
+    return state;
+}
+
+/* Release the current segment along with everything allocated for it */
+static void
+close_segment(TupleScanState *fsstate)
+{
+    if (fsstate->storage == NULL)
+        return;
+
+    StorageRelease(fsstate->storage);
+    fsstate->storage = NULL;
+    MemoryContextDelete(fsstate->segment_cxt);
+    fsstate->segment_cxt = NULL;
+}
+
+/*
+ * Move on to the next segment which may have rows in the key range; returns
+ * false when there are no more.
+ */
+static bool
+open_next_segment(ForeignScanState *node, TupleScanState *fsstate)
+{
+    EState         *estate = node->ss.ps.state;
+
+    close_segment(fsstate);
+    for (;;)
+    {
+        MemoryContext   oldcxt;
+        int             fileno;
+        char           *filename;
+        SegmentInfo    *info;
+
+        /* participants of a parallel scan take whichever file is next */
+        if (fsstate->pscan)
+            fileno = (int) pg_atomic_fetch_add_u32(&fsstate->pscan->next_file, 1);
+        else
+            fileno = fsstate->next_segment++;
+        if (fileno >= list_length(fsstate->segments))
+            return false;
+
+        filename = (char *) list_nth(fsstate->segments, fileno);
+        if (fsstate->nkeys > 0 && !file_may_match(node, fsstate, filename))
+            continue;
+        info = manifest_find(fsstate->manifest, filename);
+
+        fsstate->segment_cxt = AllocSetContextCreate(estate->es_query_cxt,
+                                                     "tuple_fdw segment",
+                                                     ALLOCSET_DEFAULT_SIZES);
+        oldcxt = MemoryContextSwitchTo(fsstate->segment_cxt);
+        fsstate->storage = open_scan_storage(node, fsstate, filename, info);
+        MemoryContextSwitchTo(oldcxt);
+
+        if (fsstate->storage == NULL)
+        {
+            MemoryContextDelete(fsstate->segment_cxt);
+            fsstate->segment_cxt = NULL;
+            continue;
+        }
+
+        if (IsRangeScan(fsstate))
+            StorageStartRangeScan(fsstate->storage, false);
+        return true;
+    }
+}
+
+static void
+tupleBeginForeignScan(ForeignScanState *node, int eflags)
+{
+    TupleScanState *fsstate;
+    ForeignScan    *plan = (ForeignScan *) node->ss.ps.plan;
+    List           *fdw_private = plan->fdw_private;
+    char           *directory;
+    char           *filenames;
+
+    fsstate = palloc0(sizeof(TupleScanState));
+    fsstate->order = intVal(list_nth(fdw_private, FdwPrivateScanOrder));
+    init_scan_keys(node, fsstate);
+
+#if PG_VERSION_NUM >= 140000
+    /*
+     * Under an async Append plain sequential scans read their blocks ahead,
+     * starting right away, so that all the partitions are read at once.
+     */
+    fsstate->prefetch = node->ss.ps.async_capable
+        && !(eflags & EXEC_FLAG_EXPLAIN_ONLY)
+        && fsstate->order == SCAN_UNORDERED && fsstate->nkeys == 0;
+#endif
+
+    /*
+     * Segments are opened one at a time as the scan goes. The set of them is
+     * taken now: segments started by writers later on are left out like the
+     * rows appended to the segments after they are opened. The same goes for
+     * the files matching the `filenames` patterns.
+     */
+    directory = strVal(list_nth(fdw_private, FdwPrivateDirectory));
+    filenames = strVal(list_nth(fdw_private, FdwPrivateFilenames));
+    if (*directory != '\0')
+    {
+        fsstate->segmented = true;
+        fsstate->segments = segment_list(directory);
+
+        /* key ranges of the segments let us skip some of them */
+        if (fsstate->nkeys > 0)
+            fsstate->manifest = manifest_read(directory);
+    }
+    else if (*filenames != '\0')
+    {
+        fsstate->segmented = true;
+        fsstate->segments = expand_filenames(filenames);
+    }
+    else
+        fsstate->storage = open_scan_storage(node, fsstate,
+                                             strVal(list_nth(fdw_private, FdwPrivateFilename)),
+                                             NULL);
+
+    node->fdw_state = fsstate;
+}
+
+static TupleTableSlot *
+tupleIterateForeignScan(ForeignScanState *node)
+{
+    TupleScanState *fsstate = (TupleScanState *) node->fdw_state;
+    TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+    HeapTuple tuple;
+
+	ExecClearTuple(slot);
+
+    if (!fsstate->started)
+    {
+        if (IsRangeScan(fsstate))
+            eval_scan_keys(node, fsstate);
+
+        if (fsstate->segmented)
+        {
+            fsstate->next_segment = 0;
+            open_next_segment(node, fsstate);
+        }
+        else if (IsRangeScan(fsstate))
+            StorageStartRangeScan(fsstate->storage,
+                                  fsstate->order == SCAN_BACKWARD);
+        fsstate->started = true;
+    }
+
+    for (;;)
+    {
+        if (fsstate->storage
+            && (tuple = StorageReadTuple(fsstate->storage)) != NULL)
+            break;
+
+        if (!fsstate->segmented || !open_next_segment(node, fsstate))
+            return slot;
+    }
+
+#if PG_VERSION_NUM < 120000
+    ExecStoreTuple(tuple, slot, InvalidBuffer, false);
+#else
+    ExecStoreHeapTuple(tuple, slot, false);
+#endif
+
+    return slot;
+}
+
+static void
+tupleReScanForeignScan(ForeignScanState *node)
+{
+    TupleScanState *fsstate = (TupleScanState *) node->fdw_state;
+
+    /*
+     * Range scans re-evaluate the keys as parameters might have changed.
+     * Segmented scans start over from the first segment.
+     */
+    if (IsRangeScan(fsstate) || fsstate->segmented)
+        fsstate->started = false;
+    else
+        StorageRescan(fsstate->storage);
+}
+
+static void
+tupleEndForeignScan(ForeignScanState *node)
+{
+	TupleScanState *fsstate = (TupleScanState *) node->fdw_state;
+
+    if (fsstate->segmented)
+        close_segment(fsstate);
+    else
+        StorageRelease(fsstate->storage);
+}
+
+/*
+ * Nothing keeps workers from reading the storage. Only scans of tables stored
+ * in several files are parallel aware though (see `add_partial_scan_path`).
+ */
+static bool
+tupleIsForeignScanParallelSafe(PlannerInfo *root,
+                               RelOptInfo *rel,
+                               RangeTblEntry *rte)
+{
+    return true;
+}
+
+static Size
+tupleEstimateDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt)
+{
+    TupleScanState *fsstate = (TupleScanState *) node->fdw_state;
+    Size            size = offsetof(TupleParallelScan, filenames);
+    ListCell       *lc;
+
+    foreach (lc, fsstate->segments)
+        size = add_size(size, strlen((char *) lfirst(lc)) + 1);
+
+    return size;
+}
+
+/* Pass the list of files taken by the leader over to the workers */
+static void
+tupleInitializeDSMForeignScan(ForeignScanState *node,
+                              ParallelContext *pcxt,
+                              void *coordinate)
+{
+    TupleScanState     *fsstate = (TupleScanState *) node->fdw_state;
+    TupleParallelScan  *pscan = (TupleParallelScan *) coordinate;
+    char               *ptr = pscan->filenames;
+    ListCell           *lc;
+
+    pg_atomic_init_u32(&pscan->next_file, 0);
+    pscan->nfiles = list_length(fsstate->segments);
+    foreach (lc, fsstate->segments)
+    {
+        strcpy(ptr, (char *) lfirst(lc));
+        ptr += strlen(ptr) + 1;
+    }
+
+    fsstate->pscan = pscan;
+}
+
+static void
+tupleReInitializeDSMForeignScan(ForeignScanState *node,
+                                ParallelContext *pcxt,
+                                void *coordinate)
+{
+    TupleParallelScan  *pscan = (TupleParallelScan *) coordinate;
+
+    pg_atomic_write_u32(&pscan->next_file, 0);
+}
+
+static void
+tupleInitializeWorkerForeignScan(ForeignScanState *node,
+                                 shm_toc *toc,
+                                 void *coordinate)
+{
+    TupleScanState     *fsstate = (TupleScanState *) node->fdw_state;
+    TupleParallelScan  *pscan = (TupleParallelScan *) coordinate;
+    char               *ptr = pscan->filenames;
+    int                 i;
+
+    /* the files listed by the worker itself may differ */
+    fsstate->segments = NIL;
+    for (i = 0; i < pscan->nfiles; i++)
+    {
+        fsstate->segments = lappend(fsstate->segments, ptr);
+        ptr += strlen(ptr) + 1;
+    }
+
+    fsstate->pscan = pscan;
+}
+
+static List *
+tuplePlanForeignModify(PlannerInfo *root,
+                       ModifyTable *plan,
+                       Index resultRelation,
+                       int subplan_index)
+{
+    struct fdw_options  options;
+	RangeTblEntry      *rte = planner_rt_fetch(resultRelation, root);
+
+    extract_table_options(rte->relid, &options);
+    return fdw_options_to_list(&options);
+}
+
+/*
+ * Open the storage file for appending. The state and everything else the
+ * storage allocates goes to the current memory context.
+ */
+static StorageState *
+open_insert_storage(TupleModifyState *mstate, const char *filename, bool use_tail)
+{
+    StorageState   *state = palloc0(sizeof(StorageState));
+    List           *fdw_private = mstate->fdw_private;
+    List           *attrs_sorted;
+    List           *attrs_minmax;
+    List           *attrs_bloom;
+    List           *attrs_ngram;
+    List           *attrs_index;
+
+    attrs_sorted = (List *) list_nth(fdw_private, FdwPrivateAttrsSorted);
+    attrs_minmax = (List *) list_nth(fdw_private, FdwPrivateAttrsMinmax);
+    attrs_bloom = (List *) list_nth(fdw_private, FdwPrivateAttrsBloom);
+    attrs_ngram = (List *) list_nth(fdw_private, FdwPrivateAttrsNgram);
+    attrs_index = (List *) list_nth(fdw_private, FdwPrivateAttrsIndex);
+
+    StorageInit(state, filename, false, false);
+    StorageSetColumns(state, RelationGetDescr(mstate->rel), attrs_sorted, attrs_minmax);
+    StorageSetBloomColumns(state, attrs_bloom, attrs_ngram);
+    StorageSetIndexColumns(state, attrs_index);
+    state->lz4_acceleration = intVal(list_nth(fdw_private, FdwPrivateLz4Acceleration));
+    state->async_compression = intVal(list_nth(fdw_private, FdwPrivateAsyncCompression));
+    state->compression_workers = intVal(list_nth(fdw_private, FdwPrivateCompressionWorkers));
+    state->sync_mode = intVal(list_nth(fdw_private, FdwPrivateSyncMode));
+    StorageOpenTail(state, use_tail);
+
+    if (state->async_compression)
+    {
+        MemoryContextCallback *callback;
+
+        callback = palloc0(sizeof(MemoryContextCallback));
+        callback->func = stop_compression_callback;
+        callback->arg = (void *) state;
+        MemoryContextRegisterResetCallback(CurrentMemoryContext, callback);
+    }
+
+    return state;
+}
+
+/*
+ * Take a segment to append to. Unless the manifest knows the range of values
+ * in the segment, the writer can't tell it either (see `segments.c`).
+ */
+static void
+open_insert_segment(TupleModifyState *mstate)
+{
+    MemoryContext   oldcxt;
+    char           *filename;
+    uint64          ntuples;
+    SegmentInfo    *info;
+
+    mstate->segment_cxt = AllocSetContextCreate(mstate->cxt,
+                                                "tuple_fdw segment",
+                                                ALLOCSET_DEFAULT_SIZES);
+    oldcxt = MemoryContextSwitchTo(mstate->segment_cxt);
+
+    filename = segment_acquire(mstate->directory, mstate->segment_blocks,
+                               &mstate->segment_lock);
+    ntuples = StorageCountTuples(filename);
+    info = manifest_find(manifest_read(mstate->directory), filename);
+
+    mstate->storage = open_insert_storage(mstate, filename, true);
+    if (ntuples == 0)
+        StorageTrackRange(mstate->storage, NULL);
+    else if (info != NULL && info->ntuples == ntuples)
+        StorageTrackRange(mstate->storage, info);
+
+    MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Finish appending to the segment, record what's in it in the manifest and
+ * let other writers have it.
+ */
+static void
+close_insert_segment(TupleModifyState *mstate)
+{
+    StorageState   *state = mstate->storage;
+    MemoryContext   oldcxt;
+    SegmentInfo     info;
+    const char     *name;
+
+    oldcxt = MemoryContextSwitchTo(mstate->segment_cxt);
+
+    StorageRelease(state);
+
+    memset(&info, 0, sizeof(SegmentInfo));
+    name = strrchr(state->filename, '/');
+    strlcpy(info.name, name ? name + 1 : state->filename, sizeof(info.name));
+    info.ntuples = StorageCountTuples(state->filename);
+    StorageSerializeRange(state, &info);
+    manifest_update(mstate->directory, &info);
+
+    segment_unlock(mstate->segment_lock);
+    mstate->segment_lock = -1;
+
+    MemoryContextSwitchTo(oldcxt);
+    MemoryContextDelete(mstate->segment_cxt);
+    mstate->segment_cxt = NULL;
+    mstate->storage = NULL;
+}
+
+/* Move on to a new segment once the current one is full */
+static void
+check_segment_rollover(TupleModifyState *mstate)
+{
+    if (mstate->segment_blocks == 0
+        || mstate->storage->file_header.nblocks < (uint64) mstate->segment_blocks)
+        return;
+
+    close_insert_segment(mstate);
+    open_insert_segment(mstate);
+}
+
+/*
+ * Open the storage for appending. Shared by INSERT and by COPY or tuple
+ * routing, which don't go through the planner.
+ */
+static TupleModifyState *
+begin_insert(Relation rel, List *fdw_private)
+{
+    TupleModifyState *mstate = palloc0(sizeof(TupleModifyState));
+    char           *directory;
+    bool            use_tail;
+
+    mstate->rel = rel;
+    mstate->fdw_private = fdw_private;
+    mstate->cxt = CurrentMemoryContext;
+    mstate->segment_lock = -1;
+
+    directory = strVal(list_nth(fdw_private, FdwPrivateDirectory));
+    use_tail = intVal(list_nth(fdw_private, FdwPrivateUseTail));
+
+    /* there's no telling which of the files rows should go to */
+    if (*strVal(list_nth(fdw_private, FdwPrivateFilenames)) != '\0')
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg(ELOG_PREFIX "tables with the filenames option are read only")));
+
+    /*
+     * With segmented storage writers are kept away from each other by
+     * taking a segment each (see `segments.c`) and always use the tail, so
+     * the lock the executor holds already is enough.
+     */
+    if (*directory != '\0')
+    {
+        mstate->directory = directory;
+        mstate->segment_blocks = intVal(list_nth(fdw_private, FdwPrivateSegmentBlocks));
+        open_insert_segment(mstate);
+        return mstate;
+    }
+
+    /*
+     * Prevent relation from being modified concurrently. The storage itself
+     * doesn't have any internal mechanisms to resolve concurrent writes.
+     *
+     * Appending to the last block rewrites it in place, so scans can't run
+     * at the same time either. With the tail nothing that has been published
+     * by the file header (or the tail header) is ever rewritten: scans take
+     * the headers at start and see the rows written up to that point, so
+     * they only have to be kept away from other writers.
+     */
+    LockRelation(rel, use_tail ? ShareUpdateExclusiveLock : AccessExclusiveLock);
+
+    mstate->storage = open_insert_storage(mstate,
+                                          strVal(list_nth(fdw_private, FdwPrivateFilename)),
+                                          use_tail);
+    return mstate;
+}
+
+static void
+end_insert(TupleModifyState *mstate)
+{
+    if (mstate->directory)
+        close_insert_segment(mstate);
+    else
+        StorageRelease(mstate->storage);
+}
+
+static void
+tupleBeginForeignModify(ModifyTableState *mtstate,
+                        ResultRelInfo *resultRelInfo,
+                        List *fdw_private,
+                        int subplan_index,
+                        int eflags)
+{
+	resultRelInfo->ri_FdwState = begin_insert(resultRelInfo->ri_RelationDesc,
+                                              fdw_private);
+}
+
+static TupleTableSlot *
+tupleExecForeignInsert(EState *estate,
+                       ResultRelInfo *resultRelInfo,
+                       TupleTableSlot *slot,
+                       TupleTableSlot *planSlot)
+{
+	TupleModifyState *mstate = (TupleModifyState *) resultRelInfo->ri_FdwState;
+	TupleTableSlot *rslot = slot;
+
+    StorageInsertSlot(mstate->storage, slot);
+    if (mstate->directory)
+        check_segment_rollover(mstate);
 
     return rslot;
 }
 
+#if PG_VERSION_NUM >= 140000
+/*
+ * Asynchronous execution under Append. With `async_prefetch` the scans of the
+ * partitions read their blocks ahead in background threads (see
+ * `prefetcher.c`), and Append takes rows from whichever partition has the
+ * next block in memory instead of waiting for each partition in turn.
+ */
+static bool
+tupleIsForeignPathAsyncCapable(ForeignPath *path)
+{
+    struct fdw_options *options = (struct fdw_options *) path->path.parent->fdw_private;
+
+    return options->async_prefetch;
+}
+
+/* Hand the next row over to Append unless it would take waiting for I/O */
+static void
+fetch_tuple_async(AsyncRequest *areq)
+{
+    ForeignScanState *node = (ForeignScanState *) areq->requestee;
+    TupleScanState *fsstate = (TupleScanState *) node->fdw_state;
+    TupleTableSlot *result;
+
+    if (fsstate->storage && !StorageTupleReady(fsstate->storage))
+    {
+        ExecAsyncRequestPending(areq);
+        return;
+    }
+
+    /* the scan node checks the quals and projects the row */
+    result = areq->requestee->ExecProcNodeReal(areq->requestee);
+    ExecAsyncRequestDone(areq, result);
+}
+
+static void
+tupleForeignAsyncRequest(AsyncRequest *areq)
+{
+    fetch_tuple_async(areq);
+}
+
+/* Only scans waiting for the prefetcher are left pending */
+static void
+tupleForeignAsyncConfigureWait(AsyncRequest *areq)
+{
+    ForeignScanState *node = (ForeignScanState *) areq->requestee;
+    TupleScanState *fsstate = (TupleScanState *) node->fdw_state;
+    AppendState    *requestor = (AppendState *) areq->requestor;
+
+    Assert(areq->callback_pending);
+    AddWaitEventToSet(requestor->as_eventset, WL_SOCKET_READABLE,
+                      block_prefetcher_event(fsstate->storage->prefetcher),
+                      NULL, areq);
+}
+
+static void
+tupleForeignAsyncNotify(AsyncRequest *areq)
+{
+    ForeignScanState *node = (ForeignScanState *) areq->requestee;
+    TupleScanState *fsstate = (TupleScanState *) node->fdw_state;
+
+    block_prefetcher_clear_event(fsstate->storage->prefetcher);
+    fetch_tuple_async(areq);
+}
+
+/*
+ * The batch size comes from the table options. Like postgres_fdw we don't
+ * batch when rows have to be returned or passed to row triggers one by one.
+ */
+static int
+tupleGetForeignModifyBatchSize(ResultRelInfo *resultRelInfo)
+{
+    struct fdw_options  options;
+    TriggerDesc        *trigdesc = resultRelInfo->ri_TrigDesc;
+
+    if (resultRelInfo->ri_projectReturning != NULL
+        || (trigdesc && (trigdesc->trig_insert_before_row ||
+                         trigdesc->trig_insert_after_row)))
+        return 1;
+
+    extract_table_options(RelationGetRelid(resultRelInfo->ri_RelationDesc),
+                          &options);
+    return options.batch_size;
+}
+
+/* Insert a batch of rows; each is formed right in the block buffer */
+static TupleTableSlot **
+tupleExecForeignBatchInsert(EState *estate,
+                            ResultRelInfo *resultRelInfo,
+                            TupleTableSlot **slots,
+                            TupleTableSlot **planSlots,
+                            int *numSlots)
+{
+	TupleModifyState *mstate = (TupleModifyState *) resultRelInfo->ri_FdwState;
+    int             i;
+
+    for (i = 0; i < *numSlots; i++)
+    {
+        StorageInsertSlot(mstate->storage, slots[i]);
+        if (mstate->directory)
+            check_segment_rollover(mstate);
+    }
+
+    return slots;
+}
+#endif
+
 static void
 tupleEndForeignModify(EState *estate,
                       ResultRelInfo *resultRelInfo)
 {
-	StorageState *state = (StorageState *) resultRelInfo->ri_FdwState;
+	TupleModifyState *mstate = (TupleModifyState *) resultRelInfo->ri_FdwState;
 
-    StorageRelease(state);
+    end_insert(mstate);
+}
+
+#if PG_VERSION_NUM >= 110000
+/*
+ * COPY FROM and tuple routing into partitions. Rows arrive through
+ * `tupleExecForeignInsert` (or batch insert) just like with INSERT and fill
+ * the blocks of a single storage state, which is flushed at the end.
+ */
+static void
+tupleBeginForeignInsert(ModifyTableState *mtstate,
+                        ResultRelInfo *resultRelInfo)
+{
+    Relation            rel = resultRelInfo->ri_RelationDesc;
+    struct fdw_options  options;
+
+    extract_table_options(RelationGetRelid(rel), &options);
+    resultRelInfo->ri_FdwState = begin_insert(rel, fdw_options_to_list(&options));
+}
+
+static void
+tupleEndForeignInsert(EState *estate,
+                      ResultRelInfo *resultRelInfo)
+{
+	TupleModifyState *mstate = (TupleModifyState *) resultRelInfo->ri_FdwState;
+
+    end_insert(mstate);
+}
+#endif
+
+/*
+ * Retention: remove the segments of a segmented table whose values of the
+ * leading sorted column all precede the given one. Nothing is rewritten, the
+ * segments are simply deleted, so it takes no time regardless of the amount
+ * of data. Only segments whose range the manifest knows are considered.
+ *
+ * Like any file removal this can't be rolled back. Returns the number of rows
+ * removed.
+ */
+PG_FUNCTION_INFO_V1(tuple_fdw_drop_before);
+Datum
+tuple_fdw_drop_before(PG_FUNCTION_ARGS)
+{
+    Oid                 relid = PG_GETARG_OID(0);
+    Datum               key_value = PG_GETARG_DATUM(1);
+    Oid                 key_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+    Relation            rel;
+    struct fdw_options  options;
+    Form_pg_attribute   attr;
+    TypeCacheEntry     *typentry;
+    AclResult           aclresult;
+    List               *manifest;
+    List               *dropped = NIL;
+    ListCell           *lc;
+    int64               ntuples = 0;
+
+    /* keeps scans and writers away until the end of the transaction */
+    rel = relation_open(relid, AccessExclusiveLock);
+    if (rel->rd_rel->relkind != RELKIND_FOREIGN_TABLE
+        || GetFdwRoutineForRelation(rel, false)->GetForeignRelSize != tupleGetForeignRelSize)
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg(ELOG_PREFIX "\"%s\" is not a tuple_fdw table",
+                        RelationGetRelationName(rel))));
+
+    /* the rows are gone for good, so it takes the right to delete them */
+    aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_DELETE);
+    if (aclresult != ACLCHECK_OK)
+#if PG_VERSION_NUM >= 110000
+        aclcheck_error(aclresult, get_relkind_objtype(rel->rd_rel->relkind),
+                       RelationGetRelationName(rel));
+#else
+        aclcheck_error(aclresult, ACL_KIND_CLASS, RelationGetRelationName(rel));
+#endif
+
+    extract_table_options(relid, &options);
+    if (options.directory == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg(ELOG_PREFIX "only tables with the directory option can drop data")));
+    if (options.attrs_sorted == NIL)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg(ELOG_PREFIX "table \"%s\" has no sorted columns",
+                        RelationGetRelationName(rel))));
+
+    attr = TupleDescAttr(RelationGetDescr(rel), linitial_int(options.attrs_sorted) - 1);
+    if (key_type != attr->atttypid)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg(ELOG_PREFIX "key value must be of type %s",
+                        format_type_be(attr->atttypid))));
+
+    typentry = lookup_type_cache(attr->atttypid, TYPECACHE_CMP_PROC_FINFO);
+    if (!OidIsValid(typentry->cmp_proc))
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_FUNCTION),
+                 errmsg(ELOG_PREFIX "could not identify a comparison function for type %s",
+                        format_type_be(attr->atttypid))));
+
+    manifest = manifest_read(options.directory);
+    foreach (lc, segment_list(options.directory))
+    {
+        char           *filename = (char *) lfirst(lc);
+        SegmentInfo    *info = manifest_find(manifest, filename);
+        char           *ptr;
+        Datum           max;
+        bool            isnull;
+
+        /* the entry only counts if it describes all the rows there are */
+        if (info == NULL || info->attnum != attr->attnum || info->range_size == 0
+            || StorageCountTuples(filename) != info->ntuples)
+            continue;
+
+        /* NULLs don't precede anything, so neither do segments having them */
+        if (info->has_nulls)
+            continue;
+
+        ptr = info->range;
+        (void) datumRestore(&ptr, &isnull);
+        max = datumRestore(&ptr, &isnull);
+        if (isnull)
+            continue;
+
+        if (DatumGetInt32(FunctionCall2Coll(&typentry->cmp_proc_finfo,
+                                            attr->attcollation,
+                                            max, key_value)) < 0)
+        {
+            dropped = lappend(dropped, filename);
+            ntuples += info->ntuples;
+        }
+    }
+
+    if (dropped != NIL)
+        segment_remove(options.directory, dropped);
+    relation_close(rel, NoLock);
+
+    PG_RETURN_INT64(ntuples);
 }